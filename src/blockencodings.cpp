@@ -0,0 +1,215 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             header(block.GetBlockHeader()),
+                                                                             vchBlockSig(block.vchBlockSig)
+{
+    FillShortTxIDSelector();
+
+    // The coinbase, and the coinstake of a proof-of-stake block, can never be
+    // in a peer's mempool so they are always sent along
+    size_t nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    if (nPrefilled > block.vtx.size())
+        nPrefilled = block.vtx.size();
+
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        prefilledtxn[i].index = 0; // differential: each directly follows the previous one
+        prefilledtxn[i].tx = block.vtx[i];
+    }
+
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids[i - nPrefilled] = GetShortID(block.vtx[i].GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nonce;
+    uint256 shorttxidhash = ss.GetHash();
+    shorttxidk0 = shorttxidhash.Get64(0);
+    shorttxidk1 = shorttxidhash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<CTransaction>& extra_txn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_CMPCTBLOCK_TXN)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vAvailable.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const CTransaction& tx = cmpctblock.prefilledtxn[i].tx;
+        if (tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        lastprefilledindex += cmpctblock.prefilledtxn[i].index + 1;
+        if (lastprefilledindex > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        if ((uint32_t)lastprefilledindex > cmpctblock.shorttxids.size() + i) {
+            // If we are inserting a tx at an index greater than our full list
+            // of shorttxids plus the number of prefilled txn we've inserted,
+            // then we have txn for which we have neither a prefilled txn or a
+            // shorttxid!
+            return READ_STATUS_INVALID;
+        }
+        txn_available[lastprefilledindex] = tx;
+        vAvailable[lastprefilledindex] = true;
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Calculate map of txids -> positions and check mempool to see what we have (or don't)
+    boost::unordered_map<uint64_t, uint16_t> shorttxids;
+    shorttxids.rehash(cmpctblock.shorttxids.size());
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vAvailable[i + index_offset])
+            index_offset++;
+        if (!shorttxids.insert(std::make_pair(cmpctblock.shorttxids[i], i + index_offset)).second) {
+            // Two transactions of the block share a short ID, no point in
+            // guessing: ask for the full block
+            return READ_STATUS_FAILED;
+        }
+    }
+
+    // Transactions matched from the pool; a second match for the same short ID
+    // means we can't tell which one is right and have to request it instead
+    std::vector<bool> vHaveMatch(txn_available.size(), false);
+    std::vector<bool> vCollision(txn_available.size(), false);
+
+    {
+        LOCK(pool->cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator mi = pool->mapTx.begin(); mi != pool->mapTx.end(); ++mi) {
+            boost::unordered_map<uint64_t, uint16_t>::const_iterator idit = shorttxids.find(cmpctblock.GetShortID(mi->first));
+            if (idit == shorttxids.end())
+                continue;
+            uint16_t nIndex = idit->second;
+            if (!vHaveMatch[nIndex]) {
+                txn_available[nIndex] = mi->second.GetTx();
+                vHaveMatch[nIndex] = true;
+                mempool_count++;
+            } else if (!vCollision[nIndex]) {
+                vCollision[nIndex] = true;
+                mempool_count--;
+            }
+            if (mempool_count == shorttxids.size())
+                break;
+        }
+    }
+
+    BOOST_FOREACH (const CTransaction& tx, extra_txn) {
+        if (tx.IsNull())
+            continue;
+        boost::unordered_map<uint64_t, uint16_t>::const_iterator idit = shorttxids.find(cmpctblock.GetShortID(tx.GetHash()));
+        if (idit == shorttxids.end())
+            continue;
+        uint16_t nIndex = idit->second;
+        if (!vHaveMatch[nIndex]) {
+            txn_available[nIndex] = tx;
+            vHaveMatch[nIndex] = true;
+            extra_count++;
+        } else if (!vCollision[nIndex] && txn_available[nIndex].GetHash() != tx.GetHash()) {
+            // The same transaction may well be in both the mempool and the
+            // extra pool, only a different one is a collision
+            vCollision[nIndex] = true;
+        }
+    }
+
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vHaveMatch[i] && !vCollision[i])
+            vAvailable[i] = true;
+        else if (vCollision[i])
+            txn_available[i] = CTransaction();
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return vAvailable[index];
+}
+
+std::vector<uint16_t> PartiallyDownloadedBlock::GetMissingIndexes() const
+{
+    std::vector<uint16_t> vIndexes;
+    for (size_t i = 0; i < vAvailable.size(); i++) {
+        if (!vAvailable[i])
+            vIndexes.push_back(i);
+    }
+    return vIndexes;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    uint256 hash = header.GetHash();
+    block = header;
+    block.vtx.resize(txn_available.size());
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!vAvailable[i]) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[tx_missing_offset++];
+        } else {
+            block.vtx[i] = txn_available[i];
+        }
+    }
+    block.vchBlockSig = vchBlockSig;
+
+    // Make sure we can't call FillBlock again.
+    header.SetNull();
+    txn_available.clear();
+    vAvailable.clear();
+
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A merkle mismatch is most likely a short ID collision against the
+    // mempool rather than a malicious peer, so fall back to a full block
+    bool mutated = false;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool (incl at least %lu from extra pool) and %lu txn requested\n", hash.ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
+    if (vtx_missing.size() < 5) {
+        BOOST_FOREACH (const CTransaction& tx, vtx_missing)
+            LogPrint("cmpctblock", "Reconstructed block %s required tx %s\n", hash.ToString(), tx.GetHash().ToString());
+    }
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,197 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdexcept>
+#include <vector>
+
+class CTxMemPool;
+
+/** Version of the compact block encoding announced in "sendcmpct" */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Number of recently seen orphan/rejected transactions kept around for block reconstruction */
+static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
+
+/** Upper bound on the number of transactions in a block, bounds every decoded count and index */
+static const unsigned int MAX_CMPCTBLOCK_TXN = MAX_BLOCK_SIZE / 60;
+
+/** A transaction sent along with the compact block, at a differentially encoded position */
+struct PrefilledTransaction {
+    // Used as an offset since last prefilled tx in CBlockHeaderAndShortTxIDs,
+    // as a proper transaction-in-block-index in PartiallyDownloadedBlock
+    uint16_t index;
+    CTransaction tx;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        uint64_t nIndex = index;
+        READWRITE(COMPACTSIZE(nIndex));
+        if (nIndex > MAX_CMPCTBLOCK_TXN)
+            throw std::ios_base::failure("index overflowed 16 bits");
+        index = nIndex;
+        READWRITE(tx);
+    }
+};
+
+/**
+ * A block announced as its header plus 6 byte short IDs for every transaction
+ * the receiver is expected to have in its mempool. The coinbase and, for
+ * proof-of-stake blocks, the coinstake are always sent in full since no peer
+ * can have seen them, and the block signature travels with the header so the
+ * reconstructed block can be checked exactly like a "block" message.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(header);
+        READWRITE(nonce);
+
+        uint64_t nShortTxIDs = shorttxids.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (nShortTxIDs > MAX_CMPCTBLOCK_TXN)
+            throw std::ios_base::failure("short txid count out of range");
+        shorttxids.resize(nShortTxIDs);
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            READWRITE(lsb);
+            READWRITE(msb);
+            if (ser_action.ForRead())
+                shorttxids[i] = (uint64_t(msb) << 32) | uint64_t(lsb);
+        }
+
+        READWRITE(prefilledtxn);
+        READWRITE(vchBlockSig);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** Asks for the transactions of a compact block the receiver could not find */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+
+        // Indexes are ascending, each is sent as the distance to the previous one
+        uint64_t nCount = indexes.size();
+        READWRITE(COMPACTSIZE(nCount));
+        if (nCount > MAX_CMPCTBLOCK_TXN)
+            throw std::ios_base::failure("index count out of range");
+        indexes.resize(nCount);
+
+        uint64_t nOffset = 0;
+        for (size_t i = 0; i < indexes.size(); i++) {
+            uint64_t nDiff = indexes[i] - nOffset;
+            READWRITE(COMPACTSIZE(nDiff));
+            nOffset += nDiff;
+            if (nOffset >= MAX_CMPCTBLOCK_TXN)
+                throw std::ios_base::failure("index overflowed 16 bits");
+            indexes[i] = nOffset;
+            nOffset++;
+        }
+    }
+};
+
+/** Answer to a BlockTransactionsRequest, transactions in the requested order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    explicit BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  // Failed to process object, fall back to a full block request
+};
+
+/**
+ * Reconstructs a block from a compact announcement, the mempool and a small
+ * pool of extra recently seen transactions.
+ */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vAvailable;
+    size_t prefilled_count, mempool_count, extra_count;
+    CTxMemPool* pool;
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) : prefilled_count(0), mempool_count(0), extra_count(0), pool(poolIn) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<CTransaction>& extra_txn);
+    bool IsTxAvailable(size_t index) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing);
+
+    /** Indexes of the transactions that still have to be fetched with "getblocktxn" */
+    std::vector<uint16_t> GetMissingIndexes() const;
+    bool IsInitialized() const { return !header.IsNull(); }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
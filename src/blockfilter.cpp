@@ -0,0 +1,217 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+//! Key of the element hashes, fixed so that a wallet hashes its elements once
+static const uint64_t BLOCKFILTER_K0 = 0x6c79726166696c74ULL;
+static const uint64_t BLOCKFILTER_K1 = 0x6572626c6f636b73ULL;
+
+/** Upper 64 bits of the 128 bit product a * b */
+static uint64_t MulHigh64(uint64_t a, uint64_t b)
+{
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+}
+
+/** Map a hash into [0, nRange), keeping the order of the hashes */
+static inline uint64_t ReduceHash(uint64_t nHash, uint64_t nRange)
+{
+    return MulHigh64(nHash, nRange);
+}
+
+uint64_t BlockFilterHash(const unsigned char* pbegin, const unsigned char* pend)
+{
+    return SipHash(BLOCKFILTER_K0, BLOCKFILTER_K1, pbegin, pend - pbegin);
+}
+
+uint64_t BlockFilterHash(const COutPoint& outpoint)
+{
+    unsigned char data[36];
+    memcpy(data, outpoint.hash.begin(), 32);
+    for (int i = 0; i < 4; i++)
+        data[32 + i] = (outpoint.n >> (8 * i)) & 0xff;
+    return BlockFilterHash(data, data + sizeof(data));
+}
+
+namespace
+{
+class CBitWriter
+{
+private:
+    std::vector<unsigned char>& vch;
+    int nOffset; //! bits used in the last byte, 8 when it is full
+
+public:
+    CBitWriter(std::vector<unsigned char>& vchIn) : vch(vchIn), nOffset(8) {}
+
+    void Write(uint64_t nValue, int nBits)
+    {
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                vch.push_back(0);
+                nOffset = 0;
+            }
+            int nTake = std::min(8 - nOffset, nBits);
+            unsigned char nChunk = (nValue >> (nBits - nTake)) & ((1 << nTake) - 1);
+            vch.back() |= nChunk << (8 - nOffset - nTake);
+            nOffset += nTake;
+            nBits -= nTake;
+        }
+    }
+};
+
+class CBitReader
+{
+private:
+    const std::vector<unsigned char>& vch;
+    size_t nPos; //! bits read so far
+
+public:
+    CBitReader(const std::vector<unsigned char>& vchIn) : vch(vchIn), nPos(0) {}
+
+    bool Read(int nBits, uint64_t& nValueRet)
+    {
+        if (nPos + nBits > vch.size() * 8)
+            return false;
+        nValueRet = 0;
+        while (nBits > 0) {
+            int nOffset = nPos % 8;
+            int nTake = std::min(8 - nOffset, nBits);
+            unsigned char nChunk = (vch[nPos / 8] >> (8 - nOffset - nTake)) & ((1 << nTake) - 1);
+            nValueRet = (nValueRet << nTake) | nChunk;
+            nPos += nTake;
+            nBits -= nTake;
+        }
+        return true;
+    }
+};
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block) : nElements(0)
+{
+    std::vector<uint64_t> vHashes;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTxOut& txout, tx.vout) {
+            CScript::const_iterator pc = txout.scriptPubKey.begin();
+            opcodetype opcode;
+            std::vector<unsigned char> vch;
+            while (pc < txout.scriptPubKey.end()) {
+                if (!txout.scriptPubKey.GetOp(pc, opcode, vch))
+                    break;
+                if (!vch.empty())
+                    vHashes.push_back(BlockFilterHash(&vch[0], &vch[0] + vch.size()));
+            }
+        }
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            vHashes.push_back(BlockFilterHash(txin.prevout));
+    }
+    std::sort(vHashes.begin(), vHashes.end());
+    vHashes.erase(std::unique(vHashes.begin(), vHashes.end()), vHashes.end());
+
+    nElements = vHashes.size();
+    uint64_t nRange = GetRange();
+    CBitWriter writer(vchData);
+    uint64_t nLast = 0;
+    BOOST_FOREACH (uint64_t nHash, vHashes) {
+        uint64_t nValue = ReduceHash(nHash, nRange);
+        uint64_t nDelta = nValue - nLast;
+        nLast = nValue;
+        // Golomb-Rice: the quotient in unary, then GOLOMB_P remainder bits
+        for (uint64_t q = nDelta >> GOLOMB_P; q > 0; q--)
+            writer.Write(1, 1);
+        writer.Write(0, 1);
+        writer.Write(nDelta, GOLOMB_P);
+    }
+}
+
+std::vector<uint64_t> CBlockFilter::Decode() const
+{
+    std::vector<uint64_t> vValues;
+    vValues.reserve(nElements);
+    CBitReader reader(vchData);
+    uint64_t nLast = 0;
+    for (uint32_t i = 0; i < nElements; i++) {
+        uint64_t q = 0;
+        uint64_t nBit;
+        while (true) {
+            if (!reader.Read(1, nBit))
+                return vValues;
+            if (!nBit)
+                break;
+            q++;
+        }
+        uint64_t r;
+        if (!reader.Read(GOLOMB_P, r))
+            return vValues;
+        nLast += (q << GOLOMB_P) + r;
+        vValues.push_back(nLast);
+    }
+    return vValues;
+}
+
+void CBlockFilterQuery::Add(const std::vector<unsigned char>& vch)
+{
+    if (!vch.empty())
+        vHashes.push_back(BlockFilterHash(&vch[0], &vch[0] + vch.size()));
+}
+
+void CBlockFilterQuery::Add(const COutPoint& outpoint)
+{
+    vHashes.push_back(BlockFilterHash(outpoint));
+}
+
+void CBlockFilterQuery::Sort()
+{
+    std::sort(vHashes.begin(), vHashes.end());
+    vHashes.erase(std::unique(vHashes.begin(), vHashes.end()), vHashes.end());
+}
+
+namespace
+{
+struct CompareReduced {
+    uint64_t nRange;
+    CompareReduced(uint64_t nRangeIn) : nRange(nRangeIn) {}
+    bool operator()(uint64_t nHash, uint64_t nValue) const
+    {
+        return ReduceHash(nHash, nRange) < nValue;
+    }
+};
+}
+
+bool CBlockFilterQuery::Match(const CBlockFilter& filter) const
+{
+    if (vHashes.empty() || filter.GetElementCount() == 0)
+        return false;
+
+    // reducing keeps the order, so the hashes of the query are sorted by
+    // their value in this filter too and both can be walked together
+    uint64_t nRange = filter.GetRange();
+    std::vector<uint64_t> vValues = filter.Decode();
+    std::vector<uint64_t>::const_iterator it = vHashes.begin();
+    BOOST_FOREACH (uint64_t nValue, vValues) {
+        it = std::lower_bound(it, vHashes.end(), nValue, CompareReduced(nRange));
+        if (it == vHashes.end())
+            return false;
+        if (ReduceHash(*it, nRange) == nValue)
+            return true;
+    }
+    return false;
+}
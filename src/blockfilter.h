@@ -0,0 +1,77 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class COutPoint;
+
+/**
+ * Golomb-coded set of the data pushed by a block's output scripts and of the
+ * outpoints spent by its inputs. A wallet can tell from it whether a block may
+ * pay or spend one of its coins without reading the block. Elements are hashed
+ * with a fixed key so that a query is hashed once for all blocks.
+ */
+class CBlockFilter
+{
+private:
+    uint32_t nElements;
+    std::vector<unsigned char> vchData;
+
+public:
+    //! Golomb-Rice parameter and inverse false positive rate, as in BIP 158
+    static const int GOLOMB_P = 19;
+    static const uint64_t GOLOMB_M = 784931;
+
+    CBlockFilter() : nElements(0) {}
+    explicit CBlockFilter(const CBlock& block);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(nElements));
+        READWRITE(vchData);
+    }
+
+    uint32_t GetElementCount() const { return nElements; }
+
+    //! Range the element hashes of this filter are mapped into
+    uint64_t GetRange() const { return (uint64_t)nElements * GOLOMB_M; }
+
+    //! Values of the set in increasing order
+    std::vector<uint64_t> Decode() const;
+};
+
+/** Hash of a filter element, the same for every block */
+uint64_t BlockFilterHash(const unsigned char* pbegin, const unsigned char* pend);
+uint64_t BlockFilterHash(const COutPoint& outpoint);
+
+/**
+ * The elements a wallet looks for in block filters, kept as sorted hashes.
+ * A filter is matched with one binary search per filter value. Call Sort()
+ * after adding elements; a sorted query can be matched from several threads.
+ */
+class CBlockFilterQuery
+{
+private:
+    std::vector<uint64_t> vHashes;
+
+public:
+    void Add(const std::vector<unsigned char>& vch);
+    void Add(const COutPoint& outpoint);
+    void Sort();
+    bool IsEmpty() const { return vHashes.empty(); }
+
+    bool Match(const CBlockFilter& filter) const;
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
@@ -58,6 +58,8 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 CDBEnv::~CDBEnv()
 {
     EnvShutdown();
+    for (map<string, CDBJournal*>::iterator it = mapJournal.begin(); it != mapJournal.end(); ++it)
+        delete it->second;
 }
 
 void CDBEnv::Close()
@@ -218,7 +220,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL), pjournal(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -273,6 +275,10 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
             bitdb.mapDb[strFile] = pdb;
         }
+
+        map<string, CDBJournal*>::iterator it = bitdb.mapJournal.find(strFile);
+        if (it != bitdb.mapJournal.end())
+            pjournal = it->second;
     }
 }
 
@@ -298,7 +304,9 @@ void CDB::Close()
     activeTxn = NULL;
     pdb = NULL;
 
-    Flush();
+    // with a journal the log is checkpointed when the journal is committed
+    if (!pjournal)
+        Flush();
 
     {
         LOCK(bitdb.cs_db);
@@ -306,6 +314,30 @@ void CDB::Close()
     }
 }
 
+bool CDB::CommitJournal(bool fSync)
+{
+    if (!pdb)
+        return false;
+    // the explicit transaction is committed by its owner, after the journal was committed by TxnBegin
+    if (activeTxn)
+        return true;
+    if (!pjournal)
+        return !fSync || bitdb.dbenv.log_flush(NULL) == 0;
+    if (!pjournal->Commit(pdb, bitdb.dbenv, fSync))
+        return false;
+
+    // Move the log to the dat file once it has grown, as Close would have done
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100) * 1024, 0, 0);
+    return true;
+}
+
+void CDBEnv::EnableJournal(const string& strFile)
+{
+    LOCK(cs_db);
+    if (!mapJournal.count(strFile))
+        mapJournal[strFile] = new CDBJournal();
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -413,6 +445,82 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 }
 
 
+void CDBJournal::Write(const CSerializeData& vchKey, const CSerializeData& vchValue)
+{
+    LOCK(cs_journal);
+    mapPending[vchKey] = make_pair(true, vchValue);
+}
+
+void CDBJournal::Erase(const CSerializeData& vchKey)
+{
+    LOCK(cs_journal);
+    mapPending[vchKey] = make_pair(false, CSerializeData());
+}
+
+CDBJournal::ReadResult CDBJournal::Read(const CSerializeData& vchKey, CSerializeData& vchValue) const
+{
+    LOCK(cs_journal);
+    EntryMap::const_iterator it = mapPending.find(vchKey);
+    if (it == mapPending.end()) {
+        it = mapCommitting.find(vchKey);
+        if (it == mapCommitting.end())
+            return NOT_FOUND;
+    }
+    if (!it->second.first)
+        return ERASED;
+    vchValue = it->second.second;
+    return FOUND;
+}
+
+bool CDBJournal::Commit(Db* pdb, DbEnv& dbenv, bool fSync)
+{
+    LOCK(cs_commit);
+    {
+        LOCK(cs_journal);
+        mapCommitting.swap(mapPending);
+    }
+
+    bool fSuccess = true;
+    if (!mapCommitting.empty()) {
+        int64_t nStart = GetTimeMillis();
+        DbTxn* ptxn = NULL;
+        fSuccess = (dbenv.txn_begin(NULL, &ptxn, DB_TXN_WRITE_NOSYNC) == 0 && ptxn);
+        for (EntryMap::iterator it = mapCommitting.begin(); fSuccess && it != mapCommitting.end(); ++it) {
+            CSerializeData& vchKey = const_cast<CSerializeData&>(it->first);
+            CSerializeData& vchValue = it->second.second;
+            Dbt datKey(&vchKey[0], vchKey.size());
+            if (it->second.first) {
+                Dbt datValue(vchValue.empty() ? NULL : &vchValue[0], vchValue.size());
+                fSuccess = (pdb->put(ptxn, &datKey, &datValue, 0) == 0);
+            } else {
+                int ret = pdb->del(ptxn, &datKey, 0);
+                fSuccess = (ret == 0 || ret == DB_NOTFOUND);
+            }
+        }
+        if (ptxn) {
+            if (fSuccess)
+                fSuccess = (ptxn->commit(0) == 0);
+            else
+                ptxn->abort();
+        }
+        LogPrint("db", "CDBJournal::Commit : %u writes %s in %dms\n", mapCommitting.size(), fSuccess ? "committed" : "failed", GetTimeMillis() - nStart);
+    }
+    if (fSuccess && fSync)
+        fSuccess = (dbenv.log_flush(NULL) == 0);
+
+    {
+        LOCK(cs_journal);
+        if (!fSuccess) {
+            // keep what could not be committed, behind the writes made since
+            for (EntryMap::iterator it = mapPending.begin(); it != mapPending.end(); ++it)
+                mapCommitting[it->first] = it->second;
+            mapPending.swap(mapCommitting);
+        }
+        mapCommitting.clear();
+    }
+    return fSuccess;
+}
+
 void CDBEnv::Flush(bool fShutdown)
 {
     int64_t nStart = GetTimeMillis();
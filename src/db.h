@@ -30,6 +30,38 @@ extern unsigned int nWalletDBUpdated;
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 
 
+/**
+ * Writes to a database that are kept in memory and committed later, many of
+ * them in one transaction. Only the last write of a key is kept. Reads of the
+ * database look here first, so the writes are seen before they are committed.
+ */
+class CDBJournal
+{
+private:
+    //! serialized value of each key, or no value when the key is erased
+    typedef std::map<CSerializeData, std::pair<bool, CSerializeData> > EntryMap;
+
+    mutable CCriticalSection cs_journal;
+    EntryMap mapPending;
+    //! writes being committed, still to be seen by reads
+    EntryMap mapCommitting;
+    //! one commit at a time
+    CCriticalSection cs_commit;
+
+public:
+    enum ReadResult { NOT_FOUND,
+        FOUND,
+        ERASED };
+
+    void Write(const CSerializeData& vchKey, const CSerializeData& vchValue);
+    void Erase(const CSerializeData& vchKey);
+    ReadResult Read(const CSerializeData& vchKey, CSerializeData& vchValue) const;
+
+    /** Write the pending entries to pdb in one transaction, and flush the log to disk if fSync */
+    bool Commit(Db* pdb, DbEnv& dbenv, bool fSync);
+};
+
+
 class CDBEnv
 {
 private:
@@ -46,6 +78,7 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CDBJournal*> mapJournal;
 
     CDBEnv();
     ~CDBEnv();
@@ -78,6 +111,8 @@ public:
     void CheckpointLSN(const std::string& strFile);
 
     void CloseDb(const std::string& strFile);
+    //! Keep the writes to strFile in a journal committed by CDB::CommitJournal
+    void EnableJournal(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
@@ -101,6 +136,7 @@ protected:
     std::string strFile;
     DbTxn* activeTxn;
     bool fReadOnly;
+    CDBJournal* pjournal;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
     ~CDB() { Close(); }
@@ -108,6 +144,8 @@ protected:
 public:
     void Flush();
     void Close();
+    //! Commit the journal of this database, if it has one. fSync also flushes the log to disk.
+    bool CommitJournal(bool fSync = false);
 
 private:
     CDB(const CDB&);
@@ -124,6 +162,24 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        // Writes not committed yet
+        if (pjournal) {
+            CSerializeData vchValue;
+            CDBJournal::ReadResult result = pjournal->Read(CSerializeData(ssKey.begin(), ssKey.end()), vchValue);
+            if (result == CDBJournal::ERASED)
+                return false;
+            if (result == CDBJournal::FOUND) {
+                try {
+                    CDataStream ssValue(vchValue, SER_DISK, CLIENT_VERSION);
+                    ssValue >> value;
+                } catch (const std::exception&) {
+                    return false;
+                }
+                return true;
+            }
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -160,12 +216,21 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        // Leave it to the next commit of the journal, outside of explicit transactions
+        if (pjournal && !activeTxn) {
+            if (!fOverwrite && Exists(key))
+                return false;
+            pjournal->Write(CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end()));
+            return true;
+        }
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -189,6 +254,12 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pjournal && !activeTxn) {
+            pjournal->Erase(CSerializeData(ssKey.begin(), ssKey.end()));
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -209,6 +280,14 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pjournal) {
+            CSerializeData vchValue;
+            CDBJournal::ReadResult result = pjournal->Read(CSerializeData(ssKey.begin(), ssKey.end()), vchValue);
+            if (result != CDBJournal::NOT_FOUND)
+                return (result == CDBJournal::FOUND);
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -223,6 +302,9 @@ protected:
     {
         if (!pdb)
             return NULL;
+        // a cursor only sees committed writes
+        if (pjournal && !CommitJournal())
+            return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
@@ -272,6 +354,9 @@ public:
     {
         if (!pdb || activeTxn)
             return false;
+        // the journal must not overwrite the writes of the transaction later
+        if (pjournal && !CommitJournal())
+            return false;
         DbTxn* ptxn = bitdb.TxnBegin();
         if (!ptxn)
             return false;
@@ -285,6 +370,9 @@ public:
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
+        // the transaction was begun without sync, and with a journal Close() no longer flushes
+        if (ret == 0 && pjournal)
+            ret = bitdb.dbenv.log_flush(NULL);
         return (ret == 0);
     }
 
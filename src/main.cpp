@@ -9,6 +9,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -62,6 +63,7 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
+bool fHeadersFirstSync = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
@@ -161,6 +163,55 @@ struct QueuedBlock {
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+/** A block downloaded ahead of its parent during headers-first sync. */
+struct CBlockAwaitingParent {
+    boost::shared_ptr<CBlock> pblock;
+    NodeId nodeid;
+};
+/** Blocks waiting for their parent to be accepted, by hash and by parent hash. Protected by cs_main. */
+map<uint256, CBlockAwaitingParent> mapBlocksAwaitingParent;
+multimap<uint256, uint256> mapBlocksAwaitingParentByPrev;
+
+// Requires cs_main.
+void static EraseBlockAwaitingParent(map<uint256, CBlockAwaitingParent>::iterator it)
+{
+    uint256 hash = it->first;
+    std::pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(it->second.pblock->hashPrevBlock);
+    for (multimap<uint256, uint256>::iterator itPrev = range.first; itPrev != range.second; ++itPrev) {
+        if (itPrev->second == hash) {
+            mapBlocksAwaitingParentByPrev.erase(itPrev);
+            break;
+        }
+    }
+    mapBlocksAwaitingParent.erase(it);
+}
+
+/** Drop the blocks waiting on an invalid block, and their descendants. Requires cs_main. */
+void static EraseBlocksAwaitingParent(const uint256& hashParent)
+{
+    std::deque<uint256> queue(1, hashParent);
+    while (!queue.empty()) {
+        std::pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(queue.front());
+        for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+            if (mapBlocksAwaitingParent.erase(it->second))
+                queue.push_back(it->second);
+        }
+        mapBlocksAwaitingParentByPrev.erase(range.first, range.second);
+        queue.pop_front();
+    }
+}
+
+/** Drop the blocks a peer sent ahead of their parent; they are requested again from others. Requires cs_main. */
+void static EraseBlocksAwaitingParentFrom(NodeId nodeid)
+{
+    map<uint256, CBlockAwaitingParent>::iterator it = mapBlocksAwaitingParent.begin();
+    while (it != mapBlocksAwaitingParent.end()) {
+        map<uint256, CBlockAwaitingParent>::iterator itErase = it++;
+        if (itErase->second.nodeid == nodeid)
+            EraseBlockAwaitingParent(itErase);
+    }
+}
+
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
@@ -286,6 +337,13 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Number of times this peer held up the block download window.
+    int nStalls;
+    //! Last header accepted from this peer before headers sync waited for the blocks to catch up.
+    CBlockIndex* pindexHeadersPaused;
+    //! Compact block we are waiting on "blocktxn" for, and its hash.
+    boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+    uint256 hashPartialBlock;
 
     CNodeState()
     {
@@ -299,6 +357,9 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        nStalls = 0;
+        pindexHeadersPaused = NULL;
+        hashPartialBlock = 0;
     }
 };
 
@@ -359,13 +420,14 @@ void FinalizeNode(NodeId nodeid)
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    EraseBlocksAwaitingParentFrom(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
 }
 
-// Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+// Requires cs_main. nodeFrom is the peer that delivered the block, if any.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
@@ -374,6 +436,9 @@ void MarkBlockAsReceived(const uint256& hash)
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        // a peer that delivers what it was asked for gets its earlier stall forgiven
+        if (itInFlight->second.first == nodeFrom)
+            state->nStalls = 0;
         mapBlocksInFlight.erase(itInFlight);
     }
 }
@@ -511,6 +576,9 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapBlocksAwaitingParent.count(pindex->GetBlockHash())) {
+                // Already downloaded, waiting for its parent.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -585,6 +653,28 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
+CBlockFilterDB* pblockfilterdb = NULL;
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// vExtraTxnForCompact
+//
+
+/** Recent orphan and rejected transactions, a ring buffer consulted when reconstructing compact blocks. Requires cs_main. */
+static std::vector<CTransaction> vExtraTxnForCompact;
+static size_t nExtraTxnForCompactIt = 0;
+
+/** Most recent block announced as a compact block, answers "getblocktxn" without a disk read */
+static CCriticalSection cs_recentCompactBlock;
+static boost::shared_ptr<const CBlock> pRecentCompactBlock;
+
+void static AddToCompactExtraTransactions(const CTransaction& tx)
+{
+    if (vExtraTxnForCompact.empty())
+        vExtraTxnForCompact.resize(DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN);
+    vExtraTxnForCompact[nExtraTxnForCompactIt] = tx;
+    nExtraTxnForCompactIt = (nExtraTxnForCompactIt + 1) % vExtraTxnForCompact.size();
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -885,10 +975,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()) {
-            sigs = (*i).second.CountSignatures();
-        }
+        sigs = swiftTXManager.GetSignatures(nTXHash);
         if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
             return nSwiftTXDepth + nResult;
         }
@@ -899,12 +986,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 
 int GetIXConfirmations(uint256 nTXHash)
 {
-    int sigs = 0;
-
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()) {
-        sigs = (*i).second.CountSignatures();
-    }
+    int sigs = swiftTXManager.GetSignatures(nTXHash);
     if (sigs >= SWIFTTX_SIGNATURES_REQUIRED) {
         return nSwiftTXDepth;
     }
@@ -1115,14 +1197,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLocked;
+    if (swiftTXManager.GetConflictingLock(tx, hashLocked)) {
+        return state.DoS(0,
+            error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -1303,14 +1382,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- swiftTX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 hashLocked;
+    if (swiftTXManager.GetConflictingLock(tx, hashLocked)) {
+        return state.DoS(0,
+            error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+            REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -2486,6 +2562,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    // a missing filter only costs a later rescan a block read, so failing to write one is not fatal
+    if (pblockfilterdb && !pblockfilterdb->WriteFilter(pindex->GetBlockHash(), CBlockFilter(block)))
+        LogPrintf("ConnectBlock() : failed to write block filter for %s\n", pindex->GetBlockHash().ToString());
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2999,11 +3079,33 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock)
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            // Peers that asked for compact blocks get the new tip pushed directly,
+            // serialized once; that needs the block itself, so it is only done
+            // when it was just handed to us
+            CInv invNewTip(MSG_BLOCK, hashNewTip);
+            CSharedMessage cmpctBlockMessage;
+            if (pblock && pblock->GetHash() == hashNewTip) {
+                cmpctBlockMessage = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+                LOCK(cs_recentCompactBlock);
+                pRecentCompactBlock.reset(new CBlock(*pblock));
+            }
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (cmpctBlockMessage && pnode->fPreferHeaderAndIDs) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = !pnode->setInventoryKnown.insert(invNewTip).second;
+                        }
+                        if (!fKnown)
+                            pnode->PushSharedMessage(cmpctBlockMessage);
+                    } else {
+                        pnode->PushInventory(invNewTip);
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
@@ -3088,6 +3190,58 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/** Compute the chain trust, entropy bit and stake modifier of a block index entry with a known parent. */
+void static SetBlockIndexStakeData(CBlockIndex* pindexNew)
+{
+    uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute chain trust score
+    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("%s : SetStakeEntropyBit() failed \n", __func__);
+
+    // ppcoin: record proof-of-stake hash value
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("%s : hashProofOfStake not found in map \n", __func__);
+        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("%s : ComputeNextStakeModifier() failed \n", __func__);
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("%s : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", __func__, pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+}
+
+/**
+ * A block index entry created from a header during headers-first sync knows
+ * nothing about the coinstake, and its stake modifier was derived from
+ * ancestors in the same state. Fill in the proof-of-stake data once the block
+ * itself arrives; blocks are accepted in chain order, so the parent is
+ * already complete.
+ */
+void static UpdateBlockIndexStakeData(CBlockIndex* pindex, const CBlock& block)
+{
+    if (block.IsProofOfStake()) {
+        pindex->SetProofOfStake();
+        pindex->prevoutStake = block.vtx[1].vin[0].prevout;
+        pindex->nStakeTime = block.nTime;
+        setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    if (pindex->pprev) {
+        pindex->nFlags &= ~CBlockIndex::BLOCK_STAKE_MODIFIER;
+        SetBlockIndexStakeData(pindex);
+    }
+    setDirtyBlockIndex.insert(pindex);
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -3119,29 +3273,9 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+        // Entries created from a header alone get their stake data once the block arrives
+        if (!block.vtx.empty())
+            SetBlockIndexStakeData(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -3362,15 +3496,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
-                BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                    if (mapLockedInputs.count(in.prevout)) {
-                        if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 hashLocked;
+                if (swiftTXManager.GetConflictingLock(tx, hashLocked)) {
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", hashLocked.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                        REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -3463,6 +3594,31 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
     return true;
 }
 
+/** Whether a header at nHeight is further ahead of the active chain than headers-first sync goes. Requires cs_main. */
+bool static HeaderTooFarAhead(int nHeight)
+{
+    return nHeight > chainActive.Height() + MAX_HEADERS_AHEAD_OF_TIP;
+}
+
+/**
+ * The part of CheckWork() a header alone can show: the difficulty target and,
+ * while blocks were still mined, the proof of work. The stake kernel needs the
+ * coinstake and is checked once the block arrives.
+ */
+bool static CheckHeaderWork(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
+{
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block) &&
+        !(block.nTime == (uint32_t)Params().LyraBadBlockTime() && block.nBits == (uint32_t)Params().LyraBadBlockBits()))
+        return state.DoS(100, error("%s : incorrect proof of work at %d", __func__, pindexPrev->nHeight + 1),
+            REJECT_INVALID, "bad-diffbits");
+
+    if (pindexPrev->nHeight + 1 <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(block.GetHash(), block.nBits))
+        return state.DoS(50, error("%s : proof of work failed", __func__),
+            REJECT_INVALID, "high-hash");
+
+    return true;
+}
+
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* const pindexPrev)
 {
     uint256 hash = block.GetHash();
@@ -3570,9 +3726,23 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
             return state.DoS(100, error("%s : prev block invalid", __func__), REJECT_INVALID, "bad-prevblk");
     }
 
+    // A header alone proves no stake, so only take headers on top of the
+    // last checkpoint, and not too far ahead of the blocks we have
+    if (block.vtx.empty() && pindexPrev) {
+        if (HeaderTooFarAhead(pindexPrev->nHeight + 1))
+            return state.DoS(0, error("%s : header %d too far ahead of the chain", __func__, pindexPrev->nHeight + 1), 0, "too-far-ahead");
+        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+        if (pcheckpoint && pindexPrev->nHeight >= pcheckpoint->nHeight && pindexPrev->GetAncestor(pcheckpoint->nHeight) != pcheckpoint)
+            return state.DoS(0, error("%s : header does not descend from the last checkpoint (height %d)", __func__, pcheckpoint->nHeight));
+    }
+
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
+    // Headers-first sync accepts headers well ahead of their blocks
+    if (pindexPrev && !CheckHeaderWork(block, state, pindexPrev))
+        return false;
+
     if (pindex == NULL)
         pindex = AddToBlockIndex(block);
 
@@ -3602,6 +3772,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
     if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
         return false;
 
+    bool fKnownHeader = mapBlockIndex.count(block.GetHash()) != 0;
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
@@ -3611,6 +3782,9 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    if (fKnownHeader)
+        UpdateBlockIndexStakeData(pindex, block);
+
     if ((!CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3702,7 +3876,25 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+// Requires cs_main.
+void static AddBlockAwaitingParent(const CBlock& block, NodeId nodeid)
+{
+    uint256 hash = block.GetHash();
+    if (mapBlocksAwaitingParent.count(hash))
+        return;
+    if (mapBlocksAwaitingParent.size() >= MAX_BLOCKS_AWAITING_PARENT) {
+        // Not in flight and not stored, so it will simply be requested again later
+        LogPrint("net", "%s : too many blocks awaiting their parent, dropping %s\n", __func__, hash.ToString());
+        return;
+    }
+
+    CBlockAwaitingParent& entry = mapBlocksAwaitingParent[hash];
+    entry.pblock.reset(new CBlock(block));
+    entry.nodeid = nodeid;
+    mapBlocksAwaitingParentByPrev.insert(make_pair(block.hashPrevBlock, hash));
+}
+
+bool static AcceptNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
     // Preliminary checks
     bool checked = CheckBlock(*pblock, state);
@@ -3733,11 +3925,21 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
             continue;
         }
 
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         if (!checked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
 
+        // Blocks are downloaded in parallel but have to be accepted in chain
+        // order, the stake checks need a complete parent
+        if (dbp == NULL) {
+            BlockMap::iterator miPrev = mapBlockIndex.find(pblock->hashPrevBlock);
+            if (miPrev != mapBlockIndex.end() && !(miPrev->second->nStatus & (BLOCK_HAVE_DATA | BLOCK_FAILED_MASK))) {
+                AddBlockAwaitingParent(*pblock, pfrom ? pfrom->GetId() : -1);
+                return true;
+            }
+        }
+
         // Store to disk
         CBlockIndex* pindex = NULL;
         bool ret = AcceptBlock(*pblock, state, &pindex, dbp);
@@ -3771,8 +3973,61 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
             pwalletMain->AutoCombineDust();
     }
 
-    LogPrintf("%s : ACCEPTED\n", __func__);
+    LogPrintf("ProcessNewBlock : ACCEPTED\n");
+
+    return true;
+}
+
+/** Accept the blocks that were downloaded ahead of hashParent, and their descendants, in chain order */
+void static ProcessBlocksAwaitingParent(const uint256& hashParent)
+{
+    std::deque<uint256> queue(1, hashParent);
+    while (!queue.empty()) {
+        std::vector<CBlockAwaitingParent> vChildren;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(queue.front());
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                std::pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksAwaitingParentByPrev.equal_range(queue.front());
+                for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+                    map<uint256, CBlockAwaitingParent>::iterator itBlock = mapBlocksAwaitingParent.find(it->second);
+                    if (itBlock == mapBlocksAwaitingParent.end())
+                        continue;
+                    vChildren.push_back(itBlock->second);
+                    mapBlocksAwaitingParent.erase(itBlock);
+                }
+                mapBlocksAwaitingParentByPrev.erase(range.first, range.second);
+            }
+        }
+        queue.pop_front();
+
+        BOOST_FOREACH (const CBlockAwaitingParent& child, vChildren) {
+            CValidationState state;
+            if (AcceptNewBlock(state, NULL, child.pblock.get(), NULL))
+                queue.push_back(child.pblock->GetHash());
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                LOCK(cs_main);
+                EraseBlocksAwaitingParent(child.pblock->GetHash());
+                if (nDoS > 0)
+                    Misbehaving(child.nodeid, nDoS);
+            }
+        }
+    }
+}
+
+bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
+{
+    if (!AcceptNewBlock(state, pfrom, pblock, dbp)) {
+        if (state.IsInvalid()) {
+            LOCK(cs_main);
+            EraseBlocksAwaitingParent(pblock->GetHash());
+        }
+        return false;
+    }
 
+    // Blocks downloaded ahead of this one can go in now
+    ProcessBlocksAwaitingParent(pblock->GetHash());
     return true;
 }
 
@@ -4531,10 +4786,9 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
     case MSG_TXLOCK_REQUEST:
-        return mapTxLockReq.count(inv.hash) ||
-               mapTxLockReqRejected.count(inv.hash);
+        return swiftTXManager.HasTxLockRequest(inv.hash);
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        return swiftTXManager.HasTxLockVote(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -4581,6 +4835,30 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+// Serialized "block" message for the most recent tip served to a peer, protected by cs_main
+static uint256 hashRecentBlockMessage;
+static CSharedMessage recentBlockMessage;
+
+/** Hand a block rebuilt from a compact block to validation, as the "block" message handler does */
+void static ProcessReconstructedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+            state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+
+        //disconnect this node if its old protocol version
+        pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+    }
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4617,31 +4895,41 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (send) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                    if (inv.type == MSG_BLOCK && inv.hash == hashRecentBlockMessage) {
+                        // Peers fetch a new tip at about the same time, serve them from one serialized copy
+                        pfrom->PushSharedMessage(recentBlockMessage);
+                    } else {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_BLOCK) {
+                            CSharedMessage msg = MakeSharedMessage("block", block);
+                            if ((*mi).second == chainActive.Tip()) {
+                                hashRecentBlockMessage = inv.hash;
+                                recentBlockMessage = msg;
+                            }
+                            pfrom->PushSharedMessage(msg);
+                        } else // MSG_FILTERED_BLOCK)
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage("merkleblock", merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
+                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -4660,9 +4948,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -4678,19 +4966,21 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if (mapTxLockVote.count(inv.hash)) {
+                    CConsensusVote vote;
+                    if (swiftTXManager.GetTxLockVote(inv.hash, vote)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
+                        ss << vote;
                         pfrom->PushMessage("txlvote", ss);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if (mapTxLockReq.count(inv.hash)) {
+                    CTransaction tx;
+                    if (swiftTXManager.GetTxLockRequest(inv.hash, tx)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
+                        ss << tx;
                         pfrom->PushMessage("ix", ss);
                         pushed = true;
                     }
@@ -4940,6 +5230,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Ask for new blocks to be announced as compact blocks
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION && nCmpctBlockVersion == CMPCTBLOCKS_VERSION)
+            pfrom->fPreferHeaderAndIDs = fAnnounceUsingCmpctBlock;
     }
 
 
@@ -5033,9 +5336,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (fHeadersFirstSync && pfrom->nVersion >= HEADERS_FIRST_VERSION && IsInitialBlockDownload()) {
+                        // Fetch the headers leading up to it first, the blocks are then
+                        // downloaded from all peers in parallel by SendMessages()
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -5072,7 +5382,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5104,16 +5414,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
         LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
-            return true;
-
         CBlockIndex* pindex = NULL;
         if (locator.IsNull()) {
             // If locator is null, return the hashStop block
@@ -5259,7 +5566,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             BOOST_FOREACH (uint256 hash, vEraseQueue)
                 EraseOrphanTx(hash);
         } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
+            if (AddOrphanTx(tx, pfrom->GetId()))
+                AddToCompactExtraTransactions(tx);
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
@@ -5281,6 +5589,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         int nDoS = 0;
         if (state.IsInvalid(nDoS)) {
+            // A non-standard or low fee transaction may still be mined by someone else
+            if (nDoS == 0)
+                AddToCompactExtraTransactions(tx);
             LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
                 pfrom->id, pfrom->cleanSubVer,
                 state.GetRejectReason());
@@ -5292,7 +5603,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive() && !fImporting && !fReindex) // Ignore headers received while importing
+    else if (strCommand == "headers" && fHeadersFirstSync && !fImporting && !fReindex) // Ignore headers received while importing
     {
         std::vector<CBlockHeader> headers;
 
@@ -5315,6 +5626,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
         CBlockIndex* pindexLast = NULL;
+        CBlockIndex* pindexPaused = NULL;
         BOOST_FOREACH (const CBlockHeader& header, headers) {
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
@@ -5322,10 +5634,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
+            // Wait for the blocks to catch up before taking more headers
+            BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
+            if (miPrev != mapBlockIndex.end() && HeaderTooFarAhead(miPrev->second->nHeight + 1) && !mapBlockIndex.count(header.GetHash())) {
+                pindexPaused = miPrev->second;
+                break;
+            }
+
+            // The header carries no coinstake; the block index entry gets its
+            // proof-of-stake data when the block itself is accepted
+            if (!AcceptBlockHeader(CBlock(header), state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5339,7 +5657,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (pindexPaused) {
+            LogPrint("net", "headers sync with peer=%d waits at %d for blocks\n", pfrom->id, pindexPaused->nHeight);
+            State(pfrom->GetId())->pindexHeadersPaused = pindexPaused;
+        } else if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -5391,6 +5712,159 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_FAILED_MASK))
+                return true;
+
+            // Only a block on top of our tip is worth rebuilding from the mempool.
+            // The header stays out of the block index: without the coinstake it
+            // proves nothing, so it goes in with the block once CheckBlock() passes
+            CBlockIndex* pindexTip = chainActive.Tip();
+            bool fRequestFull = cmpctblock.header.hashPrevBlock != pindexTip->GetBlockHash();
+            if (!fRequestFull) {
+                // Check the header before the mempool is searched for the block's transactions
+                CValidationState state;
+                if (!CheckBlockHeader(cmpctblock.header, state, false) ||
+                    !ContextualCheckBlockHeader(cmpctblock.header, state, pindexTip) ||
+                    !CheckHeaderWork(cmpctblock.header, state, pindexTip)) {
+                    int nDoS;
+                    if (state.IsInvalid(nDoS) && nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us a compact block with an invalid header\n", pfrom->id);
+                    return true;
+                }
+            }
+            if (!fRequestFull) {
+                boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+                ReadStatus status = partialBlock->InitData(cmpctblock, vExtraTxnForCompact);
+                if (status == READ_STATUS_INVALID) {
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                }
+
+                std::vector<uint16_t> vMissing;
+                if (status == READ_STATUS_OK)
+                    vMissing = partialBlock->GetMissingIndexes();
+                if (status != READ_STATUS_OK) {
+                    fRequestFull = true;
+                } else if (vMissing.empty()) {
+                    fBlockReconstructed = partialBlock->FillBlock(block, std::vector<CTransaction>()) == READ_STATUS_OK;
+                    fRequestFull = !fBlockReconstructed;
+                } else {
+                    BlockTransactionsRequest req;
+                    req.blockhash = hashBlock;
+                    req.indexes.swap(vMissing);
+                    CNodeState* nodestate = State(pfrom->GetId());
+                    nodestate->partialBlock = partialBlock;
+                    nodestate->hashPartialBlock = hashBlock;
+                    pfrom->PushMessage("getblocktxn", req);
+                }
+            }
+
+            if (fRequestFull) {
+                // Unconnectable or not reconstructable, the full block takes the usual path
+                vector<CInv> vGetData(1, inv);
+                pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        boost::shared_ptr<const CBlock> pblock;
+        {
+            LOCK(cs_recentCompactBlock);
+            if (pRecentCompactBlock && pRecentCompactBlock->GetHash() == req.blockhash)
+                pblock = pRecentCompactBlock;
+        }
+
+        if (!pblock) {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA) || !chainActive.Contains(mi->second)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+            CBlock* pblockRead = new CBlock();
+            pblock.reset(pblockRead);
+            if (!ReadBlockFromDisk(*pblockRead, mi->second))
+                assert(!"cannot load block from disk");
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= pblock->vtx.size()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = pblock->vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!nodestate->partialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock = nodestate->partialBlock;
+            nodestate->partialBlock.reset();
+            nodestate->hashPartialBlock = 0;
+
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vGetData);
+            } else {
+                fBlockReconstructed = true;
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessReconstructedBlock(pfrom, block);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5609,7 +6083,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
         budget.ProcessMessage(pfrom, strCommand, vRecv);
         masternodePayments.ProcessMessageMasternodePayments(pfrom, strCommand, vRecv);
-        ProcessMessageSwiftTX(pfrom, strCommand, vRecv);
+        swiftTXManager.ProcessMessage(pfrom, strCommand, vRecv);
         ProcessSpork(pfrom, strCommand, vRecv);
         masternodeSync.ProcessMessage(pfrom, strCommand, vRecv);
     }
@@ -5661,6 +6135,9 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // masternode broadcasts and pings whose signatures were checked in the background
+    mnodeman.ProcessVerifiedMessages(false);
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
@@ -5861,13 +6338,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (fHeadersFirstSync && pto->nVersion >= HEADERS_FIRST_VERSION) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Resume headers sync once the blocks have caught up
+        if (state.pindexHeadersPaused && !HeaderTooFarAhead(state.pindexHeadersPaused->nHeight + MAX_HEADERS_RESULTS)) {
+            LogPrint("net", "resume getheaders (%d) to peer=%d\n", state.pindexHeadersPaused->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(state.pindexHeadersPaused), uint256(0));
+            state.pindexHeadersPaused = NULL;
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -5922,10 +6409,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
-            // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
-            // should only happen during initial block download.
-            LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
-            pto->fDisconnect = true;
+            // the download window should be much larger than the to-be-downloaded set of blocks, so this
+            // should only happen during initial block download. The first time, hand the blocks this peer
+            // holds up to the other peers; a peer that stalls the window again before delivering
+            // any of the blocks it is asked for is disconnected.
+            if (state.nStalls++ == 0) {
+                LogPrintf("Peer=%d is stalling block download, reassigning %d blocks in flight\n", pto->id, state.nBlocksInFlight);
+                std::vector<uint256> vReassign;
+                BOOST_FOREACH (const QueuedBlock& entry, state.vBlocksInFlight)
+                    vReassign.push_back(entry.hash);
+                BOOST_FOREACH (const uint256& hash, vReassign)
+                    MarkBlockAsReceived(hash);
+                state.nStallingSince = 0;
+            } else {
+                LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
+                pto->fDisconnect = true;
+            }
         }
         // In case there is a block that has been in flight from this peer for (2 + 0.5 * N) times the block interval
         // (with N the number of validated blocks that were in flight at the time it was requested), disconnect due to
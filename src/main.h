@@ -41,6 +41,7 @@
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
+class CBlockFilterDB;
 class CBlockTreeDB;
 class CBloomFilter;
 class CInv;
@@ -94,6 +95,10 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of downloaded blocks kept in memory while their parent is still being fetched. */
+static const unsigned int MAX_BLOCKS_AWAITING_PARENT = BLOCK_DOWNLOAD_WINDOW;
+/** How far ahead of the active chain headers are accepted before their blocks are downloaded. */
+static const int MAX_HEADERS_AHEAD_OF_TIP = 4 * MAX_HEADERS_RESULTS;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -129,6 +134,7 @@ extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
+extern bool fHeadersFirstSync;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
@@ -609,6 +615,9 @@ extern CCoinsViewCache* pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
+/** Block filters for wallet rescans, NULL unless -blockfilterindex (leveldb is thread-safe, no lock needed) */
+extern CBlockFilterDB* pblockfilterdb;
+
 struct CBlockTemplate {
     CBlock block;
     std::vector<CAmount> vTxFees;
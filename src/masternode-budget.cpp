@@ -25,6 +25,41 @@ std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 int nSubmittedFinalBudget;
 
+// fee transactions already found in the active chain and the block they are in,
+// proposals are rechecked every few blocks and would read that block every time
+static const unsigned int BUDGET_COLLATERAL_CACHE_SIZE = 1000;
+static CCriticalSection cs_budgetCollaterals;
+static std::map<uint256, std::pair<CTransaction, uint256> > mapBudgetCollaterals;
+
+static bool GetCollateralTransaction(const uint256& txid, CTransaction& txRet, uint256& hashBlockRet)
+{
+    {
+        LOCK(cs_budgetCollaterals);
+        std::map<uint256, std::pair<CTransaction, uint256> >::iterator it = mapBudgetCollaterals.find(txid);
+        if (it != mapBudgetCollaterals.end()) {
+            BlockMap::iterator mi = mapBlockIndex.find(it->second.second);
+            if (mi != mapBlockIndex.end() && mi->second && chainActive.Contains(mi->second)) {
+                txRet = it->second.first;
+                hashBlockRet = it->second.second;
+                return true;
+            }
+            // reorganized away, look it up again
+            mapBudgetCollaterals.erase(it);
+        }
+    }
+
+    if (!GetTransaction(txid, txRet, hashBlockRet, true))
+        return false;
+
+    if (hashBlockRet != uint256(0)) {
+        LOCK(cs_budgetCollaterals);
+        if (mapBudgetCollaterals.size() >= BUDGET_COLLATERAL_CACHE_SIZE)
+            mapBudgetCollaterals.clear();
+        mapBudgetCollaterals[txid] = std::make_pair(txRet, hashBlockRet);
+    }
+    return true;
+}
+
 int GetBudgetPaymentCycleBlocks()
 {
     // Amount of blocks in a months period of time (using 1 minutes per) = (60*24*30)
@@ -38,7 +73,7 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
 {
     CTransaction txCollateral;
     uint256 nBlockHash;
-    if (!GetTransaction(nTxCollateralHash, txCollateral, nBlockHash, true)) {
+    if (!GetCollateralTransaction(nTxCollateralHash, txCollateral, nBlockHash)) {
         strError = strprintf("Can't find collateral tx %s", txCollateral.ToString());
         LogPrintf("CBudgetProposalBroadcast::IsBudgetCollateralValid - %s\n", strError);
         return false;
@@ -95,29 +130,109 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
-void CBudgetManager::CheckOrphanVotes()
+void CBudgetManager::AddOrphanVote(const uint256& nParentHash, const uint256& nVoteHash)
+{
+    if (!mapOrphanParentTime.count(nParentHash))
+        mapOrphanParentTime[nParentHash] = GetTime();
+    mapOrphanVotesByParent[nParentHash].insert(nVoteHash);
+}
+
+void CBudgetManager::EraseOrphanVotes(const uint256& nParentHash)
+{
+    std::map<uint256, std::set<uint256> >::iterator it = mapOrphanVotesByParent.find(nParentHash);
+    if (it != mapOrphanVotesByParent.end()) {
+        BOOST_FOREACH (const uint256& nVoteHash, (*it).second) {
+            mapOrphanMasternodeBudgetVotes.erase(nVoteHash);
+            mapOrphanFinalizedBudgetVotes.erase(nVoteHash);
+        }
+        mapOrphanVotesByParent.erase(it);
+    }
+    mapOrphanParentTime.erase(nParentHash);
+}
+
+// make room for one more orphan vote by dropping the votes waiting on the longest missing parents
+void CBudgetManager::LimitOrphanVotes()
+{
+    while (mapOrphanMasternodeBudgetVotes.size() + mapOrphanFinalizedBudgetVotes.size() >= BUDGET_ORPHAN_VOTES_MAX &&
+           !mapOrphanParentTime.empty()) {
+        std::map<uint256, int64_t>::iterator itOldest = mapOrphanParentTime.begin();
+        for (std::map<uint256, int64_t>::iterator it = itOldest; it != mapOrphanParentTime.end(); ++it)
+            if ((*it).second < (*itOldest).second) itOldest = it;
+
+        LogPrint("mnbudget", "CBudgetManager::LimitOrphanVotes - dropping %d orphan votes for %s\n",
+            mapOrphanVotesByParent[(*itOldest).first].size(), (*itOldest).first.ToString());
+        EraseOrphanVotes((*itOldest).first);
+    }
+}
+
+// A proposal or finalized budget arrived: apply only the orphan votes that were waiting on it
+void CBudgetManager::CheckOrphanVotes(const uint256& nParentHash)
 {
     LOCK(cs);
 
+    std::map<uint256, std::set<uint256> >::iterator it = mapOrphanVotesByParent.find(nParentHash);
+    if (it == mapOrphanVotesByParent.end()) return;
+
+    std::set<uint256> setVoteHashes;
+    setVoteHashes.swap((*it).second);
+    mapOrphanVotesByParent.erase(it);
+    mapOrphanParentTime.erase(nParentHash);
 
     std::string strError = "";
+    int nActivated = 0;
+    BOOST_FOREACH (const uint256& nVoteHash, setVoteHashes) {
+        std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.find(nVoteHash);
+        if (it1 != mapOrphanMasternodeBudgetVotes.end()) {
+            CBudgetVote vote = (*it1).second;
+            mapOrphanMasternodeBudgetVotes.erase(it1);
+            if (UpdateProposal(vote, NULL, strError)) nActivated++;
+            continue;
+        }
+
+        std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.find(nVoteHash);
+        if (it2 != mapOrphanFinalizedBudgetVotes.end()) {
+            CFinalizedBudgetVote vote = (*it2).second;
+            mapOrphanFinalizedBudgetVotes.erase(it2);
+            if (UpdateFinalizedBudget(vote, NULL, strError)) nActivated++;
+        }
+    }
+
+    LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget %s is known, activated %d of %d orphan votes\n",
+        nParentHash.ToString(), nActivated, setVoteHashes.size());
+}
+
+void CBudgetManager::ExpireOrphanVotes()
+{
+    LOCK(cs);
+
+    std::vector<uint256> vExpired;
+    std::map<uint256, int64_t>::iterator it = mapOrphanParentTime.begin();
+    while (it != mapOrphanParentTime.end()) {
+        if ((*it).second < GetTime() - BUDGET_ORPHAN_VOTES_EXPIRY) vExpired.push_back((*it).first);
+        ++it;
+    }
+
+    BOOST_FOREACH (const uint256& nParentHash, vExpired)
+        EraseOrphanVotes(nParentHash);
+}
+
+// orphan votes loaded from budget.dat are indexed again, their parents count as missed from now on
+void CBudgetManager::ReindexOrphanVotes()
+{
+    LOCK(cs);
+
+    mapOrphanVotesByParent.clear();
+    mapOrphanParentTime.clear();
+
     std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
     while (it1 != mapOrphanMasternodeBudgetVotes.end()) {
-        if (budget.UpdateProposal(((*it1).second), NULL, strError)) {
-            LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanMasternodeBudgetVotes.erase(it1++);
-        } else {
-            ++it1;
-        }
+        AddOrphanVote((*it1).second.nProposalHash, (*it1).first);
+        ++it1;
     }
     std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
     while (it2 != mapOrphanFinalizedBudgetVotes.end()) {
-        if (budget.UpdateFinalizedBudget(((*it2).second), NULL, strError)) {
-            LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
-            mapOrphanFinalizedBudgetVotes.erase(it2++);
-        } else {
-            ++it2;
-        }
+        AddOrphanVote((*it2).second.nBudgetHash, (*it2).first);
+        ++it2;
     }
 }
 
@@ -188,7 +303,7 @@ void CBudgetManager::SubmitFinalBudget()
     CTransaction txCollateral;
     uint256 nBlockHash;
 
-    if (!GetTransaction(txidCollateral, txCollateral, nBlockHash, true)) {
+    if (!GetCollateralTransaction(txidCollateral, txCollateral, nBlockHash)) {
         LogPrintf("CBudgetManager::SubmitFinalBudget - Can't find collateral tx %s", txidCollateral.ToString());
         return;
     }
@@ -233,117 +348,40 @@ void CBudgetManager::SubmitFinalBudget()
 // CBudgetDB
 //
 
-CBudgetDB::CBudgetDB()
+CBudgetDB::CBudgetDB() : file(GetDataDir() / "budget.dat", "MasternodeBudget")
 {
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
 }
 
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
+bool CBudgetDB::Write(CBudgetManager& objToSave)
 {
-    LOCK(objToSave.cs);
-
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
+    if (!file.Write(objToSave))
+        return false;
 
-    LogPrintf("Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("Written info to budget.dat  %dms, %u of %u bytes live\n", GetTimeMillis() - nStart, file.GetLiveSize(), file.GetFileSize());
+    LogPrintf("  %s\n", objToSave.ToString());
 
     return true;
 }
 
 CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
 {
-    LOCK(objToLoad.cs);
-
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
 
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
+    CRecordFile::ReadResult result;
     try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
+        result = file.Read(objToLoad);
     } catch (std::exception& e) {
         objToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
+    if (result == CRecordFile::FileError)
+        error("%s : Failed to open file budget.dat", __func__);
+    if (result != CRecordFile::Ok)
+        return (ReadResult)result;
+    objToLoad.ReindexOrphanVotes();
 
     LogPrintf("Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", objToLoad.ToString());
@@ -361,31 +399,66 @@ void DumpBudgets()
 {
     int64_t nStart = GetTimeMillis();
 
-    CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrintf("Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrintf("Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok) {
-        LogPrintf("Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+    // kept across dumps so that only what changed since the last one is appended
+    static CBudgetDB budgetdb;
+
     LogPrintf("Writting info to budget.dat...\n");
     budgetdb.Write(budget);
 
     LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
+void CBudgetManager::WriteRecords(CRecordFile& file)
+{
+    LOCK(cs);
+
+    file.WriteMap(RECORD_SEEN_PROPOSAL, mapSeenMasternodeBudgetProposals);
+    file.WriteMap(RECORD_SEEN_PROPOSAL_VOTE, mapSeenMasternodeBudgetVotes);
+    file.WriteMap(RECORD_SEEN_FINALIZED_BUDGET, mapSeenFinalizedBudgets);
+    file.WriteMap(RECORD_SEEN_FINALIZED_BUDGET_VOTE, mapSeenFinalizedBudgetVotes);
+    file.WriteMap(RECORD_ORPHAN_PROPOSAL_VOTE, mapOrphanMasternodeBudgetVotes);
+    file.WriteMap(RECORD_ORPHAN_FINALIZED_BUDGET_VOTE, mapOrphanFinalizedBudgetVotes);
+
+    file.WriteMap(RECORD_PROPOSAL, mapProposals);
+    file.WriteMap(RECORD_FINALIZED_BUDGET, mapFinalizedBudgets);
+}
+
+void CBudgetManager::ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue)
+{
+    LOCK(cs);
+
+    switch (nType) {
+    case RECORD_SEEN_PROPOSAL:
+        ReadMapRecord(mapSeenMasternodeBudgetProposals, ssKey, pssValue);
+        break;
+    case RECORD_SEEN_PROPOSAL_VOTE:
+        ReadMapRecord(mapSeenMasternodeBudgetVotes, ssKey, pssValue);
+        break;
+    case RECORD_SEEN_FINALIZED_BUDGET:
+        ReadMapRecord(mapSeenFinalizedBudgets, ssKey, pssValue);
+        break;
+    case RECORD_SEEN_FINALIZED_BUDGET_VOTE:
+        ReadMapRecord(mapSeenFinalizedBudgetVotes, ssKey, pssValue);
+        break;
+    case RECORD_ORPHAN_PROPOSAL_VOTE:
+        ReadMapRecord(mapOrphanMasternodeBudgetVotes, ssKey, pssValue);
+        break;
+    case RECORD_ORPHAN_FINALIZED_BUDGET_VOTE:
+        ReadMapRecord(mapOrphanFinalizedBudgetVotes, ssKey, pssValue);
+        break;
+    case RECORD_PROPOSAL:
+        ReadMapRecord(mapProposals, ssKey, pssValue);
+        InvalidateRankedProposals();
+        break;
+    case RECORD_FINALIZED_BUDGET:
+        ReadMapRecord(mapFinalizedBudgets, ssKey, pssValue);
+        break;
+    }
+}
+
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
 {
+    LOCK(cs);
     std::string strError = "";
     if (!finalizedBudget.IsValid(strError)) return false;
 
@@ -394,6 +467,9 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+
+    //we might have active votes for this budget that are now valid
+    CheckOrphanVotes(finalizedBudget.GetHash());
     return true;
 }
 
@@ -411,7 +487,11 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    InvalidateRankedProposals();
     LogPrintf("CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
+
+    //We might have active votes for this proposal that are valid now
+    CheckOrphanVotes(budgetProposal.GetHash());
     return true;
 }
 
@@ -640,19 +720,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 {
     LOCK(cs);
 
-    std::vector<CBudgetProposal*> vBudgetProposalRet;
-
-    std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
-    while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
-
-        CBudgetProposal* pbudgetProposal = &((*it).second);
-        vBudgetProposalRet.push_back(pbudgetProposal);
-
-        ++it;
-    }
-
-    return vBudgetProposalRet;
+    return GetRankedProposals();
 }
 
 //
@@ -667,14 +735,17 @@ struct sortProposalsByVotes {
     }
 };
 
-//Need to review this function
-std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+// Requires cs. Votes are only re-validated against the masternode list when the ranking
+// is rebuilt: on a new block, or after a proposal or vote was added.
+const std::vector<CBudgetProposal*>& CBudgetManager::GetRankedProposals()
 {
-    LOCK(cs);
+    int nHeight = chainActive.Height();
+    if (!fRankedProposalsDirty && nRankedProposalsHeight == nHeight) return vRankedProposals;
 
     // ------- Sort budgets by Yes Count
 
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
+    vBudgetPorposalsSort.reserve(mapProposals.size());
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
@@ -685,6 +756,26 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
 
     std::sort(vBudgetPorposalsSort.begin(), vBudgetPorposalsSort.end(), sortProposalsByVotes());
 
+    vRankedProposals.clear();
+    vRankedProposals.reserve(vBudgetPorposalsSort.size());
+    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
+    while (it2 != vBudgetPorposalsSort.end()) {
+        vRankedProposals.push_back((*it2).first);
+        ++it2;
+    }
+
+    nRankedProposalsHeight = nHeight;
+    fRankedProposalsDirty = false;
+    return vRankedProposals;
+}
+
+//Need to review this function
+std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+{
+    LOCK(cs);
+
+    const std::vector<CBudgetProposal*>& vRanked = GetRankedProposals();
+
     // ------- Grab The Budgets In Order
 
     std::vector<CBudgetProposal*> vBudgetProposalsRet;
@@ -696,16 +787,17 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
     int nBlockEnd = nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
+    int nMinNetYeas = mnodeman.CountEnabled(ActiveProtocol()) / 10;
 
 
-    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
-    while (it2 != vBudgetPorposalsSort.end()) {
-        CBudgetProposal* pbudgetProposal = (*it2).first;
+    std::vector<CBudgetProposal*>::const_iterator it2 = vRanked.begin();
+    while (it2 != vRanked.end()) {
+        CBudgetProposal* pbudgetProposal = *it2;
 
         //prop start/end should be inside this period
         if (pbudgetProposal->fValid && pbudgetProposal->nBlockStart <= nBlockStart &&
             pbudgetProposal->nBlockEnd >= nBlockEnd &&
-            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > mnodeman.CountEnabled(ActiveProtocol()) / 10 &&
+            pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > nMinNetYeas &&
             pbudgetProposal->IsEstablished()) {
             if (pbudgetProposal->GetAmount() + nBudgetAllocated <= nTotalBudget) {
                 pbudgetProposal->SetAllotted(pbudgetProposal->GetAmount());
@@ -865,6 +957,9 @@ void CBudgetManager::NewBlock()
 
     //remove invalid votes once in a while (we have to check the signatures and validity of every vote, somewhat CPU intensive)
 
+    LogPrintf("CBudgetManager::NewBlock - orphan votes cleanup - size: %d\n", mapOrphanMasternodeBudgetVotes.size() + mapOrphanFinalizedBudgetVotes.size());
+    ExpireOrphanVotes();
+
     LogPrintf("CBudgetManager::NewBlock - askedForSourceProposalOrBudget cleanup - size: %d\n", askedForSourceProposalOrBudget.size());
     std::map<uint256, int64_t>::iterator it = askedForSourceProposalOrBudget.begin();
     while (it != askedForSourceProposalOrBudget.end()) {
@@ -881,6 +976,7 @@ void CBudgetManager::NewBlock()
         (*it2).second.CleanAndRemove(false);
         ++it2;
     }
+    InvalidateRankedProposals();
 
     LogPrintf("CBudgetManager::NewBlock - mapFinalizedBudgets cleanup - size: %d\n", mapFinalizedBudgets.size());
     std::map<uint256, CFinalizedBudget>::iterator it3 = mapFinalizedBudgets.begin();
@@ -1000,9 +1096,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         masternodeSync.AddedBudgetItem(budgetProposalBroadcast.GetHash());
 
         LogPrintf("mprop - new budget - %s\n", budgetProposalBroadcast.GetHash().ToString());
-
-        //We might have active votes for this proposal that are valid now
-        CheckOrphanVotes();
     }
 
     if (strCommand == "mvote") { //Masternode Vote
@@ -1073,9 +1166,6 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             finalizedBudgetBroadcast.Relay();
         }
         masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
-
-        //we might have active votes for this budget that are now valid
-        CheckOrphanVotes();
     }
 
     if (strCommand == "fbvote") { //Finalized Budget Vote
@@ -1278,7 +1368,11 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrintf("CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            if (!mapOrphanMasternodeBudgetVotes.count(vote.GetHash())) {
+                LimitOrphanVotes();
+                mapOrphanMasternodeBudgetVotes[vote.GetHash()] = vote;
+                AddOrphanVote(vote.nProposalHash, vote.GetHash());
+            }
 
             if (!askedForSourceProposalOrBudget.count(vote.nProposalHash)) {
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1291,7 +1385,10 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError)) return false;
+
+    InvalidateRankedProposals();
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1305,7 +1402,11 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if (!masternodeSync.IsSynced()) return false;
 
             LogPrintf("CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            if (!mapOrphanFinalizedBudgetVotes.count(vote.GetHash())) {
+                LimitOrphanVotes();
+                mapOrphanFinalizedBudgetVotes[vote.GetHash()] = vote;
+                AddOrphanVote(vote.nBudgetHash, vote.GetHash());
+            }
 
             if (!askedForSourceProposalOrBudget.count(vote.nBudgetHash)) {
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1328,6 +1429,8 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    nYeas = nNays = nAbstains = 0;
+    nRatioYeas = nRatioNays = 0;
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1340,6 +1443,8 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    nYeas = nNays = nAbstains = 0;
+    nRatioYeas = nRatioNays = 0;
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1353,6 +1458,11 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nTime = other.nTime;
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
+    nYeas = other.nYeas;
+    nNays = other.nNays;
+    nAbstains = other.nAbstains;
+    nRatioYeas = other.nRatioYeas;
+    nRatioNays = other.nRatioNays;
     fValid = true;
 }
 
@@ -1454,7 +1564,11 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) CountVote((*it).second, -1);
+
     mapVotes[hash] = vote;
+    CountVote(vote, 1);
     return true;
 }
 
@@ -1464,66 +1578,60 @@ void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
+        bool fVoteValid = (*it).second.SignatureValid(fSignatureCheck);
+        if (fVoteValid != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fVoteValid;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
 }
 
-double CBudgetProposal::GetRatio()
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
 {
-    int yeas = 0;
-    int nays = 0;
+    if (vote.nVote == VOTE_YES) nRatioYeas += nDelta;
+    if (vote.nVote == VOTE_NO) nRatioNays += nDelta;
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
-        ++it;
-    }
+    if (!vote.fValid) return;
 
-    if (yeas + nays == 0) return 0.0f;
-
-    return ((double)(yeas) / (double)(yeas + nays));
+    if (vote.nVote == VOTE_YES) nYeas += nDelta;
+    if (vote.nVote == VOTE_NO) nNays += nDelta;
+    if (vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
 }
 
-int CBudgetProposal::GetYeas()
+void CBudgetProposal::RecountVotes()
 {
-    int ret = 0;
+    nYeas = nNays = nAbstains = 0;
+    nRatioYeas = nRatioNays = 0;
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
+        CountVote((*it).second, 1);
         ++it;
     }
-
-    return ret;
 }
 
-int CBudgetProposal::GetNays()
+double CBudgetProposal::GetRatio()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
+    if (nRatioYeas + nRatioNays == 0) return 0.0f;
 
-    return ret;
+    return ((double)(nRatioYeas) / (double)(nRatioYeas + nRatioNays));
 }
 
-int CBudgetProposal::GetAbstains()
+int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
+    return nYeas;
+}
 
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
+int CBudgetProposal::GetNays()
+{
+    return nNays;
+}
 
-    return ret;
+int CBudgetProposal::GetAbstains()
+{
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1583,7 +1691,7 @@ CBudgetProposalBroadcast::CBudgetProposalBroadcast(std::string strProposalNameIn
 void CBudgetProposalBroadcast::Relay()
 {
     CInv inv(MSG_BUDGET_PROPOSAL, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("mprop", *this));
 }
 
 CBudgetVote::CBudgetVote()
@@ -1609,7 +1717,7 @@ CBudgetVote::CBudgetVote(CTxIn vinIn, uint256 nProposalHashIn, int nVoteIn)
 void CBudgetVote::Relay()
 {
     CInv inv(MSG_BUDGET_VOTE, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("mvote", *this));
 }
 
 bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
@@ -2013,7 +2121,7 @@ CFinalizedBudgetBroadcast::CFinalizedBudgetBroadcast(std::string strBudgetNameIn
 void CFinalizedBudgetBroadcast::Relay()
 {
     CInv inv(MSG_BUDGET_FINALIZED, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("fbs", *this));
 }
 
 CFinalizedBudgetVote::CFinalizedBudgetVote()
@@ -2039,7 +2147,7 @@ CFinalizedBudgetVote::CFinalizedBudgetVote(CTxIn vinIn, uint256 nBudgetHashIn)
 void CFinalizedBudgetVote::Relay()
 {
     CInv inv(MSG_BUDGET_FINALIZED_VOTE, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("fbvote", *this));
 }
 
 bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
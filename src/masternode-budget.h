@@ -12,6 +12,7 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "recordfile.h"
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
@@ -35,6 +36,8 @@ static const CAmount PROPOSAL_FEE_TX = (50 * COIN);
 static const CAmount BUDGET_FEE_TX = (50 * COIN);
 static const int64_t BUDGET_FEE_CONFIRMATIONS = 6;
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
+static const unsigned int BUDGET_ORPHAN_VOTES_MAX = 10000;
+static const int64_t BUDGET_ORPHAN_VOTES_EXPIRY = 60 * 60 * 24;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
@@ -148,22 +151,19 @@ public:
 class CBudgetDB
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    CRecordFile file;
 
 public:
     enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
+        Ok = CRecordFile::Ok,
+        FileError = CRecordFile::FileError,
+        IncorrectMagicMessage = CRecordFile::IncorrectMagicMessage,
+        IncorrectMagicNumber = CRecordFile::IncorrectMagicNumber,
+        IncorrectFormat = CRecordFile::IncorrectFormat
     };
 
     CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
+    bool Write(CBudgetManager& objToSave);
     ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
 };
 
@@ -178,6 +178,22 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // proposals sorted by net yes votes, rebuilt once per block or after a proposal or vote changes
+    std::vector<CBudgetProposal*> vRankedProposals;
+    int nRankedProposalsHeight;
+    bool fRankedProposalsDirty;
+
+    const std::vector<CBudgetProposal*>& GetRankedProposals();
+    void InvalidateRankedProposals() { fRankedProposalsDirty = true; }
+
+    // orphan vote hashes by the proposal or finalized budget they wait on, and when that parent was first missed
+    std::map<uint256, std::set<uint256> > mapOrphanVotesByParent;
+    std::map<uint256, int64_t> mapOrphanParentTime;
+
+    void AddOrphanVote(const uint256& nParentHash, const uint256& nVoteHash);
+    void EraseOrphanVotes(const uint256& nParentHash);
+    void LimitOrphanVotes();
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -186,19 +202,36 @@ public:
     map<uint256, CBudgetProposal> mapProposals;
     map<uint256, CFinalizedBudget> mapFinalizedBudgets;
 
-    std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
-    std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
-    std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
-    std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
-    std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
-    std::map<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+    CRecordMap<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
+    CRecordMap<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
+    CRecordMap<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
+    CRecordMap<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
+    CRecordMap<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
+    CRecordMap<uint256, CFinalizedBudgetVote> mapOrphanFinalizedBudgetVotes;
+
+    /// Record types in budget.dat
+    enum {
+        RECORD_SEEN_PROPOSAL = 1,
+        RECORD_SEEN_PROPOSAL_VOTE,
+        RECORD_SEEN_FINALIZED_BUDGET,
+        RECORD_SEEN_FINALIZED_BUDGET_VOTE,
+        RECORD_ORPHAN_PROPOSAL_VOTE,
+        RECORD_ORPHAN_FINALIZED_BUDGET_VOTE,
+        RECORD_PROPOSAL,
+        RECORD_FINALIZED_BUDGET
+    };
 
     CBudgetManager()
     {
+        nRankedProposalsHeight = 0;
+        fRankedProposalsDirty = true;
         mapProposals.clear();
         mapFinalizedBudgets.clear();
     }
 
+    void WriteRecords(CRecordFile& file);
+    void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue);
+
     void ClearSeen()
     {
         mapSeenMasternodeBudgetProposals.clear();
@@ -239,12 +272,15 @@ public:
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees, bool fProofOfStake);
 
-    void CheckOrphanVotes();
+    void CheckOrphanVotes(const uint256& nParentHash);
+    void ExpireOrphanVotes();
+    void ReindexOrphanVotes();
     void Clear()
     {
         LOCK(cs);
 
         LogPrintf("Budget object cleared\n");
+        InvalidateRankedProposals();
         mapProposals.clear();
         mapFinalizedBudgets.clear();
         mapSeenMasternodeBudgetProposals.clear();
@@ -253,26 +289,11 @@ public:
         mapSeenFinalizedBudgetVotes.clear();
         mapOrphanMasternodeBudgetVotes.clear();
         mapOrphanFinalizedBudgetVotes.clear();
+        mapOrphanVotesByParent.clear();
+        mapOrphanParentTime.clear();
     }
     void CheckAndRemove();
     std::string ToString() const;
-
-
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapSeenMasternodeBudgetProposals);
-        READWRITE(mapSeenMasternodeBudgetVotes);
-        READWRITE(mapSeenFinalizedBudgets);
-        READWRITE(mapSeenFinalizedBudgetVotes);
-        READWRITE(mapOrphanMasternodeBudgetVotes);
-        READWRITE(mapOrphanFinalizedBudgetVotes);
-
-        READWRITE(mapProposals);
-        READWRITE(mapFinalizedBudgets);
-    }
 };
 
 
@@ -458,6 +479,18 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+protected:
+    // running tallies over mapVotes, kept in step by AddOrUpdateVote and CleanAndRemove
+    int nYeas;
+    int nNays;
+    int nAbstains;
+    // GetRatio() counts every vote, valid or not
+    int nRatioYeas;
+    int nRatioNays;
+
+    void CountVote(const CBudgetVote& vote, int nDelta);
+    void RecountVotes();
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -549,6 +582,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -577,6 +612,11 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.nYeas, second.nYeas);
+        swap(first.nNays, second.nNays);
+        swap(first.nAbstains, second.nAbstains);
+        swap(first.nRatioYeas, second.nRatioYeas);
+        swap(first.nRatioNays, second.nRatioNays);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
@@ -27,39 +27,19 @@ CCriticalSection cs_mapMasternodePayeeVotes;
 // CMasternodePaymentDB
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
+CMasternodePaymentDB::CMasternodePaymentDB() : file(GetDataDir() / "mnpayments.dat", "MasternodePayments")
 {
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
 }
 
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
+bool CMasternodePaymentDB::Write(CMasternodePayments& objToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
+    if (!file.Write(objToSave))
+        return false;
 
-    LogPrintf("Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("Written info to mnpayments.dat  %dms, %u of %u bytes live\n", GetTimeMillis() - nStart, file.GetLiveSize(), file.GetFileSize());
+    LogPrintf("  %s\n", objToSave.ToString());
 
     return true;
 }
@@ -67,72 +47,19 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
 CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
+    CRecordFile::ReadResult result;
     try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
+        result = file.Read(objToLoad);
     } catch (std::exception& e) {
         objToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
+    if (result == CRecordFile::FileError)
+        error("%s : Failed to open file mnpayments.dat", __func__);
+    if (result != CRecordFile::Ok)
+        return (ReadResult)result;
 
     LogPrintf("Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", objToLoad.ToString());
@@ -150,27 +77,13 @@ void DumpMasternodePayments()
 {
     int64_t nStart = GetTimeMillis();
 
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrintf("Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+    // kept across dumps so that only what changed since the last one is appended
+    static CMasternodePaymentDB paymentdb;
+
     LogPrintf("Writting info to mnpayments.dat...\n");
     paymentdb.Write(masternodePayments);
 
-    LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("Masternode payments dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 bool IsBlockValueValid(const CBlock& block, CAmount nExpectedValue, CAmount nMinted)
@@ -482,6 +395,54 @@ bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
     return false;
 }
 
+void CMasternodePayments::WriteRecords(CRecordFile& file)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    file.WriteMap(RECORD_PAYEE_VOTE, mapMasternodePayeeVotes);
+    file.WriteMap(RECORD_BLOCK_PAYEES, mapMasternodeBlocks);
+}
+
+void CMasternodePayments::ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue)
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    switch (nType) {
+    case RECORD_PAYEE_VOTE: {
+        uint256 hash;
+        ssKey >> hash;
+        std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.find(hash);
+        if (it != mapMasternodePayeeVotes.end()) {
+            RemoveVoteFromBucket(hash, it->second.nBlockHeight);
+            mapMasternodePayeeVotes.erase(it);
+        }
+        if (pssValue) {
+            CMasternodePaymentWinner& winner = mapMasternodePayeeVotes[hash];
+            *pssValue >> winner;
+            mapVotesByHeight[winner.nBlockHeight].push_back(hash);
+            // the masternode already voted at this height, as if the vote was just seen
+            mapMasternodeVoteBitmaps[winner.vinMasternode.prevout].Set(winner.nBlockHeight);
+        }
+        break;
+    }
+    case RECORD_BLOCK_PAYEES: {
+        int nHeight;
+        ssKey >> nHeight;
+        std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nHeight);
+        if (it != mapMasternodeBlocks.end()) {
+            RemovePaidHeights(it->second);
+            mapMasternodeBlocks.erase(it);
+        }
+        if (pssValue) {
+            CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[nHeight];
+            *pssValue >> blockPayees;
+            AddPaidHeights(blockPayees);
+        }
+        break;
+    }
+    }
+}
+
 bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerIn)
 {
     uint256 blockHash = 0;
@@ -497,18 +458,71 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
 
         mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapVotesByHeight[winnerIn.nBlockHeight].push_back(winnerIn.GetHash());
 
         if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, 1);
+        if (blockPayees.HasPayeeWithVotes(winnerIn.payee, MNPAYMENTS_LAST_PAID_VOTES))
+            mapPayeePaidHeights[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+void CMasternodePayments::AddPaidHeights(const CMasternodeBlockPayees& blockPayees)
+{
+    BOOST_FOREACH (const CMasternodePayee& payee, blockPayees.vecPayments) {
+        if (payee.nVotes >= MNPAYMENTS_LAST_PAID_VOTES)
+            mapPayeePaidHeights[payee.scriptPubKey].insert(blockPayees.nBlockHeight);
+    }
+}
+
+void CMasternodePayments::RemovePaidHeights(const CMasternodeBlockPayees& blockPayees)
+{
+    BOOST_FOREACH (const CMasternodePayee& payee, blockPayees.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator it = mapPayeePaidHeights.find(payee.scriptPubKey);
+        if (it == mapPayeePaidHeights.end())
+            continue;
+        it->second.erase(blockPayees.nBlockHeight);
+        if (it->second.empty())
+            mapPayeePaidHeights.erase(it);
+    }
+}
+
+void CMasternodePayments::RemoveVoteFromBucket(const uint256& hash, int nBlockHeight)
+{
+    std::map<int, std::vector<uint256> >::iterator it = mapVotesByHeight.find(nBlockHeight);
+    if (it == mapVotesByHeight.end())
+        return;
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), hash), it->second.end());
+    if (it->second.empty())
+        mapVotesByHeight.erase(it);
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nMaxHeight, int nBlocks)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeePaidHeights.find(payee);
+    if (it == mapPayeePaidHeights.end())
+        return -1;
+
+    // first height above nMaxHeight, the one before it is the latest payment
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nMaxHeight);
+    if (itHeight == it->second.begin())
+        return -1;
+    --itHeight;
+
+    if (*itHeight <= 0 || *itHeight <= nMaxHeight - nBlocks)
+        return -1;
+    return *itHeight;
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -518,6 +532,14 @@ bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
     
     std::string strPayeesPossible = "";
 
+    //require at least 6 signatures
+    BOOST_FOREACH (CMasternodePayee& payee, vecPayments)
+        if (payee.nVotes >= nMaxSignatures && payee.nVotes >= MNPAYMENTS_SIGNATURES_REQUIRED)
+            nMaxSignatures = payee.nVotes;
+
+    // if we don't have at least 6 signatures on a payee, approve whichever is the longest chain
+    if (nMaxSignatures < MNPAYMENTS_SIGNATURES_REQUIRED) return true;
+
     CAmount nReward = GetBlockValue(nBlockHeight);
 
     if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
@@ -533,14 +555,6 @@ bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 
     CAmount requiredMasternodePayment = GetMasternodePayment(nBlockHeight, nReward, nMasternode_Drift_Count);
 
-    //require at least 6 signatures
-    BOOST_FOREACH (CMasternodePayee& payee, vecPayments)
-        if (payee.nVotes >= nMaxSignatures && payee.nVotes >= MNPAYMENTS_SIGNATURES_REQUIRED)
-            nMaxSignatures = payee.nVotes;
-
-    // if we don't have at least 6 signatures on a payee, approve whichever is the longest chain
-    if (nMaxSignatures < MNPAYMENTS_SIGNATURES_REQUIRED) return true;
-
     BOOST_FOREACH (CMasternodePayee& payee, vecPayments) {
         bool found = false;
         BOOST_FOREACH (CTxOut out, txNew.vout) {
@@ -608,8 +622,9 @@ bool CMasternodePayments::IsTransactionValid(const CTransaction& txNew, int nBlo
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].IsTransactionValid(txNew);
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it != mapMasternodeBlocks.end()) {
+        return it->second.IsTransactionValid(txNew);
     }
 
     return true;
@@ -629,18 +644,30 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    // votes and tallies are ordered by height, so whole heights drop off the front
+    std::map<int, std::vector<uint256> >::iterator it = mapVotesByHeight.begin();
+    while (it != mapVotesByHeight.end() && nHeight - it->first > nLimit) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing %d old Masternode payments - block %d\n", it->second.size(), it->first);
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        mapVotesByHeight.erase(it++);
+    }
+
+    std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.begin();
+    while (itBlock != mapMasternodeBlocks.end() && nHeight - itBlock->first > nLimit) {
+        RemovePaidHeights(itBlock->second);
+        mapMasternodeBlocks.erase(itBlock++);
+    }
+
+    // masternodes that stopped voting
+    std::map<COutPoint, CMasternodeVoteBitmap>::iterator itVoter = mapMasternodeVoteBitmaps.begin();
+    while (itVoter != mapMasternodeVoteBitmaps.end()) {
+        if (nHeight - itVoter->second.nLastHeight > nLimit)
+            mapMasternodeVoteBitmaps.erase(itVoter++);
+        else
+            ++itVoter;
     }
 }
 
@@ -752,7 +779,7 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 void CMasternodePaymentWinner::Relay()
 {
     CInv inv(MSG_MASTERNODE_WINNER, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("mnw", *this));
 }
 
 bool CMasternodePaymentWinner::SignatureValid()
@@ -790,11 +817,10 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+    std::map<int, std::vector<uint256> >::iterator it = mapVotesByHeight.lower_bound(nHeight - nCountNeeded);
+    while (it != mapVotesByHeight.end() && it->first <= nHeight + 20) {
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
             nInvCount++;
         }
         ++it;
@@ -816,17 +842,10 @@ int CMasternodePayments::GetOldestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nOldestBlock = std::numeric_limits<int>::max();
+    if (mapMasternodeBlocks.empty())
+        return std::numeric_limits<int>::max();
 
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first < nOldestBlock) {
-            nOldestBlock = (*it).first;
-        }
-        it++;
-    }
-
-    return nOldestBlock;
+    return mapMasternodeBlocks.begin()->first;
 }
 
 
@@ -834,15 +853,8 @@ int CMasternodePayments::GetNewestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nNewestBlock = 0;
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first > nNewestBlock) {
-            nNewestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return 0;
 
-    return nNewestBlock;
+    return std::max(mapMasternodeBlocks.rbegin()->first, 0);
 }
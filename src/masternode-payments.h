@@ -9,6 +9,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "recordfile.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -25,6 +26,10 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// votes a payee needs for a block before the masternode counts as paid there
+#define MNPAYMENTS_LAST_PAID_VOTES 2
+// 64 block words in the voted-heights bitmap of a masternode, a window of 4096 blocks
+#define MNPAYMENTS_VOTE_BITMAP_WORDS 64
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -39,22 +44,19 @@ void DumpMasternodePayments();
 class CMasternodePaymentDB
 {
 private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
+    CRecordFile file;
 
 public:
     enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
+        Ok = CRecordFile::Ok,
+        FileError = CRecordFile::FileError,
+        IncorrectMagicMessage = CRecordFile::IncorrectMagicMessage,
+        IncorrectMagicNumber = CRecordFile::IncorrectMagicNumber,
+        IncorrectFormat = CRecordFile::IncorrectFormat
     };
 
     CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
+    bool Write(CMasternodePayments& objToSave);
     ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
 };
 
@@ -158,6 +160,40 @@ public:
     }
 };
 
+// Heights a masternode voted for, a ring of 64 block words each tagged with the
+// word of the chain it currently holds
+class CMasternodeVoteBitmap
+{
+private:
+    std::vector<std::pair<int, uint64_t> > vWords;
+
+public:
+    int nLastHeight;
+
+    CMasternodeVoteBitmap() : vWords(MNPAYMENTS_VOTE_BITMAP_WORDS, std::make_pair(-1, 0)), nLastHeight(0) {}
+
+    /// Record a vote at nHeight, false if there already was one or nHeight fell out of the window
+    bool Set(int nHeight)
+    {
+        if (nHeight < 0) return false;
+
+        int nWord = nHeight / 64;
+        std::pair<int, uint64_t>& word = vWords[nWord % MNPAYMENTS_VOTE_BITMAP_WORDS];
+        if (word.first > nWord) return false;
+        if (word.first < nWord) {
+            word.first = nWord;
+            word.second = 0;
+        }
+
+        uint64_t nBit = (uint64_t)1 << (nHeight % 64);
+        if (word.second & nBit) return false;
+        word.second |= nBit;
+
+        nLastHeight = std::max(nLastHeight, nHeight);
+        return true;
+    }
+};
+
 // for storing the winning payments
 class CMasternodePaymentWinner
 {
@@ -236,10 +272,28 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // heights at which each payee has at least MNPAYMENTS_LAST_PAID_VOTES votes,
+    // kept in step with mapMasternodeBlocks so the last payment of a masternode
+    // doesn't need a walk back through the chain
+    std::map<CScript, std::set<int> > mapPayeePaidHeights;
+    // hashes of the votes in mapMasternodePayeeVotes by block height, old heights are pruned a bucket at a time
+    std::map<int, std::vector<uint256> > mapVotesByHeight;
+    // heights each masternode voted for
+    std::map<COutPoint, CMasternodeVoteBitmap> mapMasternodeVoteBitmaps;
+
+    void AddPaidHeights(const CMasternodeBlockPayees& blockPayees);
+    void RemovePaidHeights(const CMasternodeBlockPayees& blockPayees);
+    void RemoveVoteFromBucket(const uint256& hash, int nBlockHeight);
+
 public:
-    std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
-    std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
-    std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    CRecordMap<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    CRecordMap<int, CMasternodeBlockPayees> mapMasternodeBlocks;
+
+    /// Record types in mnpayments.dat
+    enum {
+        RECORD_PAYEE_VOTE = 1,
+        RECORD_BLOCK_PAYEES
+    };
 
     CMasternodePayments()
     {
@@ -247,11 +301,17 @@ public:
         nLastBlockHeight = 0;
     }
 
+    void WriteRecords(CRecordFile& file);
+    void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue);
+
     void Clear()
     {
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeePaidHeights.clear();
+        mapVotesByHeight.clear();
+        mapMasternodeVoteBitmaps.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -260,6 +320,8 @@ public:
     void Sync(CNode* node, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
+    /// Most recent height in (nMaxHeight - nBlocks, nMaxHeight] the payee was voted for, or -1
+    int GetLastPaidHeight(const CScript& payee, int nMaxHeight, int nBlocks);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
@@ -269,15 +331,8 @@ public:
     {
         LOCK(cs_mapMasternodePayeeVotes);
 
-        if (mapMasternodesLastVote.count(outMasternode.hash + outMasternode.n)) {
-            if (mapMasternodesLastVote[outMasternode.hash + outMasternode.n] == nBlockHeight) {
-                return false;
-            }
-        }
-
         //record this masternode voted
-        mapMasternodesLastVote[outMasternode.hash + outMasternode.n] = nBlockHeight;
-        return true;
+        return mapMasternodeVoteBitmaps[outMasternode].Set(nBlockHeight);
     }
 
     int GetMinMasternodePaymentsProto();
@@ -287,15 +342,6 @@ public:
     std::string ToString() const;
     int GetOldestBlock();
     int GetNewestBlock();
-
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        READWRITE(mapMasternodePayeeVotes);
-        READWRITE(mapMasternodeBlocks);
-    }
 };
 
 
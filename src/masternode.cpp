@@ -15,6 +15,8 @@
 map<uint256, int> mapSeenMasternodeScanningErrors;
 // cache block hashes as we calculate them
 std::map<int64_t, uint256> mapCacheBlockHashes;
+// spent status of masternode collaterals
+CMasternodeCollaterals masternodeCollaterals;
 
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
@@ -209,32 +211,160 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut((GetCurrentCollateral() - 0.01) * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
-
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
-            }
+        bool fUnspent;
+        if (!masternodeCollaterals.GetStatus(vin.prevout, fUnspent)) return;
+
+        if (!fUnspent) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
         }
     }
 
     activeState = MASTERNODE_ENABLED; // OK
 }
 
-int64_t CMasternode::SecondsSincePayment()
+bool CMasternodeCollaterals::GetStatus(const COutPoint& outpoint, bool& fUnspent)
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    {
+        LOCK(cs);
+        if (setSpent.count(outpoint)) {
+            fUnspent = false;
+            return true;
+        }
+        std::map<COutPoint, CAmount>::const_iterator it = mapUnspent.find(outpoint);
+        if (it != mapUnspent.end()) {
+            // the collateral has to cover the required amount, less a fee's worth
+            fUnspent = it->second >= (GetCurrentCollateral() - 0.01) * COIN;
+            return true;
+        }
+    }
+
+    // not seen yet or touched by a transaction since, look it up
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) return false;
+
+    bool fSpent = false;
+    CAmount nValue = 0;
+    CCoins coins;
+    if (!pcoinsTip->GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n)) {
+        fSpent = true;
+    } else {
+        nValue = coins.vout[outpoint.n].nValue;
+        // not cached, it matures without any transaction touching it
+        if ((coins.IsCoinBase() || coins.IsCoinStake()) && chainActive.Height() + 1 - coins.nHeight < Params().COINBASE_MATURITY()) {
+            fUnspent = false;
+            return true;
+        }
+    }
+
+    if (!fSpent) {
+        LOCK(mempool.cs);
+        fSpent = mempool.mapNextTx.count(outpoint) > 0;
+    }
+
+    // stored while still holding cs_main so a spend can't slip in between
+    LOCK(cs);
+    if (fSpent) {
+        setSpent.insert(outpoint);
+        fUnspent = false;
+    } else {
+        mapUnspent[outpoint] = nValue;
+        fUnspent = nValue >= (GetCurrentCollateral() - 0.01) * COIN;
+    }
+    return true;
+}
+
+bool CMasternodeCollaterals::GetOutput(const COutPoint& outpoint, CTxOut& txoutRet, int& nHeightRet)
+{
+    {
+        LOCK(cs);
+        std::map<COutPoint, std::pair<CTxOut, int> >::const_iterator it = mapOutputs.find(outpoint);
+        if (it != mapOutputs.end()) {
+            txoutRet = it->second.first;
+            nHeightRet = it->second.second;
+            return true;
+        }
+    }
+
+    LOCK(cs_main);
+
+    CCoins coins;
+    if (pcoinsTip->GetCoins(outpoint.hash, coins) && coins.IsAvailable(outpoint.n)) {
+        txoutRet = coins.vout[outpoint.n];
+        nHeightRet = coins.nHeight;
+    } else {
+        // spent or not confirmed yet, only the transaction itself can tell
+        CTransaction tx;
+        uint256 hashBlock;
+        if (!GetTransaction(outpoint.hash, tx, hashBlock, true) || outpoint.n >= tx.vout.size())
+            return false;
+
+        txoutRet = tx.vout[outpoint.n];
+        nHeightRet = -1;
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && mi->second && chainActive.Contains(mi->second))
+            nHeightRet = mi->second->nHeight;
+    }
+
+    // the mempool changes too often to be worth remembering
+    if (nHeightRet >= 0) {
+        LOCK(cs);
+        mapOutputs[outpoint] = std::make_pair(txoutRet, nHeightRet);
+    }
+    return true;
+}
+
+void CMasternodeCollaterals::ForgetTransaction(const CTransaction& tx)
+{
+    LOCK(cs);
+
+    // anything touching a collateral gets looked up again on the next check
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        mapUnspent.erase(txin.prevout);
+        setSpent.erase(txin.prevout);
+    }
+
+    // and so do the outputs of a transaction that was (dis)connected, they may have
+    // appeared or gone and their height changed
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        mapUnspent.erase(COutPoint(hash, i));
+        setSpent.erase(COutPoint(hash, i));
+    }
+    std::map<COutPoint, std::pair<CTxOut, int> >::iterator it = mapOutputs.lower_bound(COutPoint(hash, 0));
+    while (it != mapOutputs.end() && it->first.hash == hash)
+        mapOutputs.erase(it++);
+}
+
+void CMasternodeCollaterals::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    ForgetTransaction(tx);
+}
+
+void CMasternodeCollaterals::TransactionRemovedFromMempool(const CTransaction& tx)
+{
+    ForgetTransaction(tx);
+}
+
+void CMasternodeCollaterals::Forget(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    mapUnspent.erase(outpoint);
+    setSpent.erase(outpoint);
+    mapOutputs.erase(outpoint);
+}
 
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+void CMasternodeCollaterals::Clear()
+{
+    LOCK(cs);
+    mapUnspent.clear();
+    setSpent.clear();
+    mapOutputs.clear();
+}
+
+int64_t CMasternode::SecondsSincePayment(int nEnabledCount)
+{
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nEnabledCount));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -247,7 +377,11 @@ int64_t CMasternode::SecondsSincePayment()
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasternode::GetLastPaid()
+//
+// Time of the latest block within the last (enabled masternodes * 1.25) blocks
+// that this masternode was voted as the payee of
+//
+int64_t CMasternode::GetLastPaid(int nEnabledCount)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -263,36 +397,20 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
+    if (nEnabledCount == -1) nEnabledCount = mnodeman.CountEnabled();
+    int nMnCount = nEnabledCount * 1.25;
 
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
+    /*
+        Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
+        to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexPrev->nHeight, nMnCount);
+    if (nHeight < 0) return 0;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex* BlockReading = chainActive[nHeight];
+    if (BlockReading == NULL) return 0;
 
-    return 0;
+    return BlockReading->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -475,9 +593,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         return false;
     }
 
-    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
-    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
         LogPrintf("mnb - ignoring outdated Masternode %s protocol version %d\n", vin.prevout.hash.ToString(), protocolVersion);
@@ -542,6 +658,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
         //take the newest entry
         LogPrint("masternode", "mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
         if (pmn->UpdateFromNewBroadcast((*this))) {
+            mnodeman.Reindex(*pmn);
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
@@ -603,14 +720,11 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 LYRA tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 LYRA tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
+    CTxOut txoutCollateral;
+    int nCollateralHeight; // block for 1000 LYRA tx -> 1 confirmation
+    if (masternodeCollaterals.GetOutput(vin.prevout, txoutCollateral, nCollateralHeight) && nCollateralHeight >= 0) {
+        CBlockIndex* pConfIndex = chainActive[nCollateralHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
             LogPrintf("mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                 sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
             return false;
@@ -644,12 +758,9 @@ bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
 {
     std::string errorMessage;
 
-    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
-    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
-
     sigTime = GetAdjustedTime();
 
-    std::string strMessage = addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, sig, keyCollateralAddress)) {
         LogPrintf("CMasternodeBroadcast::Sign() - Error: %s\n", errorMessage);
@@ -664,6 +775,21 @@ bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
     return true;
 }
 
+std::string CMasternodeBroadcast::GetStrMessage() const
+{
+    std::string vchPubKey(pubKeyCollateralAddress.begin(), pubKeyCollateralAddress.end());
+    std::string vchPubKey2(pubKeyMasternode.begin(), pubKeyMasternode.end());
+
+    return addr.ToString() + boost::lexical_cast<std::string>(sigTime) + vchPubKey + vchPubKey2 + boost::lexical_cast<std::string>(protocolVersion);
+}
+
+void CMasternodeBroadcast::RecoverSigners() const
+{
+    obfuScationSigner.RecoverSigner(GetStrMessage(), sig);
+    if (lastPing != CMasternodePing())
+        obfuScationSigner.RecoverSigner(lastPing.GetStrMessage(), lastPing.vchSig);
+}
+
 CMasternodePing::CMasternodePing()
 {
     vin = CTxIn();
@@ -687,7 +813,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!obfuScationSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrintf("CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -727,10 +853,8 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
         // update only if there is no known ping for this masternode or
         // last ping was more then MASTERNODE_MIN_MNP_SECONDS-60 ago comparing to this one
         if (!pmn->IsPingedWithin(MASTERNODE_MIN_MNP_SECONDS - 60, sigTime)) {
-            std::string strMessage = vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
-
             std::string errorMessage = "";
-            if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+            if (!obfuScationSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, GetStrMessage(), errorMessage)) {
                 LogPrintf("CMasternodePing::CheckAndUpdate - Got bad Masternode address signature %s\n", vin.prevout.hash.ToString());
                 nDos = 33;
                 return false;
@@ -779,8 +903,13 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
     return false;
 }
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + boost::lexical_cast<std::string>(sigTime);
+}
+
 void CMasternodePing::Relay()
 {
     CInv inv(MSG_MASTERNODE_PING, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSharedMessage("mnp", *this));
 }
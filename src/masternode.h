@@ -13,6 +13,7 @@
 #include "sync.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 15
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -26,8 +27,10 @@ using namespace std;
 
 class CMasternode;
 class CMasternodeBroadcast;
+class CMasternodeCollaterals;
 class CMasternodePing;
 extern map<int64_t, uint256> mapCacheBlockHashes;
+extern CMasternodeCollaterals masternodeCollaterals;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
 
@@ -63,6 +66,9 @@ public:
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     void Relay();
 
+    /// The message covered by vchSig
+    std::string GetStrMessage() const;
+
     uint256 GetHash()
     {
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
@@ -217,7 +223,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nEnabledCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -280,7 +286,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nEnabledCount = -1);
     bool IsValidNetAddr();
 };
 
@@ -301,6 +307,11 @@ public:
     bool Sign(CKey& keyCollateralAddress);
     void Relay();
 
+    /// The message covered by sig
+    std::string GetStrMessage() const;
+    /// Recover the signers of the broadcast and its ping ahead of CheckAndUpdate, see CObfuScationSigner::RecoverSigner
+    void RecoverSigners() const;
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -330,4 +341,41 @@ public:
     static bool Create(std::string strService, std::string strKey, std::string strTxHash, std::string strOutputIndex, std::string& strErrorRet, CMasternodeBroadcast& mnbRet, bool fOffline = false);
 };
 
+//
+// Tracks whether masternode collaterals are still unspent. An outpoint is looked up in the
+// UTXO set and mempool once, then the result is kept until a transaction spending or creating
+// it is connected, disconnected, enters the mempool or leaves it. Immature collaterals are
+// looked up again on every check.
+//
+class CMasternodeCollaterals : public CValidationInterface
+{
+private:
+    mutable CCriticalSection cs;
+
+    // value of collaterals known to be unspent and spendable
+    std::map<COutPoint, CAmount> mapUnspent;
+    // collaterals known to be spent or missing
+    std::set<COutPoint> setSpent;
+    // output and confirmation height (-1 if not in the active chain) of collaterals looked up
+    std::map<COutPoint, std::pair<CTxOut, int> > mapOutputs;
+
+    // drop what is known about the outputs a transaction spends and creates
+    void ForgetTransaction(const CTransaction& tx);
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    /// Whether the collateral still holds the required amount, false if it couldn't be determined right now
+    bool GetStatus(const COutPoint& outpoint, bool& fUnspent);
+    /// The collateral output and the height of the block that confirmed it, -1 if it isn't in the active chain.
+    /// Unspent collaterals come from the UTXO set, a block is only read for spent or unconfirmed ones
+    bool GetOutput(const COutPoint& outpoint, CTxOut& txoutRet, int& nHeightRet);
+    /// Connected to CTxMemPool::NotifyEntryRemoved, a collateral spent in the mempool may be unspent again
+    void TransactionRemovedFromMempool(const CTransaction& tx);
+    /// Drop what is known about a collateral
+    void Forget(const COutPoint& outpoint);
+    void Clear();
+};
+
 #endif
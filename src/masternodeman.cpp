@@ -12,19 +12,137 @@
 #include "util.h"
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
-struct CompareLastPaid {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
+/** A masternode broadcast or ping received from pfrom, waiting for its signatures to be checked */
+struct CMasternodeVerifyItem {
+    CNode* pfrom;
+    bool fPing;
+    CMasternodeBroadcast mnb;
+    CMasternodePing mnp;
+    bool fVerified;
+
+    void Verify() const
     {
-        return t1.first < t2.first;
+        if (fPing)
+            obfuScationSigner.RecoverSigner(mnp.GetStrMessage(), mnp.vchSig);
+        else
+            mnb.RecoverSigners();
     }
 };
 
-struct CompareScoreTxIn {
+/**
+ * Queue of masternode messages whose signatures are recovered by the
+ * ThreadMasternodeVerify workers. A list sync brings in thousands of them and
+ * the public key recovery is by far the most expensive part of handling one,
+ * the rest is still done in arrival order by the message handler thread.
+ */
+class CMasternodeVerifyQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+
+    // items are picked up in order, the first nClaimed ones are taken
+    std::deque<CMasternodeVerifyItem> queue;
+    size_t nClaimed;
+    int nWorkers;
+
+public:
+    CMasternodeVerifyQueue() : nClaimed(0), nWorkers(0) {}
+
+    bool HasWorkers()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nWorkers > 0;
+    }
+
+    void Push(CNode* pfrom, const CMasternodeBroadcast* pmnb, const CMasternodePing* pmnp)
+    {
+        CMasternodeVerifyItem item;
+        item.pfrom = pfrom;
+        item.fPing = pmnp != NULL;
+        if (pmnb) item.mnb = *pmnb;
+        if (pmnp) item.mnp = *pmnp;
+        item.fVerified = false;
+
+        pfrom->AddRef();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(item);
+        }
+        condWork.notify_one();
+    }
+
+    /** Take the oldest item once it is verified */
+    bool Pop(CMasternodeVerifyItem& itemRet, bool fWait)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.empty())
+            return false;
+
+        if (nClaimed == 0) {
+            if (!fWait)
+                return false;
+            // no worker got to it yet, don't wait for one
+            CMasternodeVerifyItem& item = queue.front();
+            nClaimed++;
+            lock.unlock();
+            item.Verify();
+            lock.lock();
+            item.fVerified = true;
+        }
+
+        while (!queue.front().fVerified) {
+            if (!fWait)
+                return false;
+            condDone.wait(lock);
+        }
+
+        itemRet = queue.front();
+        queue.pop_front();
+        nClaimed--;
+        return true;
+    }
+
+    void Thread()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers++;
+        }
+        while (true) {
+            CMasternodeVerifyItem* pitem;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (nClaimed == queue.size())
+                    condWork.wait(lock);
+                // deque keeps references valid while the front is popped
+                pitem = &queue[nClaimed++];
+            }
+            pitem->Verify();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pitem->fVerified = true;
+            }
+            condDone.notify_all();
+        }
+    }
+};
+
+static CMasternodeVerifyQueue masternodeverifyqueue;
+
+void ThreadMasternodeVerify()
+{
+    RenameThread("lyra-mnverify");
+    masternodeverifyqueue.Thread();
+}
+
+struct CompareLastPaid {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
@@ -32,11 +150,14 @@ struct CompareScoreTxIn {
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+struct CompareScoreOutPoint {
+    bool operator()(const pair<uint256, COutPoint>& t1,
+        const pair<uint256, COutPoint>& t2) const
     {
-        return t1.first < t2.first;
+        // highest score first, ties broken by outpoint so the order is deterministic
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second < t2.second;
     }
 };
 
@@ -44,40 +165,18 @@ struct CompareScoreMN {
 // CMasternodeDB
 //
 
-CMasternodeDB::CMasternodeDB()
+CMasternodeDB::CMasternodeDB() : file(GetDataDir() / "mncache.dat", "MasternodeCache")
 {
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
 }
 
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+bool CMasternodeDB::Write(CMasternodeMan& mnodemanToSave)
 {
     int64_t nStart = GetTimeMillis();
 
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
+    if (!file.Write(mnodemanToSave))
+        return false;
 
-    LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("Written info to mncache.dat  %dms, %u of %u bytes live\n", GetTimeMillis() - nStart, file.GetLiveSize(), file.GetFileSize());
     LogPrintf("  %s\n", mnodemanToSave.ToString());
 
     return true;
@@ -86,71 +185,19 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
 CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
 
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
+    CRecordFile::ReadResult result;
     try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-
-        ssMasternodes >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
+        result = file.Read(mnodemanToLoad);
     } catch (std::exception& e) {
         mnodemanToLoad.Clear();
         error("%s : Deserialize or I/O error - %s", __func__, e.what());
         return IncorrectFormat;
     }
+    if (result == CRecordFile::FileError)
+        error("%s : Failed to open file mncache.dat", __func__);
+    if (result != CRecordFile::Ok)
+        return (ReadResult)result;
 
     LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToLoad.ToString());
@@ -168,23 +215,9 @@ void DumpMasternodes()
 {
     int64_t nStart = GetTimeMillis();
 
-    CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+    // kept across dumps so that only what changed since the last one is appended
+    static CMasternodeDB mndb;
+
     LogPrintf("Writting info to mncache.dat...\n");
     mndb.Write(mnodeman);
 
@@ -196,6 +229,60 @@ CMasternodeMan::CMasternodeMan()
     nDsqCount = 0;
 }
 
+void CMasternodeMan::WriteRecords(CRecordFile& file)
+{
+    LOCK(cs);
+
+    file.WriteMap(RECORD_MASTERNODE, mapMasternodes);
+    file.WriteMap(RECORD_ASKED_US, mAskedUsForMasternodeList);
+    file.WriteMap(RECORD_WE_ASKED, mWeAskedForMasternodeList);
+    file.WriteMap(RECORD_WE_ASKED_ENTRY, mWeAskedForMasternodeListEntry);
+    file.Write(RECORD_DSQ_COUNT, 0, nDsqCount);
+
+    file.WriteMap(RECORD_SEEN_BROADCAST, mapSeenMasternodeBroadcast);
+    file.WriteMap(RECORD_SEEN_PING, mapSeenMasternodePing);
+}
+
+void CMasternodeMan::ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue)
+{
+    LOCK(cs);
+
+    switch (nType) {
+    case RECORD_MASTERNODE: {
+        COutPoint outpoint;
+        ssKey >> outpoint;
+        RemoveFromIndexes(outpoint);
+        mapMasternodes.erase(outpoint);
+        if (pssValue) {
+            CMasternode mn;
+            *pssValue >> mn;
+            mapMasternodes.insert(std::make_pair(mn.vin.prevout, mn));
+            AddToIndexes(mn);
+        }
+        ClearScoreTables();
+        break;
+    }
+    case RECORD_ASKED_US:
+        ReadMapRecord(mAskedUsForMasternodeList, ssKey, pssValue);
+        break;
+    case RECORD_WE_ASKED:
+        ReadMapRecord(mWeAskedForMasternodeList, ssKey, pssValue);
+        break;
+    case RECORD_WE_ASKED_ENTRY:
+        ReadMapRecord(mWeAskedForMasternodeListEntry, ssKey, pssValue);
+        break;
+    case RECORD_DSQ_COUNT:
+        if (pssValue) *pssValue >> nDsqCount;
+        break;
+    case RECORD_SEEN_BROADCAST:
+        ReadMapRecord(mapSeenMasternodeBroadcast, ssKey, pssValue);
+        break;
+    case RECORD_SEEN_PING:
+        ReadMapRecord(mapSeenMasternodePing, ssKey, pssValue);
+        break;
+    }
+}
+
 bool CMasternodeMan::Add(CMasternode& mn)
 {
     LOCK(cs);
@@ -206,7 +293,9 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        mapMasternodes.insert(std::make_pair(mn.vin.prevout, mn));
+        AddToIndexes(mn);
+        ClearScoreTables();
         return true;
     }
 
@@ -233,7 +322,8 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
     }
 }
@@ -245,20 +335,20 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
-            (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
-            (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
-            (*it).protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
-            LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
+    std::map<COutPoint, CMasternode>::iterator mi = mapMasternodes.begin();
+    while (mi != mapMasternodes.end()) {
+        if (mi->second.activeState == CMasternode::MASTERNODE_REMOVE ||
+            mi->second.activeState == CMasternode::MASTERNODE_VIN_SPENT ||
+            (forceExpiredRemoval && mi->second.activeState == CMasternode::MASTERNODE_EXPIRED) ||
+            mi->second.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
+            LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", mi->second.vin.prevout.hash.ToString(), size() - 1);
 
             //erase all of the broadcasts we've seen from this vin
             // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
             //    sending a brand new mnb
             map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
             while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
+                if ((*it3).second.vin == mi->second.vin) {
                     masternodeSync.mapSeenSyncMNB.erase((*it3).first);
                     mapSeenMasternodeBroadcast.erase(it3++);
                 } else {
@@ -269,16 +359,19 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             // allow us to ask for this masternode again if we see another ping
             map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
             while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
+                if ((*it2).first == mi->second.vin.prevout) {
                     mWeAskedForMasternodeListEntry.erase(it2++);
                 } else {
                     ++it2;
                 }
             }
 
-            it = vMasternodes.erase(it);
+            RemoveFromIndexes(mi->first);
+            masternodeCollaterals.Forget(mi->first);
+            mapMasternodes.erase(mi++);
+            ClearScoreTables();
         } else {
-            ++it;
+            ++mi;
         }
     }
 
@@ -337,7 +430,10 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    mapMasternodes.clear();
+    RebuildIndexes();
+    ClearScoreTables();
+    masternodeCollaterals.Clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -353,7 +449,8 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -378,7 +475,8 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -391,7 +489,8 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         std::string strHost;
         int port;
@@ -436,37 +535,98 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CScript, COutPoint>::const_iterator it = mapMasternodesByPayee.find(payee);
+    if (it == mapMasternodesByPayee.end())
+        return NULL;
+    return &mapMasternodes[it->second];
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.find(vin.prevout);
+    if (it == mapMasternodes.end())
+        return NULL;
+    return &it->second;
 }
 
-
 CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    std::multimap<CPubKey, COutPoint>::const_iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    if (it == mapMasternodesByPubKey.end())
+        return NULL;
+    return &mapMasternodes[it->second];
+}
+
+void CMasternodeMan::AddToIndexes(const CMasternode& mn)
+{
+    CScript payee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
+    mapMasternodesByPayee.insert(std::make_pair(payee, mn.vin.prevout));
+    mapMasternodesByPubKey.insert(std::make_pair(mn.pubKeyMasternode, mn.vin.prevout));
+    mapIndexedKeys[mn.vin.prevout] = std::make_pair(payee, mn.pubKeyMasternode);
+}
+
+void CMasternodeMan::RemoveFromIndexes(const COutPoint& outpoint)
+{
+    std::map<COutPoint, std::pair<CScript, CPubKey> >::iterator mi = mapIndexedKeys.find(outpoint);
+    if (mi == mapIndexedKeys.end())
+        return;
+
+    std::pair<std::multimap<CScript, COutPoint>::iterator, std::multimap<CScript, COutPoint>::iterator> rangePayee = mapMasternodesByPayee.equal_range(mi->second.first);
+    for (std::multimap<CScript, COutPoint>::iterator it = rangePayee.first; it != rangePayee.second; ++it) {
+        if (it->second == outpoint) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
     }
-    return NULL;
+
+    std::pair<std::multimap<CPubKey, COutPoint>::iterator, std::multimap<CPubKey, COutPoint>::iterator> rangePubKey = mapMasternodesByPubKey.equal_range(mi->second.second);
+    for (std::multimap<CPubKey, COutPoint>::iterator it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if (it->second == outpoint) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+
+    mapIndexedKeys.erase(mi);
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapIndexedKeys.clear();
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes)
+        AddToIndexes(mnpair.second);
+}
+
+void CMasternodeMan::Reindex(const CMasternode& mn)
+{
+    LOCK(cs);
+
+    // only entries stored in the list are indexed, not copies of them
+    std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.find(mn.vin.prevout);
+    if (it == mapMasternodes.end() || &it->second != &mn)
+        return;
+
+    RemoveFromIndexes(mn.vin.prevout);
+    AddToIndexes(mn);
+}
+
+std::vector<CMasternode> CMasternodeMan::GetFullMasternodeVector()
+{
+    Check();
+
+    LOCK(cs);
+    std::vector<CMasternode> vMasternodes;
+    vMasternodes.reserve(mapMasternodes.size());
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes)
+        vMasternodes.push_back(mnpair.second);
+    return vMasternodes;
 }
 
 //
@@ -484,7 +644,8 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -500,7 +661,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -517,19 +678,25 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //  -- (chance per block * chances before IsScheduled will fire)
     int nTenthNetwork = CountEnabled() / 10;
     int nCountTenth = 0;
-    uint256 nHigh = 0;
+    std::set<COutPoint> setTenth;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
-        CMasternode* pmn = Find(s.second);
-        if (!pmn) break;
+        if (!Find(s.second)) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
-        if (n > nHigh) {
-            nHigh = n;
-            pBestMasternode = pmn;
-        }
+        setTenth.insert(s.second.prevout);
         nCountTenth++;
         if (nCountTenth >= nTenthNetwork) break;
     }
+
+    // the best of them is the first one found in the score table
+    const score_table_t* pScores = GetScoreTable(nBlockHeight - 100);
+    if (pScores == NULL) return NULL;
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        if (s.first == 0) break;
+        if (setTenth.count(s.second)) {
+            pBestMasternode = &mapMasternodes[s.second];
+            break;
+        }
+    }
     return pBestMasternode;
 }
 
@@ -547,7 +714,8 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+        CMasternode& mn = mnpair.second;
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -565,42 +733,73 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
+const CMasternodeMan::score_table_t* CMasternodeMan::GetScoreTable(int64_t nBlockHeight)
+{
+    LOCK(cs);
+
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    std::map<uint256, score_table_t>::iterator it = mapScoreTables.find(hash);
+    if (it != mapScoreTables.end()) return &it->second;
+
+    score_table_t& vScores = mapScoreTables[hash];
+    vScores.reserve(mapMasternodes.size());
+    BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes)
+        vScores.push_back(make_pair(mnpair.second.CalculateScore(1, nBlockHeight), mnpair.first));
+    sort(vScores.begin(), vScores.end(), CompareScoreOutPoint());
+
+    int64_t nHeight = nBlockHeight == 0 ? chainActive.Height() : nBlockHeight;
+    mapScoreTableHeights.insert(make_pair(nHeight, hash));
+    while (mapScoreTableHeights.size() > MASTERNODES_SCORE_CACHE_BLOCKS) {
+        mapScoreTables.erase(mapScoreTableHeights.begin()->second);
+        mapScoreTableHeights.erase(mapScoreTableHeights.begin());
+    }
+
+    it = mapScoreTables.find(hash);
+    return it == mapScoreTables.end() ? NULL : &it->second;
+}
+
+void CMasternodeMan::ClearScoreTables()
+{
+    LOCK(cs);
+    mapScoreTables.clear();
+    mapScoreTableHeights.clear();
+}
+
 CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    LOCK(cs);
+
+    const score_table_t* pScores = GetScoreTable(nBlockHeight);
+    if (pScores == NULL) return NULL;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // the winner is the enabled masternode with the highest score
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        if (s.first == 0) break;
+        CMasternode& mn = mapMasternodes[s.second];
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+        return &mn;
     }
 
-    return winner;
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
 
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const score_table_t* pScores = GetScoreTable(nBlockHeight);
+    if (pScores == NULL) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        CMasternode& mn = mapMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) {
             LogPrintf("Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -619,18 +818,9 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (s.second == vin.prevout) {
             return rank;
         }
     }
@@ -638,68 +828,85 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
     return -1;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+std::vector<pair<int, CTxIn> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
+
+    std::vector<pair<int, CTxIn> > vecMasternodeRanks;
 
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const score_table_t* pScores = GetScoreTable(nBlockHeight);
+    if (pScores == NULL) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // enabled masternodes by score, followed by the ones that aren't
+    std::vector<CTxIn> vecDisabled;
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        CMasternode& mn = mapMasternodes[s.second];
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vecDisabled.push_back(mn.vin);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        vecMasternodeRanks.push_back(make_pair(++rank, mn.vin));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    BOOST_FOREACH (const CTxIn& vin, vecDisabled)
+        vecMasternodeRanks.push_back(make_pair(++rank, vin));
+
+    return vecMasternodeRanks;
+}
+
+bool CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol, std::map<COutPoint, int>& mapRanksRet)
+{
+    LOCK(cs);
+
+    mapRanksRet.clear();
+
+    const score_table_t* pScores = GetScoreTable(nBlockHeight);
+    if (pScores == NULL) return false;
+
+    int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
+    bool fCheckAge = IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        CMasternode& mn = mapMasternodes[s.second];
+        if (mn.protocolVersion < minProtocol) continue;
+        if (fCheckAge && GetAdjustedTime() - mn.sigTime < nMasternode_Min_Age) continue;
+
+        mn.Check();
+        if (!mn.IsEnabled()) continue;
+
+        mapRanksRet[s.second] = ++rank;
     }
 
-    return vecMasternodeRanks;
+    return true;
 }
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
+
+    const score_table_t* pScores = GetScoreTable(nBlockHeight);
+    if (pScores == NULL) return NULL;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(uint256, COutPoint) & s, *pScores) {
+        CMasternode& mn = mapMasternodes[s.second];
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -722,6 +929,77 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+void CMasternodeMan::ProcessVerifiedMessages(bool fWait)
+{
+    LOCK(cs_process_message);
+
+    CMasternodeVerifyItem item;
+    while (masternodeverifyqueue.Pop(item, fWait)) {
+        if (item.fPing)
+            ProcessPing(item.pfrom, item.mnp);
+        else
+            ProcessBroadcast(item.pfrom, item.mnb);
+
+        {
+            LOCK(cs_vNodes);
+            item.pfrom->Release();
+        }
+    }
+}
+
+void CMasternodeMan::ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb)
+{
+    int nDoS = 0;
+    if (!mnb.CheckAndUpdate(nDoS)) {
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+
+        //failed
+        return;
+    }
+
+    // make sure the vout that was signed is related to the transaction that spawned the Masternode
+    //  - this is expensive, so it's only done once per Masternode
+    if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
+        LogPrintf("mnb - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 33);
+        return;
+    }
+
+    // make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
+    if (mnb.CheckInputsAndAdd(nDoS)) {
+        // use this as a peer
+        addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+    } else {
+        LogPrintf("mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
+
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+void CMasternodeMan::ProcessPing(CNode* pfrom, CMasternodePing& mnp)
+{
+    int nDoS = 0;
+    if (mnp.CheckAndUpdate(nDoS)) return;
+
+    if (nDoS > 0) {
+        // if anything significant failed, mark that node
+        Misbehaving(pfrom->GetId(), nDoS);
+    } else {
+        // if nothing significant failed, search existing Masternode list
+        CMasternode* pmn = Find(mnp.vin);
+        // if it's known, don't ask for the mnb, just return
+        if (pmn != NULL) return;
+    }
+
+    // something significant is broken or mn is unknown,
+    // we might have to ask for a masternode entry once
+    AskForMN(pfrom, mnp.vin);
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Obfuscation/Masternode related functionality
@@ -739,35 +1017,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
         mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
 
-        int nDoS = 0;
-        if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-
-            //failed
-            return;
-        }
-
-        // make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if (!obfuScationSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
-            LogPrintf("mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
-            return;
-        }
-
-        // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckObfuScationPool()
-        if (mnb.CheckInputsAndAdd(nDoS)) {
-            // use this as a peer
-            addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-        } else {
-            LogPrintf("mnb - Rejected Masternode entry %s\n", mnb.vin.prevout.hash.ToString());
-
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        // signatures are checked by the verify workers, see ProcessBroadcast
+        masternodeverifyqueue.Push(pfrom, &mnb, NULL);
+        ProcessVerifiedMessages(!masternodeverifyqueue.HasWorkers());
     }
 
     else if (strCommand == "mnp") { //Masternode Ping
@@ -779,22 +1031,9 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
         mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
 
-        int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
-
-        if (nDoS > 0) {
-            // if anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS);
-        } else {
-            // if nothing significant failed, search existing Masternode list
-            CMasternode* pmn = Find(mnp.vin);
-            // if it's known, don't ask for the mnb, just return
-            if (pmn != NULL) return;
-        }
-
-        // something significant is broken or mn is unknown,
-        // we might have to ask for a masternode entry once
-        AskForMN(pfrom, mnp.vin);
+        // queued behind any broadcast it may depend on, see ProcessPing
+        masternodeverifyqueue.Push(pfrom, NULL, &mnp);
+        ProcessVerifiedMessages(!masternodeverifyqueue.HasWorkers());
 
     } else if (strCommand == "dseg") { //Get Masternode list or specific entry
 
@@ -823,7 +1062,8 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (PAIRTYPE(const COutPoint, CMasternode) & mnpair, mapMasternodes) {
+            CMasternode& mn = mnpair.second;
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -942,6 +1182,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     LogPrint("masternode", "dsee - Got updated entry for %s\n", vin.prevout.hash.ToString());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
                         pmn->pubKeyMasternode = pubkey2;
+                        Reindex(*pmn);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
                         pmn->protocolVersion = protocolVersion;
@@ -1006,14 +1247,11 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
             // verify that sig time is legit in past
             // should be at least not earlier than block when 1000 LYRA tx got MASTERNODE_MIN_CONFIRMATIONS
-            uint256 hashBlock = 0;
-            CTransaction tx2;
-            GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-            if (mi != mapBlockIndex.end() && (*mi).second) {
-                CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 10000 LYRA tx -> 1 confirmation
-                CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if (pConfIndex->GetBlockTime() > sigTime) {
+            CTxOut txoutCollateral;
+            int nCollateralHeight; // block for 10000 LYRA tx -> 1 confirmation
+            if (masternodeCollaterals.GetOutput(vin.prevout, txoutCollateral, nCollateralHeight) && nCollateralHeight >= 0) {
+                CBlockIndex* pConfIndex = chainActive[nCollateralHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+                if (pConfIndex && pConfIndex->GetBlockTime() > sigTime) {
                     LogPrintf("mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                         sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
                     return;
@@ -1135,14 +1373,13 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    std::map<COutPoint, CMasternode>::iterator it = mapMasternodes.find(vin.prevout);
+    if (it != mapMasternodes.end() && it->second.vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", it->second.vin.prevout.hash.ToString(), size() - 1);
+        RemoveFromIndexes(vin.prevout);
+        masternodeCollaterals.Forget(vin.prevout);
+        mapMasternodes.erase(it);
+        ClearScoreTables();
     }
 }
 
@@ -1161,6 +1398,7 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
     } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+        Reindex(*pmn);
         masternodeSync.AddedMasternodeList(mnb.GetHash());
     }
 }
@@ -1169,7 +1407,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)mapMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -11,11 +11,13 @@
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
+#include "recordfile.h"
 #include "sync.h"
 #include "util.h"
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_BLOCKS 24
 
 using namespace std;
 
@@ -23,28 +25,27 @@ class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
+/** Worker checking the signatures of queued mnb/mnp messages, started -par times like ThreadScriptCheck */
+void ThreadMasternodeVerify();
 
 /** Access to the MN database (mncache.dat)
  */
 class CMasternodeDB
 {
 private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
+    CRecordFile file;
 
 public:
     enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
+        Ok = CRecordFile::Ok,
+        FileError = CRecordFile::FileError,
+        IncorrectMagicMessage = CRecordFile::IncorrectMagicMessage,
+        IncorrectMagicNumber = CRecordFile::IncorrectMagicNumber,
+        IncorrectFormat = CRecordFile::IncorrectFormat
     };
 
     CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
+    bool Write(CMasternodeMan& mnodemanToSave);
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
@@ -57,43 +58,63 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // map to hold all MNs, keyed by collateral outpoint. Entries are never moved,
+    // so a pointer returned by Find() stays valid until that entry is removed
+    std::map<COutPoint, CMasternode> mapMasternodes;
+    // lookup indexes into mapMasternodes by payee script and masternode pubkey
+    std::multimap<CScript, COutPoint> mapMasternodesByPayee;
+    std::multimap<CPubKey, COutPoint> mapMasternodesByPubKey;
+    // the payee script and pubkey each entry is currently indexed under
+    std::map<COutPoint, std::pair<CScript, CPubKey> > mapIndexedKeys;
     // who's asked for the Masternode list and the last time
-    std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
+    CRecordMap<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
-    std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
+    CRecordMap<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
-    std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    CRecordMap<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+
+    // all listed masternodes ordered by descending score for a block
+    typedef std::vector<std::pair<uint256, COutPoint> > score_table_t;
+    // score tables by block hash, dropped whenever the list changes
+    std::map<uint256, score_table_t> mapScoreTables;
+    std::multimap<int64_t, uint256> mapScoreTableHeights;
+
+    const score_table_t* GetScoreTable(int64_t nBlockHeight);
+    void ClearScoreTables();
+
+    void AddToIndexes(const CMasternode& mn);
+    void RemoveFromIndexes(const COutPoint& outpoint);
+    void RebuildIndexes();
+
+    void ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb);
+    void ProcessPing(CNode* pfrom, CMasternodePing& mnp);
 
 public:
     // Keep track of all broadcasts I've seen
-    map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
+    CRecordMap<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
-    map<uint256, CMasternodePing> mapSeenMasternodePing;
+    CRecordMap<uint256, CMasternodePing> mapSeenMasternodePing;
 
     // keep track of dsq count to prevent masternodes from gaming obfuscation queue
     int64_t nDsqCount;
 
-    ADD_SERIALIZE_METHODS;
-
-    template <typename Stream, typename Operation>
-    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
-    {
-        LOCK(cs);
-        READWRITE(vMasternodes);
-        READWRITE(mAskedUsForMasternodeList);
-        READWRITE(mWeAskedForMasternodeList);
-        READWRITE(mWeAskedForMasternodeListEntry);
-        READWRITE(nDsqCount);
-
-        READWRITE(mapSeenMasternodeBroadcast);
-        READWRITE(mapSeenMasternodePing);
-    }
+    /// Record types in mncache.dat
+    enum {
+        RECORD_MASTERNODE = 1,
+        RECORD_ASKED_US,
+        RECORD_WE_ASKED,
+        RECORD_WE_ASKED_ENTRY,
+        RECORD_DSQ_COUNT,
+        RECORD_SEEN_BROADCAST,
+        RECORD_SEEN_PING
+    };
 
     CMasternodeMan();
     CMasternodeMan(CMasternodeMan& other);
 
+    void WriteRecords(CRecordFile& file);
+    void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue);
+
     /// Add an entry
     bool Add(CMasternode& mn);
 
@@ -129,22 +150,23 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod = 1, int64_t nBlockHeight = 0, int minProtocol = 0);
 
-    std::vector<CMasternode> GetFullMasternodeVector()
-    {
-        Check();
-        return vMasternodes;
-    }
+    std::vector<CMasternode> GetFullMasternodeVector();
 
-    std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
+    std::vector<pair<int, CTxIn> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
+    /// The ranks GetMasternodeRank() gives to active masternodes at this height, computed in a single pass
+    bool GetMasternodeRanks(int64_t nBlockHeight, int minProtocol, std::map<COutPoint, int>& mapRanksRet);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
 
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+    /// Apply the queued mnb/mnp messages whose signatures were checked, in the order they arrived.
+    /// With fWait the whole queue is applied, checking what no worker picked up yet here
+    void ProcessVerifiedMessages(bool fWait);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return mapMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -153,6 +175,9 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Refresh the payee/pubkey indexes of a listed entry after its keys changed
+    void Reindex(const CMasternode& mn);
+
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 };
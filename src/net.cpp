@@ -24,6 +24,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -60,12 +65,70 @@ using namespace std;
 namespace
 {
 const int MAX_OUTBOUND_CONNECTIONS = 16;
+// How long ThreadSocketHandler waits for socket events when it has nothing else to do
+const int SOCKET_EVENTS_TIMEOUT_MS = 50;
+// Maximum number of events fetched by a single epoll_wait() call
+const int MAX_EPOLL_EVENTS = 256;
+// Receive straight into a message's payload buffer when at least this much of it is outstanding
+const unsigned int MIN_DIRECT_RECV_SIZE = 16 * 1024;
+// Limits on the receive buffers kept around for reuse
+const size_t MAX_POOLED_RECV_BUFFERS = 512;
+const size_t MAX_POOLED_RECV_BYTES = 16 * 1024 * 1024;
+// Maximum number of queued messages handed to a single sendmsg() call
+const size_t MAX_SEND_IOV = 64;
+
+/**
+ * Free list of message receive buffers. Buffers of processed messages are cleared (which keeps
+ * their capacity) and handed to the next incoming message instead of being freed, so message
+ * floods do not go through the allocator, and zero_after_free_allocator's cleanse of freed
+ * memory, for every message. Network data is public, so skipping the cleanse loses nothing.
+ *
+ * This is not an arena of shared buffers: each message still owns its payload in its own
+ * CDataStream, and the cleanse is still paid when a pooled buffer is evicted or has to grow.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+    size_t nPooledBytes;
+
+public:
+    CRecvBufferPool() : nPooledBytes(0) {}
+
+    void Acquire(CDataStream& vRecv)
+    {
+        LOCK(cs);
+        if (vFree.empty())
+            return;
+        nPooledBytes -= vFree.back().capacity();
+        vRecv.swap(vFree.back());
+        vFree.pop_back();
+    }
+
+    void Release(CDataStream& vRecv)
+    {
+        CSerializeData vch;
+        vRecv.swap(vch);
+        if (vch.capacity() == 0)
+            return;
+        vch.clear();
+
+        LOCK(cs);
+        if (vFree.size() >= MAX_POOLED_RECV_BUFFERS || nPooledBytes + vch.capacity() > MAX_POOLED_RECV_BYTES)
+            return;
+        nPooledBytes += vch.capacity();
+        vFree.push_back(CSerializeData());
+        vFree.back().swap(vch);
+    }
+};
 
 struct ListenSocket {
     SOCKET socket;
     bool whitelisted;
+    bool ready; // has pending connections, as last reported by the socket events backend
 
-    ListenSocket(SOCKET socket, bool whitelisted) : socket(socket), whitelisted(whitelisted) {}
+    ListenSocket(SOCKET socket, bool whitelisted) : socket(socket), whitelisted(whitelisted), ready(false) {}
 };
 }
 
@@ -82,13 +145,18 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+static CRecvBufferPool recvBufferPool;
 CAddrMan addrman;
 int nMaxConnections = 125;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
 bool fAddressesInitialized = false;
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpollFd = -1;
+#endif
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -376,6 +444,93 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == "select") {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+static bool IsServiceableSocket(SOCKET hSocket)
+{
+    // Only select() is limited to descriptors below FD_SETSIZE
+    return nSocketEventsMode == SOCKETEVENTS_EPOLL || IsSelectableSocket(hSocket);
+}
+
+static bool SocketEventsStart()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL || hEpollFd != -1)
+        return true;
+
+    hEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpollFd == -1)
+        return error("SocketEventsStart : epoll_create1 failed: %s", NetworkErrorString(WSAGetLastError()));
+
+    // Listen sockets are level-triggered and carry no node pointer
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            return error("SocketEventsStart : epoll_ctl failed for listen socket: %s", NetworkErrorString(WSAGetLastError()));
+    }
+#endif
+    return true;
+}
+
+static bool SocketEventsAddNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode != SOCKETEVENTS_EPOLL)
+        return true;
+
+    // Edge-triggered: readiness is latched into fHasRecvData/fCanSendData and only
+    // cleared by the socket thread once recv()/send() would block. The fd is dropped
+    // from the set by the kernel when CloseSocketDisconnect() closes it.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+#endif
+    return true;
+}
+
+// requires LOCK(cs_vSend)
+static void SocketEventsWaitSend(CNode* pnode)
+{
+    pnode->fCanSendData = false;
+#ifdef HAVE_SYS_EPOLL_H
+    // Re-arming reports the socket again if it became writable since send() failed,
+    // an edge that came in between would otherwise be lost
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpollFd != -1 && pnode->hSocket != INVALID_SOCKET) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = pnode;
+        if (epoll_ctl(hEpollFd, EPOLL_CTL_MOD, pnode->hSocket, &event) != 0)
+            LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+    }
+#endif
+}
+
+// requires LOCK(cs_vRecvMsg)
+static bool NodeWantsRecv(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMaster)
 {
     if (pszDest == NULL) {
@@ -404,7 +559,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -415,6 +570,8 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        if (!SocketEventsAddNode(pnode))
+            pnode->CloseSocketDisconnect();
 
         {
             LOCK(cs_vNodes);
@@ -608,6 +765,33 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
     return true;
 }
 
+char* CNode::GetRecvPayloadBuffer(unsigned int& nBytes)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < MIN_DIRECT_RECV_SIZE)
+        return NULL;
+    return msg.PrepareData(nBytes);
+}
+
+void CNode::ReceivedPayloadBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.CommitData(nBytes);
+
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_one();
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Release(vRecv);
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -638,18 +822,28 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
     return nCopy;
 }
 
-int CNetMessage::readData(const char* pch, unsigned int nBytes)
+char* CNetMessage::PrepareData(unsigned int& nBytes)
 {
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    nBytes = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() < nDataPos + nBytes) {
+        if (nDataPos == 0)
+            recvBufferPool.Acquire(vRecv);
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
+
+int CNetMessage::readData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = nBytes;
+    char* pchData = PrepareData(nCopy);
+
+    memcpy(pchData, pch, nCopy);
+    CommitData(nCopy);
 
     return nCopy;
 }
@@ -658,30 +852,61 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData& data = **it;
+        size_t nBatchSize = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nBatchSize, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to the kernel in a single call
+        struct iovec iov[MAX_SEND_IOV];
+        size_t nIov = 0;
+        size_t nBatchSize = 0;
+        for (std::deque<CSharedMessage>::iterator itBatch = it; itBatch != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; itBatch++, nIov++) {
+            const CSerializeData& data = **itBatch;
+            size_t nOffset = (itBatch == it) ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nBatchSize += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
-                pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+            // Pop the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                const CSerializeData& data = **it;
+                size_t nPart = std::min(nLeft, data.size() - pnode->nSendOffset);
+                pnode->nSendOffset += nPart;
+                nLeft -= nPart;
+                if (pnode->nSendOffset == data.size()) {
+                    pnode->nSendOffset = 0;
+                    pnode->nSendSize -= data.size();
+                    it++;
+                }
+            }
+            if ((size_t)nBytes < nBatchSize) {
+                // could not send everything; stop sending more
+                SocketEventsWaitSend(pnode);
                 break;
             }
         } else {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                if (nErr == WSAEWOULDBLOCK)
+                    SocketEventsWaitSend(pnode);
+                else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                     LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
                     pnode->CloseSocketDisconnect();
                 }
@@ -700,9 +925,140 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+static void SocketEventsWaitSelect()
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && NodeWantsRecv(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec / 1000);
+    }
+
+    // select() is level-triggered, so readiness is recomputed from scratch every round
+    BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket)
+        hListenSocket.ready = hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv);
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        SOCKET hSocket = pnode->hSocket;
+        bool fValid = hSocket != INVALID_SOCKET && hSocket <= hSocketMax;
+        pnode->fHasRecvData = fValid && (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError));
+        LOCK(pnode->cs_vSend);
+        pnode->fCanSendData = fValid && FD_ISSET(hSocket, &fdsetSend);
+    }
+}
+
+static void SocketEventsWaitEpoll(int nTimeout)
+{
+    BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket)
+        hListenSocket.ready = false;
+
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpollFd, events, MAX_EPOLL_EVENTS, nTimeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        }
+        return;
+    }
+
+    // Nodes are only deleted by this thread and their sockets are closed (and thereby removed
+    // from the epoll set) before that, so the node pointers returned here are still valid.
+    for (int i = 0; i < nEvents; i++) {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL) {
+            // A listen socket; there are only a handful, so just try accepting on all of them
+            BOOST_FOREACH (ListenSocket& hListenSocket, vhListenSocket)
+                hListenSocket.ready = true;
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fHasRecvData = true;
+        if (events[i].events & EPOLLOUT) {
+            LOCK(pnode->cs_vSend);
+            pnode->fCanSendData = true;
+        }
+    }
+#endif
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    // Set when a node still has latched readiness to service, so the next wait must not block
+    bool fMoreWork = false;
     while (true) {
         //
         // Disconnect nodes
@@ -763,86 +1119,16 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsWaitEpoll(fMoreWork ? 0 : SOCKET_EVENTS_TIMEOUT_MS);
+        else
+            SocketEventsWaitSelect();
 
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && hListenSocket.ready) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -865,7 +1151,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (!IsServiceableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -878,6 +1164,8 @@ void ThreadSocketHandler()
                     CNode* pnode = new CNode(hSocket, addr, "", true);
                     pnode->AddRef();
                     pnode->fWhitelisted = whitelisted;
+                    if (!SocketEventsAddNode(pnode))
+                        pnode->CloseSocketDisconnect();
 
                     {
                         LOCK(cs_vNodes);
@@ -897,6 +1185,7 @@ void ThreadSocketHandler()
             BOOST_FOREACH (CNode* pnode, vNodesCopy)
                 pnode->AddRef();
         }
+        fMoreWork = false;
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             boost::this_thread::interruption_point();
 
@@ -905,19 +1194,27 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            if (pnode->fHasRecvData) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
+                if (!lockRecv) {
+                    fMoreWork = true;
+                } else if (nSocketEventsMode == SOCKETEVENTS_SELECT || NodeWantsRecv(pnode)) {
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        unsigned int nRecvSize = sizeof(pchBuf);
+                        char* pchPayload = pnode->GetRecvPayloadBuffer(nRecvSize);
+                        int nBytes = recv(pnode->hSocket, pchPayload ? pchPayload : pchBuf, nRecvSize, MSG_DONTWAIT);
                         if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (pchPayload)
+                                pnode->ReceivedPayloadBytes(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // with edge-triggered events keep reading until recv() would block
+                            fMoreWork = true;
                         } else if (nBytes == 0) {
                             // socket closed gracefully
                             if (!pnode->fDisconnect)
@@ -926,7 +1223,9 @@ void ThreadSocketHandler()
                         } else if (nBytes < 0) {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fHasRecvData = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                                 pnode->CloseSocketDisconnect();
@@ -941,9 +1240,11 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (!lockSend)
+                    fMoreWork = true;
+                else if (pnode->fCanSendData && !pnode->vSendMsg.empty())
                     SocketSendData(pnode);
             }
 
@@ -1447,7 +1748,7 @@ bool BindListenPort(const CService& addrBind, string& strError, bool fWhiteliste
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket)) {
+    if (!IsServiceableSocket(hListenSocket)) {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
         return false;
@@ -1572,6 +1873,13 @@ void StartNode(boost::thread_group& threadGroup)
         addrman.size(), GetTimeMillis() - nStart);
     fAddressesInitialized = true;
 
+    if (!SocketEventsStart()) {
+        // select() only handles descriptors below FD_SETSIZE
+        nMaxConnections = std::max(std::min(nMaxConnections, (int)FD_SETSIZE - (int)vhListenSocket.size() - MIN_CORE_FILEDESCRIPTORS), 0);
+        LogPrintf("Falling back to select() for socket events, using at most %i connections\n", nMaxConnections);
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+    }
+
     if (semOutbound == NULL) {
         // initialize semaphore
         int nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, nMaxConnections);
@@ -1655,6 +1963,12 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpollFd != -1) {
+            close(hEpollFd);
+            hEpollFd = -1;
+        }
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1683,21 +1997,27 @@ void RelayTransaction(const CTransaction& tx)
     RelayTransaction(tx, ss);
 }
 
+// Keep a serialized copy of an announced item around, so getdata requests for it can be
+// answered without serializing it again for every peer
+static void AddRelayMessage(const CInv& inv, const CSharedMessage& msg)
+{
+    LOCK(cs_mapRelay);
+    // Expire old relay messages
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+
+    // Save original serialized message so newer versions are preserved
+    if (mapRelay.insert(std::make_pair(inv, msg)).second)
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+}
+
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+    AddRelayMessage(inv, MakeSharedMessage("tx", ss));
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (!pnode->fRelayTxes)
@@ -1713,7 +2033,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
-    CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CSharedMessage msg = MakeSharedMessage("ix", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1721,7 +2041,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -1735,6 +2055,12 @@ void RelayInv(CInv& inv)
     }
 }
 
+void RelayInv(CInv& inv, const CSharedMessage& msg)
+{
+    AddRelayMessage(inv, msg);
+    RelayInv(inv);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1914,10 +2240,13 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fHasRecvData = false;
+    fCanSendData = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
+    fPreferHeaderAndIDs = false;
     setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
@@ -1983,6 +2312,23 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+// Fill in the size and checksum of the message header at the start of ss; returns the payload size
+static unsigned int FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    return nSize;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2016,26 +2362,45 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    unsigned int nSize = FinalizeMessageHeader(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    CSerializeData* pdata = new CSerializeData();
+    ssSend.GetAndClear(*pdata);
+    vSendMsg.push_back(CSharedMessage(pdata));
+    nSendSize += pdata->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushSharedMessage(const CSharedMessage& msg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending shared message (%d bytes) peer=%d\n", msg->size(), id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+    ss << CMessageHeader(pszCommand, 0);
+    if (!ssPayload.empty())
+        ss.write(&ssPayload[0], ssPayload.size());
+    FinalizeMessageHeader(ss);
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSharedMessage(pdata);
+}
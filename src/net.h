@@ -28,6 +28,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -59,6 +60,28 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Upper bound for -maxconnections when sockets are watched with epoll instead of select() */
+static const int MAX_EPOLL_CONNECTIONS = 16384;
+#ifdef WIN32
+// Win32 LevelDB doesn't use filedescriptors, and the ones used for
+// accessing block files, don't count towards to fd_set size limit
+// anyway.
+static const int MIN_CORE_FILEDESCRIPTORS = 0;
+#else
+static const int MIN_CORE_FILEDESCRIPTORS = 150;
+#endif
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
+/** Readiness notification backends used by ThreadSocketHandler */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT, // select(), limited to FD_SETSIZE sockets
+    SOCKETEVENTS_EPOLL,  // edge-triggered epoll(7), Linux only
+};
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -78,6 +101,23 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode* pnode);
 
+/**
+ * A fully serialized network message, header included. Messages relayed to many peers are
+ * serialized once and the same buffer is queued on every peer's send queue.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+CSharedMessage MakeSharedMessage(const char* pszCommand, const CDataStream& ssPayload);
+
+template <typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    return MakeSharedMessage(pszCommand, ss);
+}
+bool SetSocketEventsMode(const std::string& strMode);
+
 typedef int NodeId;
 
 // Signals for message handling
@@ -125,10 +165,11 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -192,6 +233,9 @@ public:
         nTime = 0;
     }
 
+    // Hands vRecv's buffer back to the receive buffer pool
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -207,6 +251,11 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+
+    // Make room for up to nBytes of payload and return where it should be written.
+    // nBytes is clamped to the remaining payload size. Follow up with CommitData().
+    char* PrepareData(unsigned int& nBytes);
+    void CommitData(unsigned int nBytes) { nDataPos += nBytes; }
 };
 
 
@@ -221,9 +270,15 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Socket readiness as last reported by the socket events backend. With epoll these are
+    // edge-triggered, so they stay set until recv()/send() report that the socket would block.
+    // fCanSendData is also cleared by optimistic sends and is protected by cs_vSend.
+    bool fHasRecvData;
+    bool fCanSendData;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -254,6 +309,8 @@ public:
     // b) the peer may tell us in their version message that we should not relay tx invs
     //    until they have initialized their bloom filter.
     bool fRelayTxes;
+    // Peer asked ("sendcmpct") for new blocks to be announced as compact blocks
+    bool fPreferHeaderAndIDs;
     // Should be 'true' only if we connected to this node to actually mix funds.
     // In this case node will be released automatically via CMasternodeMan::ProcessMasternodeConnections().
     // Connecting to verify connectability/status or connecting for sending/relaying single message
@@ -346,6 +403,15 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // If a large part of the current message's payload is still outstanding, return a pointer
+    // into its buffer so the socket can be read straight into it, skipping ReceiveMsgBytes'
+    // copy. nBytes is clamped to the outstanding size. Follow up with ReceivedPayloadBytes().
+    char* GetRecvPayloadBuffer(unsigned int& nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedPayloadBytes(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -416,6 +482,9 @@ public:
 
     void PushVersion();
 
+    // Queue a message that was serialized once for many peers
+    void PushSharedMessage(const CSharedMessage& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -657,6 +726,7 @@ void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
+void RelayInv(CInv& inv, const CSharedMessage& msg);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
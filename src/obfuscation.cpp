@@ -7,6 +7,8 @@
 #include "coincontrol.h"
 #include "init.h"
 #include "main.h"
+#include "masternode-budget.h"
+#include "masternode-payments.h"
 #include "masternodeman.h"
 #include "script/sign.h"
 #include "swifttx.h"
@@ -2105,13 +2107,11 @@ bool CObfuScationSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
     CScript payee2;
     payee2 = GetScriptForDestination(pubkey.GetID());
 
-    CTransaction txVin;
-    uint256 hash;
-    if (GetTransaction(vin.prevout.hash, txVin, hash, true)) {
-        BOOST_FOREACH (CTxOut out, txVin.vout) {
-            if (out.nValue == GetCurrentCollateral() * COIN) {
-                if (out.scriptPubKey == payee2) return true;
-            }
+    CTxOut out;
+    int nHeight;
+    if (masternodeCollaterals.GetOutput(vin.prevout, out, nHeight)) {
+        if (out.nValue == GetCurrentCollateral() * COIN) {
+            if (out.scriptPubKey == payee2) return true;
         }
     }
 
@@ -2160,22 +2160,66 @@ bool CObfuScationSigner::SignMessage(std::string strMessage, std::string& errorM
     return true;
 }
 
-bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+static uint256 GetSignerCacheKey(const std::string& strMessage, const std::vector<unsigned char>& vchSig, uint256& hashMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    hashMessage = ss.GetHash();
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
-        errorMessage = _("Error recovering public key.");
-        return false;
+    CHashWriter ssKey(SER_GETHASH, 0);
+    ssKey << hashMessage;
+    ssKey << vchSig;
+    return ssKey.GetHash();
+}
+
+bool CObfuScationSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    uint256 hashMessage;
+    uint256 hashKey = GetSignerCacheKey(strMessage, vchSig, hashMessage);
+
+    CKeyID idSigner;
+    bool fCached = false;
+    {
+        LOCK(cs_signers);
+        std::map<uint256, CKeyID>::iterator it = mapRecoveredSigners.find(hashKey);
+        if (it != mapRecoveredSigners.end()) {
+            idSigner = it->second;
+            mapRecoveredSigners.erase(it);
+            fCached = true;
+        }
+    }
+
+    if (!fCached) {
+        CPubKey pubkey2;
+        if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
+            errorMessage = _("Error recovering public key.");
+            return false;
+        }
+        idSigner = pubkey2.GetID();
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && idSigner != pubkey.GetID())
+        LogPrintf("CObfuScationSigner::VerifyMessage -- keys don't match: %s %s\n", idSigner.ToString(), pubkey.GetID().ToString());
+
+    return (idSigner == pubkey.GetID());
+}
+
+void CObfuScationSigner::RecoverSigner(const std::string& strMessage, const std::vector<unsigned char>& vchSig)
+{
+    uint256 hashMessage;
+    uint256 hashKey = GetSignerCacheKey(strMessage, vchSig, hashMessage);
+
+    // a failed recovery is left for VerifyMessage to report
+    CPubKey pubkey;
+    if (!pubkey.RecoverCompact(hashMessage, vchSig))
+        return;
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    LOCK(cs_signers);
+    // messages rejected before their signature was checked never consume their entry
+    if (mapRecoveredSigners.size() >= OBFUSCATION_SIGNER_CACHE_SIZE)
+        mapRecoveredSigners.clear();
+    mapRecoveredSigners[hashKey] = pubkey.GetID();
 }
 
 bool CObfuscationQueue::Sign()
@@ -2292,6 +2336,9 @@ void ThreadCheckObfuScationPool()
         MilliSleep(1000);
         //LogPrintf("ThreadCheckObfuScationPool::check timeout\n");
 
+        // catch up with masternode messages still waiting for a verify worker
+        mnodeman.ProcessVerifiedMessages(true);
+
         // try to sync from all available nodes, one step at a time
         masternodeSync.Process();
 
@@ -2306,10 +2353,15 @@ void ThreadCheckObfuScationPool()
                 mnodeman.CheckAndRemove();
                 mnodeman.ProcessMasternodeConnections();
                 masternodePayments.CleanPaymentList();
-                CleanTransactionLocksList();
+                swiftTXManager.CheckAndRemove();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            // dumps only append what changed since the previous one
+            if (c % MASTERNODES_DUMP_SECONDS == 0) {
+                DumpMasternodes();
+                DumpBudgets();
+                DumpMasternodePayments();
+            }
 
             obfuScationPool.CheckTimeout();
             obfuScationPool.CheckForCompleteQueue();
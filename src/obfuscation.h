@@ -41,6 +41,9 @@ class CActiveMasternode;
 #define OBFUSCATION_QUEUE_TIMEOUT 30
 #define OBFUSCATION_SIGNING_TIMEOUT 15
 
+// signers recovered ahead of VerifyMessage, dropped when this many pile up unused
+#define OBFUSCATION_SIGNER_CACHE_SIZE 20000
+
 // used for anonymous relaying of inputs/outputs/sigs
 #define OBFUSCATION_RELAY_IN 1
 #define OBFUSCATION_RELAY_OUT 2
@@ -246,6 +249,11 @@ public:
  */
 class CObfuScationSigner
 {
+private:
+    CCriticalSection cs_signers;
+    // key ids recovered from (message hash, signature), consumed by VerifyMessage
+    std::map<uint256, CKeyID> mapRecoveredSigners;
+
 public:
     /// Is the inputs associated with this public key? (and there is 10000 LYRA - checking if valid masternode)
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
@@ -257,6 +265,8 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Recover the signer of a message in advance so that VerifyMessage only has to compare keys, safe to call from any thread
+    void RecoverSigner(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
 };
 
 /** Used to keep track of current status of Obfuscation pool
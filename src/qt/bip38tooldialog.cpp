@@ -227,7 +227,7 @@ void Bip38ToolDialog::on_importAddressButton_DEC_clicked()
 
         pwalletMain->mapKeyMetadata[vchAddress].nCreateTime = 1;
 
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+        if (!pwalletMain->AddKeyPubKey(key, pubkey) || !pwalletMain->SyncKeys()) {
             ui->statusLabel_DEC->setStyleSheet("QLabel { color: red; }");
             ui->statusLabel_DEC->setText(tr("Error Adding Key To Wallet"));
             return;
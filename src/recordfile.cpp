@@ -0,0 +1,241 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recordfile.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+CRecordFile::CRecordFile(const boost::filesystem::path& pathIn, const std::string& strMagicMessageIn) : path(pathIn),
+                                                                                                      strMagicMessage(strMagicMessageIn),
+                                                                                                      nPass(1),
+                                                                                                      nLiveSize(0),
+                                                                                                      nFileSize(0),
+                                                                                                      nReadEnd(0),
+                                                                                                      fSynced(false),
+                                                                                                      fTorn(false),
+                                                                                                      fileOut(NULL),
+                                                                                                      fCompact(false),
+                                                                                                      fWriteFailed(false)
+{
+}
+
+CRecordFile::~CRecordFile()
+{
+    if (fileOut)
+        fclose(fileOut);
+}
+
+CRecordFile::ReadResult CRecordFile::ReadHeader(CAutoFile& filein)
+{
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    int nVersion;
+    try {
+        // file specific magic message, network magic number and layout version
+        filein >> strMagicMessageTmp;
+        if (strMagicMessage != strMagicMessageTmp) {
+            error("%s : Invalid magic message in %s", __func__, path.string());
+            return IncorrectMagicMessage;
+        }
+
+        filein >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+            error("%s : Invalid network magic number in %s", __func__, path.string());
+            return IncorrectMagicNumber;
+        }
+
+        filein >> nVersion;
+    } catch (std::exception& e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    if (nVersion != RECORDFILE_VERSION) {
+        error("%s : Unsupported version %d of %s", __func__, nVersion, path.string());
+        return IncorrectFormat;
+    }
+
+    nFileSize = ftell(filein.Get());
+    nReadEnd = boost::filesystem::file_size(path);
+    fTorn = false;
+    return Ok;
+}
+
+bool CRecordFile::ReadNextRecord(CAutoFile& filein, uint8_t& nOp, uint8_t& nType, std::vector<unsigned char>& vchKey, std::vector<unsigned char>& vchValue)
+{
+    if (nFileSize >= nReadEnd)
+        return false;
+
+    uint32_t nChecksum;
+    try {
+        filein >> nOp >> nType >> vchKey >> vchValue >> nChecksum;
+    } catch (std::exception& e) {
+        LogPrintf("%s : %s ends in a partial record at %u, dropping it\n", __func__, path.filename().string(), nFileSize);
+        fTorn = true;
+        return false;
+    }
+
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord << nOp << nType << vchKey << vchValue;
+    uint256 hash = Hash(ssRecord.begin(), ssRecord.end());
+    if ((uint32_t)hash.GetLow64() != nChecksum || (nOp != RECORD_WRITE && nOp != RECORD_ERASE)) {
+        LogPrintf("%s : Damaged record in %s at %u, ignoring the rest of the file\n", __func__, path.filename().string(), nFileSize);
+        fTorn = true;
+        return false;
+    }
+
+    unsigned int nSize = ssRecord.size() + sizeof(nChecksum);
+    nFileSize += nSize;
+
+    record_key_t key(nType, vchKey);
+    std::map<record_key_t, CRecordInfo>::iterator it = mapRecords.find(key);
+    if (it != mapRecords.end()) {
+        nLiveSize -= it->second.nSize;
+        mapRecords.erase(it);
+    }
+    if (nOp == RECORD_WRITE) {
+        CRecordInfo& info = mapRecords[key];
+        info.nChecksum = Hash(vchValue.begin(), vchValue.end()).GetLow64();
+        info.nSize = nSize;
+        info.nPass = nPass;
+        nLiveSize += nSize;
+    }
+
+    return true;
+}
+
+bool CRecordFile::BeginWrite()
+{
+    assert(fileOut == NULL);
+
+    nPass++;
+    fWriteFailed = false;
+    setPartialTypes.clear();
+
+    // rewrite the file if what is on disk isn't known or mostly history
+    fCompact = !fSynced || nFileSize > 2 * nLiveSize + RECORDFILE_MIN_COMPACT_SIZE;
+
+    if (!fCompact) {
+        fileOut = fopen(path.string().c_str(), "ab");
+        if (fileOut == NULL)
+            return error("%s : Failed to open file %s", __func__, path.string());
+        return true;
+    }
+
+    // don't overwrite a file that belongs to another network or isn't ours
+    if (!fSynced) {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (!filein.IsNull()) {
+            ReadResult result = ReadHeader(filein);
+            if (result == IncorrectMagicMessage || result == IncorrectMagicNumber) {
+                LogPrintf("%s : %s is unknown or invalid, please fix it manually\n", __func__, path.filename().string());
+                return false;
+            }
+        }
+    }
+
+    boost::filesystem::path pathTmp = path.string() + ".new";
+    fileOut = fopen(pathTmp.string().c_str(), "wb");
+    if (fileOut == NULL)
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader << strMagicMessage;
+    ssHeader << FLATDATA(Params().MessageStart());
+    ssHeader << RECORDFILE_VERSION;
+    if (fwrite(&ssHeader[0], 1, ssHeader.size(), fileOut) != ssHeader.size())
+        fWriteFailed = true;
+
+    nFileSize = ssHeader.size();
+    nLiveSize = 0;
+    return true;
+}
+
+unsigned int CRecordFile::AppendRecord(uint8_t nOp, uint8_t nType, const std::vector<unsigned char>& vchKey, const CDataStream& ssValue)
+{
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord << nOp << nType << vchKey;
+    ssRecord << std::vector<unsigned char>(ssValue.begin(), ssValue.end());
+    uint256 hash = Hash(ssRecord.begin(), ssRecord.end());
+    ssRecord << (uint32_t)hash.GetLow64();
+
+    if (fwrite(&ssRecord[0], 1, ssRecord.size(), fileOut) != ssRecord.size())
+        fWriteFailed = true;
+
+    nFileSize += ssRecord.size();
+    return ssRecord.size();
+}
+
+void CRecordFile::WriteRecord(uint8_t nType, const std::vector<unsigned char>& vchKey, const CDataStream& ssValue)
+{
+    if (fileOut == NULL)
+        return;
+
+    uint64_t nChecksum = Hash(ssValue.begin(), ssValue.end()).GetLow64();
+    CRecordInfo& info = mapRecords[record_key_t(nType, vchKey)];
+    bool fNew = info.nPass == 0;
+
+    if (fCompact || fNew || info.nChecksum != nChecksum) {
+        if (!fCompact && !fNew)
+            nLiveSize -= info.nSize;
+        info.nChecksum = nChecksum;
+        info.nSize = AppendRecord(RECORD_WRITE, nType, vchKey, ssValue);
+        nLiveSize += info.nSize;
+    }
+    info.nPass = nPass;
+}
+
+void CRecordFile::EraseRecord(uint8_t nType, const std::vector<unsigned char>& vchKey)
+{
+    if (fileOut == NULL)
+        return;
+
+    std::map<record_key_t, CRecordInfo>::iterator it = mapRecords.find(record_key_t(nType, vchKey));
+    if (it == mapRecords.end())
+        return;
+
+    nLiveSize -= it->second.nSize;
+    AppendRecord(RECORD_ERASE, nType, vchKey, CDataStream(SER_DISK, CLIENT_VERSION));
+    mapRecords.erase(it);
+}
+
+bool CRecordFile::Commit()
+{
+    // whatever wasn't written in this pass is gone, except for the types that
+    // only wrote their changed keys and erased the rest themselves
+    std::map<record_key_t, CRecordInfo>::iterator it = mapRecords.begin();
+    while (it != mapRecords.end()) {
+        if (it->second.nPass == nPass || setPartialTypes.count(it->first.first)) {
+            ++it;
+            continue;
+        }
+        if (!fCompact) {
+            nLiveSize -= it->second.nSize;
+            AppendRecord(RECORD_ERASE, it->first.first, it->first.second, CDataStream(SER_DISK, CLIENT_VERSION));
+        }
+        mapRecords.erase(it++);
+    }
+
+    if (fflush(fileOut) != 0)
+        fWriteFailed = true;
+    FileCommit(fileOut);
+    fclose(fileOut);
+    fileOut = NULL;
+
+    if (fCompact && !fWriteFailed) {
+        boost::filesystem::path pathTmp = path.string() + ".new";
+        if (!RenameOver(pathTmp, path))
+            fWriteFailed = true;
+    }
+
+    // on failure start over with a fresh file next time
+    fSynced = !fWriteFailed;
+    if (fWriteFailed)
+        return error("%s : Failed to write %s", __func__, path.string());
+    return true;
+}
@@ -0,0 +1,291 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECORDFILE_H
+#define BITCOIN_RECORDFILE_H
+
+#include "clientversion.h"
+#include "streams.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Version of the record file layout, files with another version are recreated */
+static const int RECORDFILE_VERSION = 1;
+/** Appended history below this size never triggers a rewrite of the file */
+static const uint64_t RECORDFILE_MIN_COMPACT_SIZE = 1 << 20;
+
+/**
+ * Cache file made of independent key/value records, used for mncache.dat,
+ * mnpayments.dat and budget.dat.
+ *
+ * A dump only appends records for the entries that changed since the previous
+ * one, plus erase records for the ones that went away. Maps kept in a CRecordMap
+ * only serialize the keys touched since the last dump, other maps are serialized
+ * in full and compared against the checksum of their last record. Once the appended history
+ * outweighs the live data the file is rewritten from scratch. Every record carries
+ * its own checksum, so loading streams through the file one record at a time and
+ * a record torn by a crash only loses the changes written after it.
+ *
+ * The object being stored provides
+ *   void WriteRecords(CRecordFile& file);  calling Write()/WriteMap() for every entry
+ *   void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue);  pssValue is NULL for an erased entry
+ */
+template <typename K, typename V>
+class CRecordMap;
+
+class CRecordFile
+{
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+    CRecordFile(const boost::filesystem::path& pathIn, const std::string& strMagicMessageIn);
+    ~CRecordFile();
+
+    template <typename T>
+    ReadResult Read(T& obj)
+    {
+        LOCK(cs);
+
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return FileError;
+
+        ReadResult result = ReadHeader(filein);
+        if (result != Ok)
+            return result;
+
+        mapRecords.clear();
+        nLiveSize = 0;
+
+        uint8_t nOp, nType;
+        std::vector<unsigned char> vchKey, vchValue;
+        while (ReadNextRecord(filein, nOp, nType, vchKey, vchValue)) {
+            CDataStream ssKey(vchKey, SER_DISK, CLIENT_VERSION);
+            if (nOp == RECORD_ERASE) {
+                obj.ReadRecord(nType, ssKey, (CDataStream*)NULL);
+            } else {
+                CDataStream ssValue(vchValue, SER_DISK, CLIENT_VERSION);
+                obj.ReadRecord(nType, ssKey, &ssValue);
+            }
+        }
+
+        // appending after a torn record would hide everything behind it
+        fSynced = !fTorn;
+        return Ok;
+    }
+
+    template <typename T>
+    bool Write(T& obj)
+    {
+        LOCK(cs);
+
+        if (!BeginWrite())
+            return false;
+        obj.WriteRecords(*this);
+        return Commit();
+    }
+
+    /** Store the current value of an entry, only written out if it changed */
+    template <typename K, typename V>
+    void Write(uint8_t nType, const K& key, const V& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << value;
+        WriteRecord(nType, std::vector<unsigned char>(ssKey.begin(), ssKey.end()), ssValue);
+    }
+
+    template <typename K, typename V>
+    void WriteMap(uint8_t nType, const std::map<K, V>& mapIn)
+    {
+        for (typename std::map<K, V>::const_iterator it = mapIn.begin(); it != mapIn.end(); ++it)
+            Write(nType, it->first, it->second);
+    }
+
+    /** Only the keys changed since the last dump are looked at, unless the file is rewritten */
+    template <typename K, typename V>
+    void WriteMap(uint8_t nType, CRecordMap<K, V>& mapIn)
+    {
+        if (fCompact) {
+            WriteMap(nType, static_cast<const std::map<K, V>&>(mapIn));
+        } else {
+            // entries of this type that aren't written this time are kept
+            setPartialTypes.insert(nType);
+            for (typename std::set<K>::const_iterator it = mapIn.GetChanged().begin(); it != mapIn.GetChanged().end(); ++it) {
+                typename std::map<K, V>::const_iterator mi = mapIn.find(*it);
+                if (mi != mapIn.end())
+                    Write(nType, mi->first, mi->second);
+                else
+                    Erase(nType, *it);
+            }
+        }
+        mapIn.ClearChanged();
+    }
+
+    /** Drop an entry, only used while appending */
+    template <typename K>
+    void Erase(uint8_t nType, const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        EraseRecord(nType, std::vector<unsigned char>(ssKey.begin(), ssKey.end()));
+    }
+
+    uint64_t GetFileSize() const { return nFileSize; }
+    uint64_t GetLiveSize() const { return nLiveSize; }
+
+private:
+    enum {
+        RECORD_WRITE = 1,
+        RECORD_ERASE = 2
+    };
+
+    struct CRecordInfo {
+        uint64_t nChecksum;
+        unsigned int nSize;
+        unsigned int nPass;
+    };
+
+    typedef std::pair<uint8_t, std::vector<unsigned char> > record_key_t;
+
+    CCriticalSection cs;
+    boost::filesystem::path path;
+    std::string strMagicMessage;
+
+    // last record written for each live entry, to tell which ones changed
+    std::map<record_key_t, CRecordInfo> mapRecords;
+    // current dump, entries not written in it are erased. Loaded entries belong
+    // to pass 1, 0 marks an entry that was never written
+    unsigned int nPass;
+    // size of the latest record of every live entry, and of the whole file
+    uint64_t nLiveSize;
+    uint64_t nFileSize;
+    // size of the file being loaded
+    uint64_t nReadEnd;
+    // mapRecords matches what is on disk, appending is safe
+    bool fSynced;
+    // the last load stopped at a damaged record
+    bool fTorn;
+
+    // state of the dump in progress
+    FILE* fileOut;
+    bool fCompact;
+    bool fWriteFailed;
+    // record types written from their changed keys only
+    std::set<uint8_t> setPartialTypes;
+
+    ReadResult ReadHeader(CAutoFile& filein);
+    bool ReadNextRecord(CAutoFile& filein, uint8_t& nOp, uint8_t& nType, std::vector<unsigned char>& vchKey, std::vector<unsigned char>& vchValue);
+
+    bool BeginWrite();
+    void WriteRecord(uint8_t nType, const std::vector<unsigned char>& vchKey, const CDataStream& ssValue);
+    void EraseRecord(uint8_t nType, const std::vector<unsigned char>& vchKey);
+    unsigned int AppendRecord(uint8_t nOp, uint8_t nType, const std::vector<unsigned char>& vchKey, const CDataStream& ssValue);
+    bool Commit();
+};
+
+/**
+ * Map that remembers which keys were inserted, replaced or erased since the last
+ * dump. Changes made through iterators or references kept from earlier calls are
+ * not seen, maps whose values are updated that way are written with a plain
+ * std::map.
+ */
+template <typename K, typename V>
+class CRecordMap : public std::map<K, V>
+{
+public:
+    typedef std::map<K, V> base_type;
+    typedef typename base_type::iterator iterator;
+    typedef typename base_type::key_type key_type;
+    typedef typename base_type::value_type value_type;
+    typedef typename base_type::size_type size_type;
+
+    V& operator[](const key_type& key)
+    {
+        setChanged.insert(key);
+        return base_type::operator[](key);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        std::pair<iterator, bool> ret = base_type::insert(value);
+        if (ret.second)
+            setChanged.insert(value.first);
+        return ret;
+    }
+
+    void erase(iterator it)
+    {
+        setChanged.insert(it->first);
+        base_type::erase(it);
+    }
+
+    size_type erase(const key_type& key)
+    {
+        size_type n = base_type::erase(key);
+        if (n)
+            setChanged.insert(key);
+        return n;
+    }
+
+    void clear()
+    {
+        for (iterator it = base_type::begin(); it != base_type::end(); ++it)
+            setChanged.insert(it->first);
+        base_type::clear();
+    }
+
+    const std::set<K>& GetChanged() const { return setChanged; }
+    void ClearChanged() { setChanged.clear(); }
+
+private:
+    std::set<K> setChanged;
+};
+
+template <typename K, typename V>
+unsigned int GetSerializeSize(const CRecordMap<K, V>& m, int nType, int nVersion)
+{
+    return GetSerializeSize(static_cast<const std::map<K, V>&>(m), nType, nVersion);
+}
+
+template <typename Stream, typename K, typename V>
+void Serialize(Stream& os, const CRecordMap<K, V>& m, int nType, int nVersion)
+{
+    Serialize(os, static_cast<const std::map<K, V>&>(m), nType, nVersion);
+}
+
+template <typename Stream, typename K, typename V>
+void Unserialize(Stream& is, CRecordMap<K, V>& m, int nType, int nVersion)
+{
+    Unserialize(is, static_cast<std::map<K, V>&>(m), nType, nVersion);
+}
+
+/** Apply a record to the map it was written from */
+template <typename K, typename V>
+void ReadMapRecord(std::map<K, V>& mapOut, CDataStream& ssKey, CDataStream* pssValue)
+{
+    K key;
+    ssKey >> key;
+    if (pssValue == NULL) {
+        mapOut.erase(key);
+    } else {
+        *pssValue >> mapOut[key];
+    }
+}
+
+#endif // BITCOIN_RECORDFILE_H
@@ -63,6 +63,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"listsinceblock", 2},
         {"sendmany", 1},
         {"sendmany", 2},
+        {"sendbatch", 1},
+        {"sendbatch", 2},
+        {"sendbatch", 4},
         {"addmultisigaddress", 0},
         {"addmultisigaddress", 1},
         {"createmultisig", 0},
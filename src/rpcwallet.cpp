@@ -886,6 +886,110 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendbatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            "sendbatch \"fromaccount\" {\"address\":amount,...} ( minconf \"comment\" maxoutputs )\n"
+            "\nPay many addresses at once, for example a pool payout. The payments are split over as many\n"
+            "transactions as needed to keep each one standard, and all of them are broadcast together.\n"
+            "Only coins of single key addresses are spent. Every transaction of the batch is recorded in the\n"
+            "wallet, the ones the memory pool refused are not relayed and are reported with accepted false." +
+            HelpRequiringPassphrase() + "\n"
+                                        "\nArguments:\n"
+                                        "1. \"fromaccount\"         (string, required) The account to send the funds from, can be \"\" for the default account\n"
+                                        "2. \"amounts\"             (string, required) A json object with addresses and amounts\n"
+                                        "    {\n"
+                                        "      \"address\":amount   (numeric) The lyra address is the key, the numeric amount in btc is the value\n"
+                                        "      ,...\n"
+                                        "    }\n"
+                                        "3. minconf                 (numeric, optional, default=1) Only use the balance confirmed at least this many times.\n"
+                                        "4. \"comment\"             (string, optional) A comment\n"
+                                        "5. maxoutputs              (numeric, optional, default=" + strprintf("%u", DEFAULT_BATCH_MAX_OUTPUTS) + ") The most payments put in one transaction\n"
+                                        "\nResult:\n"
+                                        "[                          (json array of objects)\n"
+                                        "  {\n"
+                                        "    \"txid\":\"transactionid\",  (string) The id of a transaction of the batch\n"
+                                        "    \"accepted\":true|false      (boolean) If the memory pool accepted it and it was relayed\n"
+                                        "  }\n"
+                                        "  ,...\n"
+                                        "]\n"
+                                        "\nExamples:\n"
+                                        "\nSend two amounts to two different addresses:\n" +
+            HelpExampleCli("sendbatch", "\"tabby\" \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\"") +
+            "\nSend with at most 100 payments per transaction:\n" + HelpExampleCli("sendbatch", "\"tabby\" \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\" 6 \"payout\" 100") +
+            "\nAs a json rpc call\n" + HelpExampleRpc("sendbatch", "\"tabby\", \"{\\\"XwnLY9Tf7Zsef8gMGL2fhWA9ZmMjt4KPwg\\\":0.01,\\\"XuQQkwA4FYkq2XERzMY2CiAZhJTEDAbtcg\\\":0.02}\", 6, \"payout\", 100"));
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    string strComment;
+    if (params.size() > 3 && params[3].type() != null_type)
+        strComment = params[3].get_str();
+    unsigned int nMaxOutputs = DEFAULT_BATCH_MAX_OUTPUTS;
+    if (params.size() > 4) {
+        int nValue = params[4].get_int();
+        if (nValue <= 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maxoutputs must be positive");
+        nMaxOutputs = nValue;
+    }
+
+    set<CBitcoinAddress> setAddress;
+    vector<pair<CScript, CAmount> > vecSend;
+
+    CAmount totalAmount = 0;
+    BOOST_FOREACH (const Pair& s, sendTo) {
+        CBitcoinAddress address(s.name_);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid LYRA address: ") + s.name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ") + s.name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey = GetScriptForDestination(address.Get());
+        CAmount nAmount = AmountFromValue(s.value_);
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    CAmount nBalance = GetAccountBalance(strAccount, nMinDepth, ISMINE_SPENDABLE);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send
+    vector<CWalletTx> vwtx;
+    vector<boost::shared_ptr<CReserveKey> > vKeyChange;
+    CAmount nFeeRequired = 0;
+    string strFailReason;
+    bool fCreated = pwalletMain->CreateTransactionBatch(vecSend, nMaxOutputs, vwtx, vKeyChange, nFeeRequired, strFailReason);
+    if (!fCreated)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
+    BOOST_FOREACH (CWalletTx& wtx, vwtx) {
+        wtx.strFromAccount = strAccount;
+        if (!strComment.empty())
+            wtx.mapValue["comment"] = strComment;
+    }
+    // some transactions may be out already, so report each one instead of failing the call
+    vector<bool> vAccepted;
+    pwalletMain->CommitTransactionBatch(vwtx, vKeyChange, vAccepted);
+
+    Array result;
+    for (unsigned int i = 0; i < vwtx.size(); i++) {
+        Object entry;
+        entry.push_back(Pair("txid", vwtx[i].GetHash().GetHex()));
+        entry.push_back(Pair("accepted", (bool)vAccepted[i]));
+        result.push_back(entry);
+    }
+    return result;
+}
+
 // Defined in rpcmisc.cpp
 extern CScript _createmultisig_redeemScript(const Array& params);
 
@@ -286,6 +286,14 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the underlying buffer (including any already read part) with
+    // vchOther, without copying. Used to recycle network receive buffers.
+    void swap(vector_type& vchOther)
+    {
+        vch.swap(vchOther);
+        nReadPos = 0;
+    }
 };
 
 
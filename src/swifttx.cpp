@@ -17,12 +17,7 @@
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
-std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+CSwiftTXManager swiftTXManager;
 int nCompleteTXLocks;
 
 //txlock - Locks transaction
@@ -32,7 +27,14 @@ int nCompleteTXLocks;
 //         Send "txvote", CTransaction, Signature, Approve
 //step 3.) Top 1 masternode, waits for SWIFTTX_SIGNATURES_REQUIRED messages. Upon success, sends "txlock'
 
-void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
+CSwiftTXManager::CSwiftTXManager()
+{
+    nUnknownVotesTotal = 0;
+    vExpirySlots.resize(SWIFTTX_EXPIRY_SLOTS);
+    nNextExpirySlot = 0;
+}
+
+void CSwiftTXManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all obfuscation/masternode related functionality
     if (!IsSporkActive(SPORK_2_SWIFTTX)) return;
@@ -40,14 +42,13 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
     if (strCommand == "ix") {
         //LogPrintf("ProcessMessageSwiftTX::ix\n");
-        CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
+        if (HasTxLockRequest(tx.GetHash())) {
             return;
         }
 
@@ -79,7 +80,10 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            }
 
             LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -88,35 +92,37 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            bool fReprocess = false;
+            {
+                LOCK(cs);
+                mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
 
-            // can we get the conflicting transaction as proof?
+                // can we get the conflicting transaction as proof?
 
-            LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : rejected %s\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str());
+                LogPrintf("ProcessMessageSwiftTX::ix - Transaction Lock Request: %s %s : rejected %s\n",
+                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                    tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
+                LockInputs(tx);
 
-            // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()) {
-                //we only care if we have a complete tx lock
-                if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-                    if (!CheckForConflictingLocks(tx)) {
-                        LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                // resolve conflicts
+                std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+                if (i != mapTxLocks.end()) {
+                    //we only care if we have a complete tx lock
+                    if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
+                        if (!CheckForConflictingLocks(tx)) {
+                            LogPrintf("ProcessMessageSwiftTX::ix - Found Existing Complete IX Lock\n");
+
+                            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                            fReprocess = true;
+                        }
                     }
                 }
             }
 
+            //reprocess the last 15 blocks
+            if (fReprocess) ReprocessBlocks(15);
+
             return;
         }
     } else if (strCommand == "txlvote") //SwiftTX Lock Consensus Votes
@@ -127,11 +133,15 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockVote.count(ctx.GetHash())) {
-            return;
-        }
+        // a vote is only ever verified once
+        {
+            LOCK(cs);
+            if (mapTxLockVote.count(ctx.GetHash())) {
+                return;
+            }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+            mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+        }
 
         if (ProcessConsensusVote(pfrom, ctx)) {
             //Spam/Dos protection
@@ -140,19 +150,25 @@ void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& v
                 This tracks those messages and allows it at the same rate of the rest of the network, if
                 a peer violates it, it will simply be ignored
             */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+            {
+                LOCK(cs);
+                if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
+                    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(ctx.vinMasternode.prevout.hash);
+                    if (it == mapUnknownVotes.end()) {
+                        it = mapUnknownVotes.insert(make_pair(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10))).first;
+                        nUnknownVotesTotal += (*it).second;
+                    }
 
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
+                    if ((*it).second > GetTime() &&
+                        (*it).second - GetAverageVoteTime() > 60 * 10) {
+                        LogPrintf("ProcessMessageSwiftTX::ix - masternode is spamming transaction votes: %s %s\n",
+                            ctx.vinMasternode.ToString().c_str(),
+                            ctx.txHash.ToString().c_str());
+                        return;
+                    } else {
+                        nUnknownVotesTotal += GetTime() + (60 * 10) - (*it).second;
+                        (*it).second = GetTime() + (60 * 10);
+                    }
                 }
             }
             RelayInv(inv);
@@ -209,7 +225,7 @@ bool IsIXTXValid(const CTransaction& txCollateral)
     return true;
 }
 
-int64_t CreateNewLock(CTransaction tx)
+int64_t CSwiftTXManager::CreateNewLock(const CTransaction& tx)
 {
     int64_t nTxAge = 0;
     BOOST_REVERSE_FOREACH (CTxIn i, tx.vin) {
@@ -217,6 +233,10 @@ int64_t CreateNewLock(CTransaction tx)
         if (nTxAge < 5) //1 less than the "send IX" gui requires, incase of a block propagating the network at the time
         {
             LogPrintf("CreateNewLock - Transaction not found / too new: %d / %s\n", nTxAge, tx.GetHash().ToString().c_str());
+
+            // a lock without a block height never counts signatures, but it expires with the request
+            LOCK(cs);
+            GetOrCreateLock(tx.GetHash());
             return 0;
         }
     }
@@ -228,30 +248,170 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
-    if (!mapTxLocks.count(tx.GetHash())) {
-        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
+    LOCK(cs);
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
-    } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
+    if (!mapTxLocks.count(tx.GetHash()))
+        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
+    else
         LogPrint("swifttx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
-    }
 
+    GetOrCreateLock(tx.GetHash()).nBlockHeight = nBlockHeight;
 
     return nBlockHeight;
 }
 
+void CSwiftTXManager::AddTxLockRequest(const CTransaction& tx)
+{
+    {
+        LOCK(cs);
+        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+    }
+    CreateNewLock(tx);
+}
+
+// Requires cs
+CTransactionLock& CSwiftTXManager::GetOrCreateLock(const uint256& txHash)
+{
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it != mapTxLocks.end()) return (*it).second;
+
+    CTransactionLock newLock;
+    newLock.nBlockHeight = 0;
+    newLock.nExpiration = GetTime() + (60 * 60); //locks expire after 60 minutes (24 confirmations)
+    newLock.nTimeout = GetTime() + (60 * 5);
+    newLock.txHash = txHash;
+    ScheduleExpiry(txHash, newLock.nExpiration);
+
+    return mapTxLocks.insert(make_pair(txHash, newLock)).first->second;
+}
+
+// Requires cs. A lock may sit in several slots, only the slot matching its current expiration removes it
+void CSwiftTXManager::ScheduleExpiry(const uint256& txHash, int64_t nExpiration)
+{
+    if (nNextExpirySlot == 0) nNextExpirySlot = GetTime() / SWIFTTX_EXPIRY_SLOT_SECONDS;
+
+    int64_t nSlot = nExpiration / SWIFTTX_EXPIRY_SLOT_SECONDS;
+    nSlot = std::max(nSlot, nNextExpirySlot);
+    nSlot = std::min(nSlot, nNextExpirySlot + SWIFTTX_EXPIRY_SLOTS - 1);
+
+    vExpirySlots[nSlot % SWIFTTX_EXPIRY_SLOTS].push_back(txHash);
+}
+
+// Requires cs
+void CSwiftTXManager::LockInputs(const CTransaction& tx)
+{
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        if (!mapLockedInputs.count(in.prevout)) {
+            mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+        }
+    }
+}
+
+bool CSwiftTXManager::HasTxLockRequest(const uint256& txHash)
+{
+    LOCK(cs);
+    return mapTxLockReq.count(txHash) || mapTxLockReqRejected.count(txHash);
+}
+
+bool CSwiftTXManager::GetTxLockRequest(const uint256& txHash, CTransaction& txRet)
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransaction>::iterator it = mapTxLockReq.find(txHash);
+    if (it == mapTxLockReq.end()) return false;
+
+    txRet = (*it).second;
+    return true;
+}
+
+bool CSwiftTXManager::HasTxLockVote(const uint256& nVoteHash)
+{
+    LOCK(cs);
+    return mapTxLockVote.count(nVoteHash);
+}
+
+bool CSwiftTXManager::GetTxLockVote(const uint256& nVoteHash, CConsensusVote& voteRet)
+{
+    LOCK(cs);
+
+    std::map<uint256, CConsensusVote>::iterator it = mapTxLockVote.find(nVoteHash);
+    if (it == mapTxLockVote.end()) return false;
+
+    voteRet = (*it).second;
+    return true;
+}
+
+bool CSwiftTXManager::GetConflictingLock(const CTransaction& tx, uint256& txHashLockedRet)
+{
+    LOCK(cs);
+
+    if (mapLockedInputs.empty()) return false;
+
+    BOOST_FOREACH (const CTxIn& in, tx.vin) {
+        std::map<COutPoint, uint256>::iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && (*it).second != tx.GetHash()) {
+            txHashLockedRet = (*it).second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int CSwiftTXManager::GetSignatures(const uint256& txHash)
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end()) return -1;
+
+    return (*it).second.CountSignatures();
+}
+
+bool CSwiftTXManager::IsTimedOut(const uint256& txHash)
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end()) return false;
+
+    return GetTime() > (*it).second.nTimeout;
+}
+
+int CSwiftTXManager::GetMasternodeRank(const CTxIn& vin, int nBlockHeight)
+{
+    {
+        LOCK(cs);
+        std::map<int, std::pair<int64_t, std::map<COutPoint, int> > >::iterator it = mapMasternodeRanks.find(nBlockHeight);
+        if (it != mapMasternodeRanks.end() && (*it).second.first > GetTime() - SWIFTTX_RANK_CACHE_SECONDS) {
+            std::map<COutPoint, int>::iterator itRank = (*it).second.second.find(vin.prevout);
+            return itRank == (*it).second.second.end() ? -1 : (*itRank).second;
+        }
+    }
+
+    // rank every masternode of this height at once, outside of cs
+    std::map<COutPoint, int> mapRanks;
+    if (!mnodeman.GetMasternodeRanks(nBlockHeight, MIN_SWIFTTX_PROTO_VERSION, mapRanks)) return -1;
+
+    std::map<COutPoint, int>::iterator itRank = mapRanks.find(vin.prevout);
+    int nRank = itRank == mapRanks.end() ? -1 : (*itRank).second;
+
+    LOCK(cs);
+    std::pair<int64_t, std::map<COutPoint, int> >& entry = mapMasternodeRanks[nBlockHeight];
+    entry.first = GetTime();
+    entry.second.swap(mapRanks);
+    while (mapMasternodeRanks.size() > SWIFTTX_RANK_CACHE_HEIGHTS)
+        mapMasternodeRanks.erase(mapMasternodeRanks.begin());
+
+    return nRank;
+}
+
 // check if we need to vote on this transaction
-void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
+void CSwiftTXManager::DoConsensusVote(const CTransaction& tx, int64_t nBlockHeight)
 {
     if (!fMasterNode) return;
 
-    int n = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    int n = GetMasternodeRank(activeMasternode.vin, nBlockHeight);
 
     if (n == -1) {
         LogPrint("swifttx", "SwiftTX::DoConsensusVote - Unknown Masternode\n");
@@ -281,16 +441,19 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    {
+        LOCK(cs);
+        mapTxLockVote[ctx.GetHash()] = ctx;
+    }
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
     RelayInv(inv);
 }
 
 //received a consensus vote
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
+bool CSwiftTXManager::ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    int n = GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight);
 
     CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
     if (pmn != NULL)
@@ -315,71 +478,63 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         return false;
     }
 
-    if (!mapTxLocks.count(ctx.txHash)) {
-        LogPrintf("SwiftTX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+    bool fLockComplete = false;
+    bool fReprocess = false;
+    {
+        LOCK(cs);
 
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime() + (60 * 60);
-        newLock.nTimeout = GetTime() + (60 * 5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else
-        LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
+        if (!mapTxLocks.count(ctx.txHash))
+            LogPrintf("SwiftTX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
+        else
+            LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()) {
-        (*i).second.AddSignature(ctx);
+        //compile consessus vote
+        CTransactionLock& txLock = GetOrCreateLock(ctx.txHash);
+        txLock.AddSignature(ctx);
 
-#ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if (pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
-#endif
+        LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", txLock.CountSignatures(), ctx.GetHash().ToString().c_str());
 
-        LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+        if (txLock.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
+            LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", txLock.GetHash().ToString().c_str());
 
-        if ((*i).second.CountSignatures() >= SWIFTTX_SIGNATURES_REQUIRED) {
-            LogPrint("swifttx", "SwiftTX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+            CTransaction tx;
+            std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(ctx.txHash);
+            if (itReq != mapTxLockReq.end()) tx = (*itReq).second;
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
             if (!CheckForConflictingLocks(tx)) {
-#ifdef ENABLE_WALLET
-                if (pwalletMain) {
-                    if (pwalletMain->UpdatedTransaction((*i).second.txHash)) {
-                        nCompleteTXLocks++;
-                    }
-                }
-#endif
+                fLockComplete = true;
 
-                if (mapTxLockReq.count(ctx.txHash)) {
-                    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                        if (!mapLockedInputs.count(in.prevout)) {
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
+                if (itReq != mapTxLockReq.end()) LockInputs(tx);
 
                 // resolve conflicts
 
                 //if this tx lock was rejected, we need to remove the conflicting blocks
-                if (mapTxLockReqRejected.count((*i).second.txHash)) {
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
-                }
+                fReprocess = mapTxLockReqRejected.count(ctx.txHash);
             }
         }
-        return true;
     }
 
+#ifdef ENABLE_WALLET
+    if (pwalletMain) {
+        LOCK(pwalletMain->cs_wallet);
 
-    return false;
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        if (pwalletMain->mapRequestCount.count(ctx.txHash))
+            pwalletMain->mapRequestCount[ctx.txHash]++;
+
+        if (fLockComplete && pwalletMain->UpdatedTransaction(ctx.txHash))
+            nCompleteTXLocks++;
+    }
+#endif
+
+    //reprocess the last 15 blocks
+    if (fReprocess) ReprocessBlocks(15);
+
+    return true;
 }
 
-bool CheckForConflictingLocks(CTransaction& tx)
+// Requires cs
+bool CSwiftTXManager::CheckForConflictingLocks(const CTransaction& tx)
 {
     /*
         It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
@@ -389,60 +544,80 @@ bool CheckForConflictingLocks(CTransaction& tx)
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("SwiftTX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
+        std::map<COutPoint, uint256>::iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && (*it).second != tx.GetHash()) {
+            LogPrintf("SwiftTX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), (*it).second.ToString().c_str());
+
+            uint256 vHashes[2] = {tx.GetHash(), (*it).second};
+            for (int i = 0; i < 2; i++) {
+                std::map<uint256, CTransactionLock>::iterator itLock = mapTxLocks.find(vHashes[i]);
+                if (itLock == mapTxLocks.end()) continue;
+                (*itLock).second.nExpiration = GetTime();
+                ScheduleExpiry(vHashes[i], (*itLock).second.nExpiration);
             }
+            return true;
         }
     }
 
     return false;
 }
 
-int64_t GetAverageVoteTime()
+// Requires cs
+int64_t CSwiftTXManager::GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
+    if (mapUnknownVotes.empty()) return 0;
 
-    return total / count;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
 }
 
-void CleanTransactionLocksList()
+void CSwiftTXManager::CheckAndRemove()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    LOCK(cs);
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    int64_t nNow = GetTime();
+    int64_t nSlotNow = nNow / SWIFTTX_EXPIRY_SLOT_SECONDS;
+    if (nNextExpirySlot == 0) nNextExpirySlot = nSlotNow;
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+    // after a long pause every slot is visited once
+    nNextExpirySlot = std::max(nNextExpirySlot, nSlotNow - SWIFTTX_EXPIRY_SLOTS + 1);
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+    while (nNextExpirySlot <= nSlotNow) {
+        std::vector<uint256> vTxHashes;
+        vTxHashes.swap(vExpirySlots[nNextExpirySlot % SWIFTTX_EXPIRY_SLOTS]);
+        nNextExpirySlot++;
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+        BOOST_FOREACH (const uint256& txHash, vTxHashes) {
+            std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+            if (it == mapTxLocks.end()) continue;
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
+            if (nNow <= it->second.nExpiration) { //keep them for an hour
+                ScheduleExpiry(txHash, it->second.nExpiration);
+                continue;
             }
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+
+            const CTransaction* ptx = NULL;
+            if (mapTxLockReq.count(txHash))
+                ptx = &mapTxLockReq[txHash];
+            else if (mapTxLockReqRejected.count(txHash))
+                ptx = &mapTxLockReqRejected[txHash];
+            if (ptx) {
+                BOOST_FOREACH (const CTxIn& in, ptx->vin) {
+                    std::map<COutPoint, uint256>::iterator itInput = mapLockedInputs.find(in.prevout);
+                    if (itInput != mapLockedInputs.end() && itInput->second == txHash)
+                        mapLockedInputs.erase(itInput);
+                }
+            }
+            mapTxLockReq.erase(txHash);
+            mapTxLockReqRejected.erase(txHash);
+
+            BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
+
+            mapTxLocks.erase(it);
         }
     }
 }
@@ -503,10 +678,11 @@ bool CConsensusVote::Sign()
 }
 
 
+// Votes only get into a lock after their signature was checked, so only the ranks are checked again
 bool CTransactionLock::SignaturesValid()
 {
-    BOOST_FOREACH (CConsensusVote vote, vecConsensusVotes) {
-        int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_SWIFTTX_PROTO_VERSION);
+    BOOST_FOREACH (const CConsensusVote& vote, vecConsensusVotes) {
+        int n = swiftTXManager.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight);
 
         if (n == -1) {
             LogPrintf("CTransactionLock::SignaturesValid() - Unknown Masternode\n");
@@ -517,11 +693,6 @@ bool CTransactionLock::SignaturesValid()
             LogPrintf("CTransactionLock::SignaturesValid() - Masternode not in the top %s\n", SWIFTTX_SIGNATURES_TOTAL);
             return false;
         }
-
-        if (!vote.SignatureValid()) {
-            LogPrintf("CTransactionLock::SignaturesValid() - Signature not valid\n");
-            return false;
-        }
     }
 
     return true;
@@ -542,7 +713,7 @@ int CTransactionLock::CountSignatures()
     if (nBlockHeight == 0) return -1;
 
     int n = 0;
-    BOOST_FOREACH (CConsensusVote v, vecConsensusVotes) {
+    BOOST_FOREACH (const CConsensusVote& v, vecConsensusVotes) {
         if (v.nBlockHeight == nBlockHeight) {
             n++;
         }
@@ -32,37 +32,23 @@ using namespace boost;
 class CConsensusVote;
 class CTransaction;
 class CTransactionLock;
+class CSwiftTXManager;
 
 static const int MIN_SWIFTTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
-extern int nCompleteTXLocks;
+// lock expiry runs on a wheel of one minute slots covering the hour a lock is kept
+static const int SWIFTTX_EXPIRY_SLOT_SECONDS = 60;
+static const int SWIFTTX_EXPIRY_SLOTS = 64;
 
+// masternode ranks are cached for this many heights, and recomputed when older than this
+static const unsigned int SWIFTTX_RANK_CACHE_HEIGHTS = 10;
+static const int64_t SWIFTTX_RANK_CACHE_SECONDS = 60;
 
-int64_t CreateNewLock(CTransaction tx);
+extern CSwiftTXManager swiftTXManager;
+extern int nCompleteTXLocks;
 
 bool IsIXTXValid(const CTransaction& txCollateral);
 
-// if two conflicting locks are approved by the network, they will cancel out
-bool CheckForConflictingLocks(CTransaction& tx);
-
-void ProcessMessageSwiftTX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
-
-//check if we need to vote on this transaction
-void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
-
-//process consensus vote message
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
-
-// keep transaction locks in memory for an hour
-void CleanTransactionLocksList();
-
-int64_t GetAverageVoteTime();
-
 class CConsensusVote
 {
 public:
@@ -107,5 +93,68 @@ public:
     }
 };
 
+//
+// SwiftTX Manager : lock requests, their votes and the inputs they lock
+//
+class CSwiftTXManager
+{
+private:
+    // critical section to protect the inner data structures, never held while calling into
+    // validation or the wallet
+    mutable CCriticalSection cs;
+
+    map<uint256, CTransaction> mapTxLockReq;
+    map<uint256, CTransaction> mapTxLockReqRejected;
+    map<uint256, CConsensusVote> mapTxLockVote;
+    map<uint256, CTransactionLock> mapTxLocks;
+    map<COutPoint, uint256> mapLockedInputs;
+    map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
+    int64_t nUnknownVotesTotal;
+
+    // txids of the locks expiring in each slot, entries of locks already gone are skipped
+    std::vector<std::vector<uint256> > vExpirySlots;
+    int64_t nNextExpirySlot;
+
+    // block height -> (time computed, masternode ranks)
+    map<int, std::pair<int64_t, std::map<COutPoint, int> > > mapMasternodeRanks;
+
+    void ScheduleExpiry(const uint256& txHash, int64_t nExpiration);
+    CTransactionLock& GetOrCreateLock(const uint256& txHash);
+    void LockInputs(const CTransaction& tx);
+    bool CheckForConflictingLocks(const CTransaction& tx);
+    int64_t GetAverageVoteTime();
+
+    //check if we need to vote on this transaction
+    void DoConsensusVote(const CTransaction& tx, int64_t nBlockHeight);
+    //process consensus vote message
+    bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
+
+public:
+    CSwiftTXManager();
+
+    void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+
+    int64_t CreateNewLock(const CTransaction& tx);
+    /// Lock request for one of our own transactions
+    void AddTxLockRequest(const CTransaction& tx);
+
+    bool HasTxLockRequest(const uint256& txHash);
+    bool GetTxLockRequest(const uint256& txHash, CTransaction& txRet);
+    bool HasTxLockVote(const uint256& nVoteHash);
+    bool GetTxLockVote(const uint256& nVoteHash, CConsensusVote& voteRet);
+
+    /// Find an input of tx locked by another transaction
+    bool GetConflictingLock(const CTransaction& tx, uint256& txHashLockedRet);
+    /// Number of votes for the lock of this transaction, -1 if there is none
+    int GetSignatures(const uint256& txHash);
+    bool IsTimedOut(const uint256& txHash);
+
+    /// Rank as in CMasternodeMan::GetMasternodeRank, cached per block height
+    int GetMasternodeRank(const CTxIn& vin, int nBlockHeight);
+
+    // keep transaction locks in memory for an hour
+    void CheckAndRemove();
+};
+
 
 #endif
@@ -0,0 +1,131 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildStakeBlock()
+{
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.nTime = 1530000000;
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].scriptSig = CScript() << OP_11;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(uint256(1), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txCoinStake.vout[1].nValue = 50000LL;
+    block.vtx.push_back(txCoinStake);
+
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(2 + i), 0);
+        tx.vin[0].scriptSig = CScript() << OP_11;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 1000LL;
+        block.vtx.push_back(tx);
+    }
+
+    block.vchBlockSig.assign(72, 0x30);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(compact_stake_block_roundtrip)
+{
+    CBlock block = BuildStakeBlock();
+    BOOST_CHECK(block.IsProofOfStake());
+
+    CTxMemPool pool(CFeeRate(0));
+    pool.addUnchecked(block.vtx[2].GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+    std::vector<CTransaction> vExtra(1, block.vtx[4]);
+
+    CBlockHeaderAndShortTxIDs cmpctblockOut(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblockOut;
+
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    stream >> cmpctblock;
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, vExtra) == READ_STATUS_OK);
+    // Coinbase and coinstake are prefilled, one tx from the mempool, one from the extra pool
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+    BOOST_CHECK(partialBlock.IsTxAvailable(4));
+
+    std::vector<uint16_t> vMissing = partialBlock.GetMissingIndexes();
+    BOOST_CHECK_EQUAL(vMissing.size(), 1);
+    BOOST_CHECK_EQUAL(vMissing[0], 3);
+
+    CBlock blockOut;
+    std::vector<CTransaction> vMissingTx(1, block.vtx[3]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vMissingTx) == READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK(blockOut.hashMerkleRoot == block.hashMerkleRoot);
+    BOOST_CHECK(blockOut.vchBlockSig == block.vchBlockSig);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_wrong_txn)
+{
+    CBlock block = BuildStakeBlock();
+    CTxMemPool pool(CFeeRate(0));
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetMissingIndexes().size(), 3);
+
+    // Too few transactions is invalid, the wrong ones fail the merkle check
+    CBlock blockOut;
+    std::vector<CTransaction> vWrong(3, block.vtx[2]);
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, vWrong) == READ_STATUS_FAILED);
+
+    PartiallyDownloadedBlock partialBlock2(&pool);
+    BOOST_CHECK(partialBlock2.InitData(cmpctblock, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock2.FillBlock(blockOut, std::vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(transactions_request_serialization)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = uint256(42);
+    req1.indexes.push_back(0);
+    req1.indexes.push_back(1);
+    req1.indexes.push_back(3);
+    req1.indexes.push_back(4);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK(req1.blockhash == req2.blockhash);
+    BOOST_CHECK(req1.indexes == req2.indexes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "clientversion.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+static CBlock BuildBlock(int nTxs)
+{
+    CBlock block;
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].scriptSig = CScript() << OP_11;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    for (int i = 0; i < nTxs; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(1000 + i), i);
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = GetScriptForDestination(CKeyID(uint160(i + 1)));
+        tx.vout[0].nValue = 1000;
+        tx.vout[1].scriptPubKey = GetScriptForDestination(CScriptID(uint160(5000 + i)));
+        tx.vout[1].nValue = 2000;
+        block.vtx.push_back(tx);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    CBlock block = BuildBlock(100);
+    CBlockFilter filter(block);
+    // a key hash and a script hash per transaction plus the spent outpoints
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 300);
+    BOOST_CHECK_EQUAL(filter.Decode().size(), 300);
+
+    // every element of the block is found
+    for (int i = 0; i < 100; i++) {
+        CBlockFilterQuery queryKey;
+        queryKey.Add(ToByteVector(CKeyID(uint160(i + 1))));
+        queryKey.Sort();
+        BOOST_CHECK(queryKey.Match(filter));
+
+        CBlockFilterQuery queryScript;
+        queryScript.Add(ToByteVector(CScriptID(uint160(5000 + i))));
+        queryScript.Sort();
+        BOOST_CHECK(queryScript.Match(filter));
+
+        CBlockFilterQuery querySpend;
+        querySpend.Add(COutPoint(uint256(1000 + i), i));
+        querySpend.Sort();
+        BOOST_CHECK(querySpend.Match(filter));
+    }
+
+    // elements that are not in the block rarely are, with many of them queried at once
+    CBlockFilterQuery queryOther;
+    for (int i = 0; i < 1000; i++) {
+        queryOther.Add(ToByteVector(CKeyID(uint160(100000 + i))));
+        queryOther.Add(COutPoint(uint256(1000 + i), i + 1));
+    }
+    queryOther.Sort();
+    BOOST_CHECK(!queryOther.Match(filter));
+
+    // one hit among them is enough
+    queryOther.Add(ToByteVector(CKeyID(uint160(50))));
+    queryOther.Sort();
+    BOOST_CHECK(queryOther.Match(filter));
+
+    CBlockFilterQuery queryEmpty;
+    BOOST_CHECK(!queryEmpty.Match(filter));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_serialize)
+{
+    CBlockFilter filter(BuildBlock(20));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << filter;
+    // about GOLOMB_P + 2.5 bits per element instead of a hash each
+    BOOST_CHECK(ss.size() < 60 * 3 + 8);
+
+    CBlockFilter filter2;
+    ss >> filter2;
+    BOOST_CHECK_EQUAL(filter2.GetElementCount(), filter.GetElementCount());
+    BOOST_CHECK(filter2.Decode() == filter.Decode());
+
+    // an empty block still decodes
+    CBlockFilter filterEmpty(BuildBlock(0));
+    BOOST_CHECK_EQUAL(filterEmpty.GetElementCount(), 0);
+    BOOST_CHECK(filterEmpty.Decode().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -46,4 +46,20 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Reference vector for a 32 byte message 00..1f with key 00..0f
+    std::vector<unsigned char> vch;
+    for (int i = 0; i < 32; i++)
+        vch.push_back(i);
+    uint256 val(vch);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, &vch[0], 32), 0x7127512f72f27cceULL);
+
+    // Shorter messages from the reference implementation's test vectors
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, &vch[0], 0), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, &vch[0], 8), 0x93f5f5799a932462ULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, &vch[0], 15), 0xa129ca6149be45e5ULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,204 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "recordfile.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(recordfile_tests)
+
+struct CTestRecords {
+    std::map<int, std::string> mapValues;
+    int nCounter;
+
+    CTestRecords() : nCounter(0) {}
+
+    void WriteRecords(CRecordFile& file) const
+    {
+        file.WriteMap(1, mapValues);
+        file.Write(2, 0, nCounter);
+    }
+
+    void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue)
+    {
+        if (nType == 1)
+            ReadMapRecord(mapValues, ssKey, pssValue);
+        else if (nType == 2 && pssValue)
+            *pssValue >> nCounter;
+    }
+};
+
+struct CTrackedRecords {
+    CRecordMap<int, std::string> mapValues;
+
+    void WriteRecords(CRecordFile& file)
+    {
+        file.WriteMap(1, mapValues);
+    }
+
+    void ReadRecord(uint8_t nType, CDataStream& ssKey, CDataStream* pssValue)
+    {
+        if (nType == 1)
+            ReadMapRecord(mapValues, ssKey, pssValue);
+    }
+};
+
+static boost::filesystem::path RecordFilePath(const std::string& strName)
+{
+    boost::filesystem::path path = GetDataDir() / strName;
+    boost::filesystem::remove(path);
+    return path;
+}
+
+BOOST_AUTO_TEST_CASE(recordfile_roundtrip)
+{
+    boost::filesystem::path path = RecordFilePath("recordfile_roundtrip.dat");
+
+    CTestRecords records;
+    for (int i = 0; i < 100; i++)
+        records.mapValues[i] = strprintf("value %d", i);
+    records.nCounter = 7;
+
+    CRecordFile file(path, "TestRecords");
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK_EQUAL(file.GetFileSize(), boost::filesystem::file_size(path));
+
+    CTestRecords loaded;
+    CRecordFile file2(path, "TestRecords");
+    BOOST_CHECK(file2.Read(loaded) == CRecordFile::Ok);
+    BOOST_CHECK(loaded.mapValues == records.mapValues);
+    BOOST_CHECK_EQUAL(loaded.nCounter, 7);
+
+    // another file type or a missing file is refused
+    CRecordFile fileOther(path, "OtherRecords");
+    BOOST_CHECK(fileOther.Read(loaded) == CRecordFile::IncorrectMagicMessage);
+    BOOST_CHECK(!fileOther.Write(records));
+    CRecordFile fileMissing(GetDataDir() / "recordfile_missing.dat", "TestRecords");
+    BOOST_CHECK(fileMissing.Read(loaded) == CRecordFile::FileError);
+}
+
+BOOST_AUTO_TEST_CASE(recordfile_append)
+{
+    boost::filesystem::path path = RecordFilePath("recordfile_append.dat");
+
+    CTestRecords records;
+    for (int i = 0; i < 100; i++)
+        records.mapValues[i] = strprintf("value %d", i);
+
+    CRecordFile file(path, "TestRecords");
+    BOOST_CHECK(file.Write(records));
+    uint64_t nFullSize = file.GetFileSize();
+
+    // nothing changed, nothing appended
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK_EQUAL(file.GetFileSize(), nFullSize);
+
+    // one change and one erase only append two small records
+    records.mapValues[5] = "changed";
+    records.mapValues.erase(6);
+    records.nCounter = 3;
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK(file.GetFileSize() > nFullSize);
+    BOOST_CHECK(file.GetFileSize() < nFullSize + 100);
+    BOOST_CHECK(file.GetLiveSize() < file.GetFileSize());
+
+    CTestRecords loaded;
+    CRecordFile file2(path, "TestRecords");
+    BOOST_CHECK(file2.Read(loaded) == CRecordFile::Ok);
+    BOOST_CHECK(loaded.mapValues == records.mapValues);
+    BOOST_CHECK_EQUAL(loaded.nCounter, 3);
+
+    // the reader knows what is on disk and keeps appending
+    loaded.mapValues[200] = "new";
+    uint64_t nSize = file2.GetFileSize();
+    BOOST_CHECK(file2.Write(loaded));
+    BOOST_CHECK(file2.GetFileSize() > nSize);
+    BOOST_CHECK(file2.GetFileSize() < nSize + 50);
+
+    CTestRecords loaded2;
+    CRecordFile file3(path, "TestRecords");
+    BOOST_CHECK(file3.Read(loaded2) == CRecordFile::Ok);
+    BOOST_CHECK(loaded2.mapValues == loaded.mapValues);
+}
+
+BOOST_AUTO_TEST_CASE(recordfile_torn_tail)
+{
+    boost::filesystem::path path = RecordFilePath("recordfile_torn.dat");
+
+    CTestRecords records;
+    for (int i = 0; i < 10; i++)
+        records.mapValues[i] = strprintf("value %d", i);
+
+    CRecordFile file(path, "TestRecords");
+    BOOST_CHECK(file.Write(records));
+    uint64_t nSize = file.GetFileSize();
+    records.mapValues[20] = "lost in the crash";
+    BOOST_CHECK(file.Write(records));
+
+    // cut the last record in half
+    boost::filesystem::resize_file(path, (nSize + file.GetFileSize()) / 2);
+
+    CTestRecords loaded;
+    CRecordFile file2(path, "TestRecords");
+    BOOST_CHECK(file2.Read(loaded) == CRecordFile::Ok);
+    BOOST_CHECK_EQUAL(loaded.mapValues.size(), 10);
+    BOOST_CHECK(!loaded.mapValues.count(20));
+
+    // the next dump rewrites the file instead of appending behind the torn record
+    loaded.mapValues[20] = "written again";
+    BOOST_CHECK(file2.Write(loaded));
+    CTestRecords loaded2;
+    CRecordFile file3(path, "TestRecords");
+    BOOST_CHECK(file3.Read(loaded2) == CRecordFile::Ok);
+    BOOST_CHECK(loaded2.mapValues == loaded.mapValues);
+}
+
+BOOST_AUTO_TEST_CASE(recordfile_changed_keys)
+{
+    boost::filesystem::path path = RecordFilePath("recordfile_changed.dat");
+
+    CTrackedRecords records;
+    for (int i = 0; i < 100; i++)
+        records.mapValues[i] = strprintf("value %d", i);
+    BOOST_CHECK_EQUAL(records.mapValues.GetChanged().size(), 100);
+
+    CRecordFile file(path, "TestRecords");
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK(records.mapValues.GetChanged().empty());
+    uint64_t nFullSize = file.GetFileSize();
+
+    // nothing touched, nothing looked at
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK_EQUAL(file.GetFileSize(), nFullSize);
+
+    records.mapValues[5] = "changed";
+    records.mapValues.erase(6);
+    records.mapValues.erase(records.mapValues.find(7));
+    records.mapValues.insert(std::make_pair(200, std::string("new")));
+    BOOST_CHECK_EQUAL(records.mapValues.GetChanged().size(), 4);
+    BOOST_CHECK(file.Write(records));
+    BOOST_CHECK(file.GetFileSize() > nFullSize);
+    BOOST_CHECK(file.GetFileSize() < nFullSize + 150);
+
+    // entries that weren't touched are not erased by an incremental dump
+    CTrackedRecords loaded;
+    CRecordFile file2(path, "TestRecords");
+    BOOST_CHECK(file2.Read(loaded) == CRecordFile::Ok);
+    BOOST_CHECK(loaded.mapValues == records.mapValues);
+    BOOST_CHECK(loaded.mapValues.GetChanged().empty());
+
+    // clearing the map erases every entry on disk
+    records.mapValues.clear();
+    records.mapValues[1] = "only";
+    BOOST_CHECK(file.Write(records));
+    CTrackedRecords loaded2;
+    CRecordFile file3(path, "TestRecords");
+    BOOST_CHECK(file3.Read(loaded2) == CRecordFile::Ok);
+    BOOST_CHECK_EQUAL(loaded2.mapValues.size(), 1);
+    BOOST_CHECK_EQUAL(loaded2.mapValues[1], "only");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -177,6 +177,17 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     Array arr = retValue.get_array();
     BOOST_CHECK(arr.size() > 0);
     BOOST_CHECK(CBitcoinAddress(arr[0].get_str()).Get() == demoAddress.Get());
+
+    /*********************************
+     * 		sendbatch
+     *********************************/
+    string strBatch = " {\"" + demoAddress.ToString() + "\":1}";
+    BOOST_CHECK_THROW(CallRPC("sendbatch"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch " + strAccount), runtime_error);
+    /* maxoutputs must be positive */
+    BOOST_CHECK_THROW(CallRPC("sendbatch " + strAccount + strBatch + " 1 payout 0"), runtime_error);
+    /* the account has nothing to send */
+    BOOST_CHECK_THROW(CallRPC("sendbatch " + strAccount + strBatch), runtime_error);
 }
 
 
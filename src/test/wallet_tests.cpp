@@ -4,6 +4,10 @@
 
 #include "wallet.h"
 
+#include "main.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -23,6 +27,8 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+extern CWallet* pwalletMain;
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
@@ -305,4 +311,144 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_exact_match)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+
+        // 41 cents can only be made from a few of these coins, the exact match search always finds one
+        add_coin(7*CENT); add_coin(11*CENT); add_coin(13*CENT); add_coin(17*CENT); add_coin(19*CENT); add_coin(23*CENT);
+        for (int j = 0; j < 200; j++)
+            add_coin(2*COIN);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(41 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 41 * CENT);
+
+        // only the 7 cent coin is below 8 cents, the next bigger coin is used without any search
+        BOOST_CHECK( wallet.SelectCoinsMinConf(8 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+    }
+
+    // without any time to search, the coins selected still cover the target
+    unsigned int nCoinSelectionMillisOld = nCoinSelectionMillis;
+    nCoinSelectionMillis = 0;
+    BOOST_CHECK( wallet.SelectCoinsMinConf(300 * COIN, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(nValueRet >= 300 * COIN);
+
+    // the knapsack solver gets a single pass now, which finds 6 + 5 for 11 cents only
+    // some of the time; the exact match search has to leave out the 9 cent coin it took first
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+        add_coin(9*CENT); add_coin(6*CENT); add_coin(5*CENT);
+        add_coin(2*COIN);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+    }
+
+    // coins of even value never add up to an odd target, so the exact match search gives up
+    // once the time is over and the knapsack solver stops after its first pass
+    empty_wallet();
+    CAmount nTotal = 0;
+    for (int j = 0; j < 60; j++) {
+        add_coin((j + 10) * CENT / 10);
+        nTotal += (j + 10) * CENT / 10;
+    }
+    BOOST_CHECK( wallet.SelectCoinsMinConf(1 * COIN + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK(nValueRet > 1 * COIN + 1);
+    BOOST_CHECK(nValueRet < nTotal);
+
+    nCoinSelectionMillis = nCoinSelectionMillisOld;
+
+    empty_wallet();
+}
+
+static COutput batch_coin(const CScript& scriptPubKey, const CAmount& nValue)
+{
+    static int nextLockTime = 0;
+    CMutableTransaction tx;
+    tx.nLockTime = nextLockTime++;
+    tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    return COutput(new CWalletTx(pwalletMain, tx), 0, 6*24, true);
+}
+
+BOOST_AUTO_TEST_CASE(transaction_batch_tests)
+{
+    // coins of the test wallet, and a big multisig coin the fee estimate can't size
+    vector<COutput> vBatchCoins;
+    for (int i = 0; i < 20; i++) {
+        CPubKey pubkey = pwalletMain->GenerateNewKey();
+        if (i % 2)
+            vBatchCoins.push_back(batch_coin(GetScriptForDestination(pubkey.GetID()), 1 * COIN));
+        else
+            vBatchCoins.push_back(batch_coin(CScript() << ToByteVector(pubkey) << OP_CHECKSIG, 1 * COIN));
+    }
+    vector<CPubKey> vMultisigKeys;
+    vMultisigKeys.push_back(pwalletMain->GenerateNewKey());
+    COutput multisig = batch_coin(GetScriptForMultisig(1, vMultisigKeys), 100 * COIN);
+    vBatchCoins.push_back(multisig);
+
+    vector<pair<CScript, CAmount> > vecSend;
+    set<CScript> setPayees;
+    for (int i = 0; i < 10; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        vecSend.push_back(make_pair(scriptPubKey, COIN / 2));
+        setPayees.insert(scriptPubKey);
+    }
+
+    vector<CWalletTx> vwtx;
+    vector<boost::shared_ptr<CReserveKey> > vReserveKeys;
+    CAmount nFee = 0;
+    string strFailReason;
+    BOOST_CHECK(pwalletMain->CreateTransactionBatch(vBatchCoins, vecSend, 3, vwtx, vReserveKeys, nFee, strFailReason));
+    BOOST_CHECK(nFee > 0);
+
+    // ten payments of at most three per transaction
+    BOOST_CHECK_EQUAL(vwtx.size(), 4U);
+    BOOST_CHECK_EQUAL(vReserveKeys.size(), vwtx.size());
+    unsigned int nPayments = 0;
+    set<COutPoint> setSpent;
+    BOOST_FOREACH (const CWalletTx& wtx, vwtx) {
+        unsigned int nTxPayments = 0;
+        BOOST_FOREACH (const CTxOut& txout, wtx.vout)
+            nTxPayments += setPayees.count(txout.scriptPubKey);
+        BOOST_CHECK(nTxPayments <= 3);
+        nPayments += nTxPayments;
+
+        for (unsigned int j = 0; j < wtx.vin.size(); j++) {
+            // no coin is spent twice in the batch, and the multisig coin is never picked
+            BOOST_CHECK(setSpent.insert(wtx.vin[j].prevout).second);
+            BOOST_CHECK(wtx.vin[j].prevout.hash != multisig.tx->GetHash());
+
+            // the inputs were signed on the worker threads of the test setup
+            const CWalletTx* pcoin = NULL;
+            BOOST_FOREACH (const COutput& out, vBatchCoins) {
+                if (out.tx->GetHash() == wtx.vin[j].prevout.hash)
+                    pcoin = out.tx;
+            }
+            BOOST_REQUIRE(pcoin != NULL);
+            const CScript& scriptPubKey = pcoin->vout[wtx.vin[j].prevout.n].scriptPubKey;
+            BOOST_CHECK(VerifyScript(wtx.vin[j].scriptSig, scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&wtx, j)));
+        }
+    }
+    BOOST_CHECK_EQUAL(nPayments, 10U);
+
+    // the first three transactions take six coins, the 14 left can't pay 15.5 coins
+    // and the multisig coin isn't touched to make up for it
+    vecSend.push_back(make_pair(vecSend[0].first, 15 * COIN));
+    BOOST_CHECK(!pwalletMain->CreateTransactionBatch(vBatchCoins, vecSend, 3, vwtx, vReserveKeys, nFee, strFailReason));
+
+    BOOST_FOREACH (const COutput& out, vBatchCoins)
+        delete out.tx;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,60 @@
+// Copyright (c) 2018 The Scrypta developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet.h"
+#include "walletdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(walletdb_tests)
+
+BOOST_AUTO_TEST_CASE(walletdb_journal)
+{
+    std::string strFile = "journal_test.dat";
+    bitdb.EnableJournal(strFile);
+    CWalletDB walletdb(strFile, "cr+");
+
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyPool keypool(key.GetPubKey());
+    CKeyPool keypoolRead;
+
+    // writes are read back before they are committed
+    BOOST_CHECK(walletdb.WritePool(1, keypool));
+    BOOST_CHECK(walletdb.ReadPool(1, keypoolRead));
+    BOOST_CHECK(keypoolRead.vchPubKey == keypool.vchPubKey);
+
+    // and so are erases of committed keys
+    BOOST_CHECK(walletdb.CommitJournal(true));
+    BOOST_CHECK(walletdb.ReadPool(1, keypoolRead));
+    BOOST_CHECK(walletdb.ErasePool(1));
+    BOOST_CHECK(!walletdb.ReadPool(1, keypoolRead));
+    BOOST_CHECK(walletdb.CommitJournal());
+    BOOST_CHECK(!walletdb.ReadPool(1, keypoolRead));
+
+    // the last write of a key wins
+    BOOST_CHECK(walletdb.WritePool(2, keypool));
+    BOOST_CHECK(walletdb.ErasePool(2));
+    BOOST_CHECK(walletdb.WritePool(2, keypool));
+    BOOST_CHECK(walletdb.CommitJournal());
+    BOOST_CHECK(walletdb.ReadPool(2, keypoolRead));
+
+    // cursors see the writes that are not committed yet
+    CAccountingEntry ae;
+    ae.strAccount = "journal";
+    ae.nCreditDebit = 1;
+    ae.nTime = 1333333333;
+    BOOST_CHECK(walletdb.WriteAccountingEntry(ae));
+    std::list<CAccountingEntry> entries;
+    walletdb.ListAccountCreditDebit("journal", entries);
+    BOOST_CHECK_EQUAL(entries.size(), 1U);
+
+    // keys are never overwritten, also before the journal is synced
+    BOOST_CHECK(walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey(), CKeyMetadata(GetTime())));
+    BOOST_CHECK(!walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey(), CKeyMetadata(GetTime())));
+    BOOST_CHECK(walletdb.CommitJournal(true));
+    BOOST_CHECK(!walletdb.WriteKey(key.GetPubKey(), key.GetPrivKey(), CKeyMetadata(GetTime())));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -261,3 +261,17 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe)
+{
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256& hashBlock, CBlockFilter& filter)
+{
+    return Read(make_pair('f', hashBlock), filter);
+}
+
+bool CBlockFilterDB::WriteFilter(const uint256& hashBlock, const CBlockFilter& filter)
+{
+    return Write(make_pair('f', hashBlock), filter);
+}
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "blockfilter.h"
 #include "leveldbwrapper.h"
 #include "main.h"
 
@@ -65,4 +66,19 @@ public:
     bool LoadBlockIndexGuts();
 };
 
+/** Access to the block filter database (blocks/filter/), filters are keyed by block hash */
+class CBlockFilterDB : public CLevelDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+
+public:
+    bool ReadFilter(const uint256& hashBlock, CBlockFilter& filter);
+    bool WriteFilter(const uint256& hashBlock, const CBlockFilter& filter);
+};
+
 #endif // BITCOIN_TXDB_H
@@ -455,6 +455,7 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
             BOOST_FOREACH (const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
 
+            NotifyEntryRemoved(tx);
             removed.push_back(tx);
             totalTxSize -= mapTx[hash].GetTxSize();
             mapTx.erase(hash);
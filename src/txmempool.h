@@ -13,6 +13,8 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/signals2/signal.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -107,6 +109,9 @@ public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Called with cs held for every transaction leaving the pool */
+    boost::signals2::signal<void(const CTransaction&)> NotifyEntryRemoved;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -8,6 +8,7 @@
 #include "wallet.h"
 
 #include "base58.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "kernel.h"
@@ -18,12 +19,15 @@
 #include "spork.h"
 #include "swifttx.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
 
 #include <assert.h>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 
@@ -36,6 +40,7 @@ CFeeRate payTxFee(DEFAULT_TRANSACTION_FEE);
 CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 unsigned int nTxConfirmTarget = 1;
 bool bSpendZeroConfChange = true;
+unsigned int nCoinSelectionMillis = DEFAULT_COIN_SELECTION_MS;
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
 
@@ -96,7 +101,10 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
+    fGeneratingKey = true;
+    bool fAdded = AddKeyPubKey(secret, pubkey);
+    fGeneratingKey = false;
+    if (!fAdded)
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
     return pubkey;
 }
@@ -106,6 +114,11 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey& pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    // outputs already in the wallet may pay an imported key
+    if (!fGeneratingKey) {
+        fWalletUTXODirty = true;
+        nWalletGeneration++;
+    }
 
     // check if we need to remove from watch-only
     CScript script;
@@ -126,6 +139,13 @@ bool CWallet::AddCryptedKey(const CPubKey& vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    {
+        LOCK(cs_wallet);
+        if (!fGeneratingKey) {
+            fWalletUTXODirty = true;
+            nWalletGeneration++;
+        }
+    }
     if (!fFileBacked)
         return true;
     {
@@ -159,6 +179,11 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        fWalletUTXODirty = true;
+        nWalletGeneration++;
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -184,6 +209,11 @@ bool CWallet::AddWatchOnly(const CScript& dest)
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
+    {
+        LOCK(cs_wallet);
+        fWalletUTXODirty = true;
+        nWalletGeneration++;
+    }
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
@@ -195,6 +225,8 @@ bool CWallet::RemoveWatchOnly(const CScript& dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    fWalletUTXODirty = true;
+    nWalletGeneration++;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
@@ -620,6 +652,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
+        fWalletUTXODirty = true;
+        nWalletGeneration++;
     }
 }
 
@@ -631,6 +665,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        fWalletUTXODirty = true;
+        nWalletGeneration++;
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -681,6 +717,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                         wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            ForgetObfuscationRounds(hash);
         }
 
         bool fUpdated = false;
@@ -711,6 +748,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        nWalletGeneration++;
+
+        // Its outputs and the wallet outputs it spends may have changed state
+        UpdateWalletUTXO(hash);
+        BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+            if (mapWallet.count(txin.prevout.hash))
+                UpdateWalletUTXO(txin.prevout.hash);
+        }
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -751,6 +796,8 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    if (pblock)
+        UpdateConflictedSpends(tx);
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
         return; // Not one of ours
 
@@ -763,14 +810,46 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     }
 }
 
+/**
+ * Wallet transactions spending an input of a transaction that made it into a
+ * block are conflicted now, even when that transaction isn't ours. The wallet
+ * outputs they spend become available again.
+ */
+void CWallet::UpdateConflictedSpends(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    uint256 hash = tx.GetHash();
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(txin.prevout);
+        for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+            if (it->second == hash)
+                continue;
+            std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(it->second);
+            if (mi == mapWallet.end())
+                continue;
+            nWalletGeneration++;
+            BOOST_FOREACH (const CTxIn& txinConflicted, (*mi).second.vin) {
+                std::map<uint256, CWalletTx>::iterator miPrev = mapWallet.find(txinConflicted.prevout.hash);
+                if (miPrev != mapWallet.end()) {
+                    (*miPrev).second.MarkDirty();
+                    UpdateWalletUTXO(txinConflicted.prevout.hash);
+                }
+            }
+        }
+    }
+}
+
 void CWallet::EraseFromWallet(const uint256& hash)
 {
     if (!fFileBacked)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        if (mapWallet.erase(hash)) {
             CWalletDB(strWalletFile).EraseTx(hash);
+            fWalletUTXODirty = true;
+            nWalletGeneration++;
+        }
     }
     return;
 }
@@ -808,7 +887,7 @@ CAmount CWallet::GetDebit(const CTxIn& txin, const isminefilter& filter) const
 // Recursively determine the rounds of a given input (How deep is the Obfuscation chain for a given input)
 int CWallet::GetRealInputObfuscationRounds(CTxIn in, int rounds) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
+    AssertLockHeld(cs_wallet);
 
     if (rounds >= 16) return 15; // 16 rounds max
 
@@ -817,17 +896,10 @@ int CWallet::GetRealInputObfuscationRounds(CTxIn in, int rounds) const
 
     const CWalletTx* wtx = GetWalletTx(hash);
     if (wtx != NULL) {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if (mdwi == mDenomWtxes.end()) {
-            LogPrint("obfuscation", "GetInputObfuscationRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        }
-        // found and it's not an initial value, just return it
-        else if (mDenomWtxes[hash].vout[nout].nRounds != -10) {
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
+        // found, just return it
+        std::map<COutPoint, int>::const_iterator mi = mapObfuscationRounds.find(in.prevout);
+        if (mi != mapObfuscationRounds.end())
+            return (*mi).second;
 
         // bounds check
         if (nout >= wtx->vout.size()) {
@@ -836,54 +908,82 @@ int CWallet::GetRealInputObfuscationRounds(CTxIn in, int rounds) const
             return -4;
         }
 
-        if (pwalletMain->IsCollateralAmount(wtx->vout[nout].nValue)) {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("obfuscation", "GetInputObfuscationRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+        int nRounds;
+        if (IsCollateralAmount(wtx->vout[nout].nValue)) {
+            nRounds = -3;
+        } else if (/*rounds == 0 && */ !IsDenominatedAmount(wtx->vout[nout].nValue)) { //make sure the final output is non-denominate
+            nRounds = -2;
+        } else {
+            bool fAllDenoms = true;
+            BOOST_FOREACH (const CTxOut& out, wtx->vout) {
+                fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
+            }
 
-        //make sure the final output is non-denominate
-        if (/*rounds == 0 && */ !IsDenominatedAmount(wtx->vout[nout].nValue)) //NOT DENOM
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("obfuscation", "GetInputObfuscationRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        bool fAllDenoms = true;
-        BOOST_FOREACH (CTxOut out, wtx->vout) {
-            fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
-        }
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if (!fAllDenoms) {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("obfuscation", "GetInputObfuscationRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH (CTxIn in2, wtx->vin) {
-            if (IsMine(in2)) {
-                int n = GetRealInputObfuscationRounds(in2, rounds + 1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if (n >= 0 && (n < nShortest || nShortest == -10)) {
-                    nShortest = n;
-                    fDenomFound = true;
+            if (!fAllDenoms) {
+                // this one is denominated but there is another non-denominated output found in the same tx
+                nRounds = 0;
+            } else {
+                int nShortest = -10; // an initial value, should be no way to get this by calculations
+                bool fDenomFound = false;
+                // only denoms here so let's look up, every input is only walked once across all lookups
+                BOOST_FOREACH (const CTxIn& in2, wtx->vin) {
+                    if (IsMine(in2)) {
+                        int n = GetRealInputObfuscationRounds(in2, rounds + 1);
+                        // denom found, find the shortest chain or initially assign nShortest with the first found value
+                        if (n >= 0 && (n < nShortest || nShortest == -10)) {
+                            nShortest = n;
+                            fDenomFound = true;
+                        }
+                    }
                 }
+                nRounds = fDenomFound ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
+                                        :
+                                        0; // too bad, we are the fist one in that chain
             }
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
-                                                             :
-                                                             0; // too bad, we are the fist one in that chain
-        LogPrint("obfuscation", "GetInputObfuscationRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
+
+        if (mapObfuscationRounds.size() >= MAX_OBFUSCATION_ROUNDS_CACHE)
+            mapObfuscationRounds.clear();
+        mapObfuscationRounds[in.prevout] = nRounds;
+
+        LogPrint("obfuscation", "GetInputObfuscationRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, nRounds);
+        return nRounds;
     }
 
     return rounds - 1;
 }
 
+// A transaction joined the wallet: the outputs that descend from it may have been counted without it
+void CWallet::ForgetObfuscationRounds(const uint256& wtxid)
+{
+    AssertLockHeld(cs_wallet);
+
+    if (mapObfuscationRounds.empty()) return;
+
+    std::vector<uint256> vToVisit(1, wtxid);
+    std::set<uint256> setVisited;
+    while (!vToVisit.empty()) {
+        uint256 hash = vToVisit.back();
+        vToVisit.pop_back();
+        if (!setVisited.insert(hash).second) continue;
+
+        const CWalletTx* wtx = GetWalletTx(hash);
+        if (wtx == NULL) continue;
+
+        for (unsigned int i = 0; i < wtx->vout.size(); i++) {
+            COutPoint outpoint(hash, i);
+            bool fForgotten = mapObfuscationRounds.erase(outpoint) > 0;
+
+            // spenders computed through this output (or with the new tx missing) are forgotten too
+            if (fForgotten || hash == wtxid) {
+                std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+                for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+                    vToVisit.push_back(it->second);
+            }
+        }
+    }
+}
+
 // respect current settings
 int CWallet::GetInputObfuscationRounds(CTxIn in) const
 {
@@ -1076,17 +1176,148 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+bool CWallet::GetBlockFilterQuery(CBlockFilterQuery& query) const
+{
+    AssertLockHeld(cs_wallet);
+    {
+        LOCK(cs_KeyStore);
+        std::set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        BOOST_FOREACH (const CKeyID& keyid, setKeys) {
+            query.Add(ToByteVector(keyid));
+            CPubKey pubkey;
+            if (GetPubKey(keyid, pubkey))
+                query.Add(ToByteVector(pubkey));
+        }
+        BOOST_FOREACH (const PAIRTYPE(CScriptID, CScript) & item, mapScripts)
+            query.Add(ToByteVector(item.first));
+        BOOST_FOREACH (const CScript& script, setWatchOnly) {
+            bool fPushes = false;
+            CScript::const_iterator pc = script.begin();
+            opcodetype opcode;
+            std::vector<unsigned char> vch;
+            while (pc < script.end() && script.GetOp(pc, opcode, vch)) {
+                if (!vch.empty()) {
+                    query.Add(vch);
+                    fPushes = true;
+                }
+            }
+            if (!fPushes)
+                return false;
+        }
+    }
+
+    // the coins we already have, so that blocks spending them are found
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        const CWalletTx& wtx = (*it).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+            if (IsMine(wtx.vout[i]) != ISMINE_NO)
+                query.Add(COutPoint((*it).first, i));
+        }
+    }
+    query.Sort();
+    return true;
+}
+
+/**
+ * A run of consecutive active chain blocks being read from disk and matched
+ * against the wallet's keys by worker threads. Only the keystore and the
+ * block filter database are touched off the calling thread, both do their
+ * own locking.
+ */
+class CWalletRescanChunk
+{
+private:
+    const CWallet* pwallet;
+    const CBlockFilterQuery* pquery;
+    boost::thread_group threads;
+
+    void ReadBlocks(unsigned int nFirst, unsigned int nStep)
+    {
+        RenameThread("lyra-rescan");
+        for (unsigned int i = nFirst; i < vIndex.size(); i += nStep) {
+            const uint256& hashBlock = vIndex[i]->GetBlockHash();
+            bool fHaveFilter = false;
+            if (pquery) {
+                fHaveFilter = pblockfilterdb->ReadFilter(hashBlock, vFilters[i]);
+                if (fHaveFilter && !pquery->Match(vFilters[i])) {
+                    vSkipped[i] = true;
+                    continue;
+                }
+            }
+
+            CBlock& block = vBlocks[i];
+            if (!ReadBlockFromDisk(block, vIndex[i])) {
+                block.SetNull();
+                continue;
+            }
+            vMatch[i].resize(block.vtx.size());
+            for (unsigned int j = 0; j < block.vtx.size(); j++)
+                vMatch[i][j] = pwallet->IsMine(block.vtx[j]);
+
+            // blocks connected before -blockfilterindex get their filter on first rescan
+            if (pquery && !fHaveFilter)
+                pblockfilterdb->WriteFilter(hashBlock, CBlockFilter(block));
+        }
+    }
+
+public:
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CBlock> vBlocks;
+    //! Per block and transaction, whether one of its outputs is ours
+    std::vector<std::vector<char> > vMatch;
+    //! Blocks not read because their filter did not match the query
+    std::vector<char> vSkipped;
+    std::vector<CBlockFilter> vFilters;
+
+    CWalletRescanChunk(const CWallet* pwalletIn, const CBlockFilterQuery* pqueryIn, CBlockIndex* pindexFirst, int nThreads) : pwallet(pwalletIn), pquery(pqueryIn)
+    {
+        {
+            LOCK(cs_main);
+            for (CBlockIndex* pindex = pindexFirst; pindex && vIndex.size() < WALLET_RESCAN_CHUNK; pindex = chainActive.Next(pindex))
+                vIndex.push_back(pindex);
+        }
+        vBlocks.resize(vIndex.size());
+        vMatch.resize(vIndex.size());
+        vSkipped.resize(vIndex.size(), false);
+        vFilters.resize(vIndex.size());
+        for (int i = 0; i < nThreads && i < (int)vIndex.size(); i++)
+            threads.create_thread(boost::bind(&CWalletRescanChunk::ReadBlocks, this, i, nThreads));
+    }
+
+    ~CWalletRescanChunk()
+    {
+        Wait();
+    }
+
+    void Wait()
+    {
+        threads.join_all();
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and matched against our keys one chunk ahead on -par
+ * worker threads and applied in chain order. cs_main and cs_wallet are
+ * only taken while a chunk is applied, so a caller not holding them
+ * lets the node go on between chunks. With -blockfilterindex, blocks
+ * whose filter shows they cannot involve the wallet are not read.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
+    int nThreads = std::max(1, nScriptCheckThreads);
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart;
+    double dProgressTip;
+    CBlockFilterQuery query;
+    bool fUseFilters = false;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1096,26 +1327,97 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        if (pblockfilterdb) {
+            fUseFilters = GetBlockFilterQuery(query);
+            if (!fUseFilters)
+                LogPrintf("%s : a watch-only script cannot be matched by block filters, reading every block\n", __func__);
+        }
+    }
+    const CBlockFilterQuery* pquery = fUseFilters ? &query : NULL;
+
+    // Coins of ours found by this scan. The workers check filters against the
+    // query as it was when the scan started, a block skipped by them may
+    // still spend one of these.
+    CBlockFilterQuery queryFound;
+
+    boost::scoped_ptr<CWalletRescanChunk> pchunk(new CWalletRescanChunk(this, pquery, pindex, nThreads));
+    while (!pchunk->vIndex.empty()) {
+        pchunk->Wait();
+
+        // read ahead while this chunk is applied
+        CBlockIndex* pindexNext;
+        {
+            LOCK(cs_main);
+            pindexNext = chainActive.Next(pchunk->vIndex.back());
+        }
+        boost::scoped_ptr<CWalletRescanChunk> pnext(new CWalletRescanChunk(this, pquery, pindexNext, nThreads));
+
+        bool fReorganized = false;
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int i = 0; i < pchunk->vIndex.size(); i++) {
+                pindex = pchunk->vIndex[i];
+                if (!chainActive.Contains(pindex)) {
+                    // the chain moved under us, go on from where it forked
+                    pindexNext = chainActive.Next(chainActive.FindFork(pindex));
+                    fReorganized = true;
+                    break;
+                }
+
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                }
+
+                const CBlock* pblock = &pchunk->vBlocks[i];
+                const std::vector<char>* pvMatch = &pchunk->vMatch[i];
+                CBlock blockSkipped;
+                std::vector<char> vMatchSkipped;
+                if (pchunk->vSkipped[i]) {
+                    if (queryFound.IsEmpty() || !queryFound.Match(pchunk->vFilters[i]))
+                        continue;
+                    if (!ReadBlockFromDisk(blockSkipped, pindex))
+                        continue;
+                    BOOST_FOREACH (const CTransaction& tx, blockSkipped.vtx)
+                        vMatchSkipped.push_back(IsMine(tx));
+                    pblock = &blockSkipped;
+                    pvMatch = &vMatchSkipped;
+                }
+
+                bool fFound = false;
+                for (unsigned int j = 0; j < pblock->vtx.size(); j++) {
+                    const CTransaction& tx = pblock->vtx[j];
+                    // what the workers did not match can only involve us by spending our coins
+                    if (!(*pvMatch)[j] && !mapWallet.count(tx.GetHash()) && !IsFromMe(tx))
+                        continue;
+                    if (!AddToWalletIfInvolvingMe(tx, pblock, fUpdate))
+                        continue;
                     ret++;
-            }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                    if (fUseFilters) {
+                        for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                            if (IsMine(tx.vout[k]) != ISMINE_NO)
+                                queryFound.Add(COutPoint(tx.GetHash(), k));
+                        }
+                        fFound = true;
+                    }
+                }
+                if (fFound)
+                    queryFound.Sort();
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        if (fReorganized) {
+            pnext.reset();
+            pnext.reset(new CWalletRescanChunk(this, pquery, pindexNext, nThreads));
+        }
+        pchunk.swap(pnext);
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1154,8 +1456,7 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if (strCommand == "ix") {
-                mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
-                CreateNewLock(((CTransaction) * this));
+                swiftTXManager.AddTxLockRequest((CTransaction) * this);
                 RelayTransactionLockReq((CTransaction) * this, true);
             } else {
                 RelayTransaction((CTransaction) * this);
@@ -1220,16 +1521,142 @@ void CWallet::ResendWalletTransactions()
  */
 
 
+void CWallet::UpdateWalletUTXO(const uint256& wtxid)
+{
+    AssertLockHeld(cs_wallet);
+    if (fWalletUTXODirty)
+        return; // rebuilt from scratch on next use
+
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(wtxid);
+    if (mi == mapWallet.end()) {
+        std::set<COutPoint>::iterator it = setWalletUTXO.lower_bound(COutPoint(wtxid, 0));
+        while (it != setWalletUTXO.end() && it->hash == wtxid) {
+            COutPoint outpoint = *it;
+            setWalletUTXO.erase(it++);
+            UpdateStakeCandidate(outpoint);
+        }
+        return;
+    }
+
+    const CWalletTx& wtx = (*mi).second;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        COutPoint outpoint(wtxid, i);
+        if (!IsSpent(wtxid, i) && IsMine(wtx.vout[i]) != ISMINE_NO)
+            setWalletUTXO.insert(outpoint);
+        else
+            setWalletUTXO.erase(outpoint);
+        UpdateStakeCandidate(outpoint);
+    }
+}
+
+void CWallet::UpdateStakeCandidate(const COutPoint& outpoint) const
+{
+    std::map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.find(outpoint);
+    if (it != mapStakeCandidates.end()) {
+        setStakeReady.erase(make_pair((*it).second.nTimeReady, outpoint));
+        mapStakeCandidates.erase(it);
+    }
+
+    if (!setWalletUTXO.count(outpoint))
+        return;
+    const CWalletTx* pwtx = GetWalletTx(outpoint.hash);
+    if (pwtx == NULL || pwtx->vout[outpoint.n].nValue <= 0 || IsMine(pwtx->vout[outpoint.n]) != ISMINE_SPENDABLE)
+        return;
+    // unconfirmed coins come back through AddToWallet once they are in a block
+    BlockMap::const_iterator mi = mapBlockIndex.find(pwtx->hashBlock);
+    if (pwtx->hashBlock == 0 || mi == mapBlockIndex.end())
+        return;
+
+    CStakeCandidate candidate;
+    candidate.pindexFrom = (*mi).second;
+    candidate.nTimeReady = candidate.pindexFrom->GetBlockTime() + nStakeMinAge;
+    mapStakeCandidates[outpoint] = candidate;
+    setStakeReady.insert(make_pair(candidate.nTimeReady, outpoint));
+}
+
+const std::set<COutPoint>& CWallet::GetWalletUTXO() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fWalletUTXODirty) {
+        setWalletUTXO.clear();
+        mapStakeCandidates.clear();
+        setStakeReady.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+            const uint256& wtxid = (*it).first;
+            const CWalletTx& wtx = (*it).second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+                if (!IsSpent(wtxid, i) && IsMine(wtx.vout[i]) != ISMINE_NO)
+                    setWalletUTXO.insert(COutPoint(wtxid, i));
+            }
+        }
+        BOOST_FOREACH (const COutPoint& outpoint, setWalletUTXO)
+            UpdateStakeCandidate(outpoint);
+        fWalletUTXODirty = false;
+        LogPrint("wallet", "%s : indexed %u unspent outputs of %u transactions\n", __func__, setWalletUTXO.size(), mapWallet.size());
+    }
+    return setWalletUTXO;
+}
+
+/**
+ * Wallet transactions with at least one unspent output of ours, the only ones
+ * that can contribute to a balance or be selected as inputs.
+ */
+std::vector<const CWalletTx*> CWallet::GetWalletUTXOTxs() const
+{
+    std::vector<const CWalletTx*> vTxs;
+    const std::set<COutPoint>& setUTXO = GetWalletUTXO();
+    uint256 hashLast = 0;
+    BOOST_FOREACH (const COutPoint& outpoint, setUTXO) {
+        if (!vTxs.empty() && outpoint.hash == hashLast)
+            continue;
+        hashLast = outpoint.hash;
+        std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi != mapWallet.end())
+            vTxs.push_back(&(*mi).second);
+    }
+    return vTxs;
+}
+
+bool CWallet::GetCachedBalance(BalanceType nType, CAmount& nBalanceRet) const
+{
+    AssertLockHeld(cs_wallet);
+    uint256 hashTip = chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : 0;
+    unsigned int nMempool = mempool.GetTransactionsUpdated();
+    if (hashTip != hashCachedBalancesTip || nWalletGeneration != nCachedBalancesGeneration ||
+        nMempool != nCachedBalancesMempool || nObfuscationRounds != nCachedBalancesRounds) {
+        mapCachedBalances.clear();
+        hashCachedBalancesTip = hashTip;
+        nCachedBalancesGeneration = nWalletGeneration;
+        nCachedBalancesMempool = nMempool;
+        nCachedBalancesRounds = nObfuscationRounds;
+        return false;
+    }
+
+    std::map<int, CAmount>::const_iterator it = mapCachedBalances.find(nType);
+    if (it == mapCachedBalances.end())
+        return false;
+    nBalanceRet = (*it).second;
+    return true;
+}
+
+void CWallet::SetCachedBalance(BalanceType nType, CAmount nBalance) const
+{
+    AssertLockHeld(cs_wallet);
+    mapCachedBalances[nType] = nBalance;
+}
+
 CAmount CWallet::GetBalance() const
 {
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_AVAILABLE, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_AVAILABLE, nTotal);
     }
 
     return nTotal;
@@ -1242,12 +1669,13 @@ CAmount CWallet::GetAnonymizableBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
+        if (GetCachedBalance(BALANCE_ANONYMIZABLE, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAnonymizableCredit();
         }
+        SetCachedBalance(BALANCE_ANONYMIZABLE, nTotal);
     }
 
     return nTotal;
@@ -1260,12 +1688,13 @@ CAmount CWallet::GetAnonymizedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
+        if (GetCachedBalance(BALANCE_ANONYMIZED, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAnonymizedCredit();
         }
+        SetCachedBalance(BALANCE_ANONYMIZED, nTotal);
     }
 
     return nTotal;
@@ -1282,20 +1711,17 @@ double CWallet::GetAverageAnonymizedRounds() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            uint256 hash = (*it).first;
+        BOOST_FOREACH (const COutPoint& outpoint, GetWalletUTXO()) {
+            const CWalletTx* pcoin = GetWalletTx(outpoint.hash);
+            if (pcoin == NULL) continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                CTxIn vin = CTxIn(hash, i);
+            CTxIn vin = CTxIn(outpoint.hash, outpoint.n);
 
-                if (IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+            if (IsMine(pcoin->vout[outpoint.n]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
 
-                int rounds = GetInputObfuscationRounds(vin);
-                fTotal += (float)rounds;
-                fCount += 1;
-            }
+            int rounds = GetInputObfuscationRounds(vin);
+            fTotal += (float)rounds;
+            fCount += 1;
         }
     }
 
@@ -1314,21 +1740,21 @@ CAmount CWallet::GetNormalizedAnonymizedBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            uint256 hash = (*it).first;
+        if (GetCachedBalance(BALANCE_NORMALIZED_ANONYMIZED, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const COutPoint& outpoint, GetWalletUTXO()) {
+            const CWalletTx* pcoin = GetWalletTx(outpoint.hash);
+            if (pcoin == NULL) continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                CTxIn vin = CTxIn(hash, i);
+            CTxIn vin = CTxIn(outpoint.hash, outpoint.n);
 
-                if (IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
-                if (pcoin->GetDepthInMainChain() < 0) continue;
+            if (IsMine(pcoin->vout[outpoint.n]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+            if (pcoin->GetDepthInMainChain() < 0) continue;
 
-                int rounds = GetInputObfuscationRounds(vin);
-                nTotal += pcoin->vout[i].nValue * rounds / nObfuscationRounds;
-            }
+            int rounds = GetInputObfuscationRounds(vin);
+            nTotal += pcoin->vout[outpoint.n].nValue * rounds / nObfuscationRounds;
         }
+        SetCachedBalance(BALANCE_NORMALIZED_ANONYMIZED, nTotal);
     }
 
     return nTotal;
@@ -1338,14 +1764,15 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if (fLiteMode) return 0;
 
+    BalanceType nType = unconfirmed ? BALANCE_DENOMINATED_UNCONFIRMED : BALANCE_DENOMINATED;
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
+        if (GetCachedBalance(nType, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs())
             nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
+        SetCachedBalance(nType, nTotal);
     }
 
     return nTotal;
@@ -1356,11 +1783,13 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_UNCONFIRMED, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
+        SetCachedBalance(BALANCE_UNCONFIRMED, nTotal);
     }
     return nTotal;
 }
@@ -1370,10 +1799,11 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_IMMATURE, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs())
             nTotal += pcoin->GetImmatureCredit();
-        }
+        SetCachedBalance(BALANCE_IMMATURE, nTotal);
     }
     return nTotal;
 }
@@ -1383,11 +1813,13 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_WATCH_ONLY, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_WATCH_ONLY, nTotal);
     }
 
     return nTotal;
@@ -1398,11 +1830,13 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_UNCONFIRMED_WATCH_ONLY, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
+        SetCachedBalance(BALANCE_UNCONFIRMED_WATCH_ONLY, nTotal);
     }
     return nTotal;
 }
@@ -1412,10 +1846,11 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
+        if (GetCachedBalance(BALANCE_IMMATURE_WATCH_ONLY, nTotal))
+            return nTotal;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs())
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+        SetCachedBalance(BALANCE_IMMATURE_WATCH_ONLY, nTotal);
     }
     return nTotal;
 }
@@ -1429,9 +1864,8 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        BOOST_FOREACH (const CWalletTx* pcoin, GetWalletUTXOTxs()) {
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -1471,9 +1905,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    (!IsLockedCoin((*it).first, i) || nCoinType == ONLY_10000) &&
+                    (!IsLockedCoin(wtxid, i) || nCoinType == ONLY_10000) &&
                     (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(wtxid, i)))
                     vCoins.push_back(COutput(pcoin, i, nDepth,
                         ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                             (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO)));
@@ -1502,7 +1936,7 @@ map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fCo
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int64_t nDeadline, int iterations = 1000)
 {
     vector<char> vfIncluded;
 
@@ -1511,7 +1945,8 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
 
     seed_insecure_rand();
 
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
+    // past the deadline the best subset found so far is used, after at least one try
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue && (nRep == 0 || GetTimeMicros() < nDeadline); nRep++) {
         vfIncluded.assign(vValue.size(), false);
         CAmount nTotal = 0;
         bool fReachedTarget = false;
@@ -1542,6 +1977,56 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
 }
 
 
+/**
+ * Depth first search for a subset of vValue, sorted by decreasing value,
+ * adding up to exactly nTargetValue. The larger coins are tried first, and
+ * a branch is given up as soon as the coins left cannot reach the target.
+ * Stops after nMaxTries steps or past nDeadline.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTargetValue, vector<char>& vfBest, int64_t nDeadline, int nMaxTries = COIN_SELECTION_BNB_TRIES)
+{
+    // value of the coins from i on
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (int i = (int)vValue.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i + 1] + vValue[i].first;
+
+    vector<char> vfSelected(vValue.size(), false);
+    vector<unsigned int> vSelected;
+    CAmount nSelected = 0;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < nMaxTries; nTries++) {
+        if (nSelected == nTargetValue) {
+            vfBest = vfSelected;
+            return true;
+        }
+        if ((nTries & 1023) == 1023 && GetTimeMicros() > nDeadline)
+            return false;
+
+        if (i < vValue.size() && nSelected + vRemaining[i] >= nTargetValue) {
+            // take the coin if it fits, else go on without it
+            if (nSelected + vValue[i].first <= nTargetValue) {
+                vfSelected[i] = true;
+                vSelected.push_back(i);
+                nSelected += vValue[i].first;
+            }
+            i++;
+            continue;
+        }
+
+        // Backtrack: leave out the last coin taken. Coins of the same value
+        // after it would only give the subsets already tried with it.
+        if (vSelected.empty())
+            return false;
+        unsigned int nLast = vSelected.back();
+        vSelected.pop_back();
+        vfSelected[nLast] = false;
+        nSelected -= vValue[nLast].first;
+        for (i = nLast + 1; i < vValue.size() && vValue[i].first == vValue[nLast].first; i++)
+            ;
+    }
+    return false;
+}
+
 // TODO: find appropriate place for this sort function
 // move denoms down
 bool less_then_denom(const COutput& out1, const COutput& out2)
@@ -1559,28 +2044,62 @@ bool less_then_denom(const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
-bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const
+static bool less_then_denom_ptr(const COutput* out1, const COutput* out2)
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
+    return less_then_denom(*out1, *out2);
+}
+
+/**
+ * Coins that can stake at nTime, oldest first, with their block and stake
+ * modifier. Only the coins old enough to stake are visited.
+ */
+bool CWallet::SelectStakeCoins(std::vector<std::pair<COutPoint, CStakeCandidate> >& vCoins, CAmount nTargetAmount, int64_t nTime)
+{
+    LOCK2(cs_main, cs_wallet);
+    GetWalletUTXO();
+
+    // a reorg may have changed the stake modifiers of any coin
+    if (pindexStakeModifiers && !chainActive.Contains(pindexStakeModifiers)) {
+        for (std::map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); ++it)
+            (*it).second.fStakeModifier = false;
+    }
+    pindexStakeModifiers = chainActive.Tip();
+
     CAmount nAmountSelected = 0;
+    for (std::set<std::pair<int64_t, COutPoint> >::const_iterator itReady = setStakeReady.begin(); itReady != setStakeReady.end(); ++itReady) {
+        if ((*itReady).first > nTime)
+            break;
 
-    BOOST_FOREACH (const COutput& out, vCoins) {
-        //make sure not to outrun target amount
-        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+        const COutPoint& outpoint = (*itReady).second;
+        CStakeCandidate& candidate = mapStakeCandidates[outpoint];
+        const CWalletTx* pcoin = GetWalletTx(outpoint.hash);
+        if (pcoin == NULL || !chainActive.Contains(candidate.pindexFrom))
             continue;
 
-        //check for min age
-        if (GetTime() - out.tx->GetTxTime() < nStakeMinAge)
+        //make sure not to outrun target amount
+        CAmount nValue = pcoin->vout[outpoint.n].nValue;
+        if (nAmountSelected + nValue > nTargetAmount)
             continue;
 
         //check that it is matured
-        if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+        int nDepth = chainActive.Height() - candidate.pindexFrom->nHeight + 1;
+        if (nDepth < ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) ? Params().COINBASE_MATURITY() + 1 : 10))
             continue;
 
+        if (IsLockedCoin(outpoint.hash, outpoint.n))
+            continue;
+
+        if (!candidate.fStakeModifier) {
+            int nStakeModifierHeight;
+            int64_t nStakeModifierTime;
+            if (!GetKernelStakeModifier(candidate.pindexFrom->GetBlockHash(), candidate.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+                continue;
+            candidate.fStakeModifier = true;
+        }
+
         //add to our stake set
-        setCoins.insert(make_pair(out.tx, out.i));
-        nAmountSelected += out.tx->vout[out.i].nValue;
+        vCoins.push_back(make_pair(outpoint, candidate));
+        nAmountSelected += nValue;
     }
     return true;
 }
@@ -1604,10 +2123,17 @@ bool CWallet::MintableCoins()
     return false;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoinsIn, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
+    int64_t nDeadline = GetTimeMicros() + (int64_t)nCoinSelectionMillis * 1000;
+
+    // shuffle and sort pointers, the coins themselves are not copied
+    vector<const COutput*> vCoins;
+    vCoins.reserve(vCoinsIn.size());
+    BOOST_FOREACH (const COutput& output, vCoinsIn)
+        vCoins.push_back(&output);
 
     // List of values less than target
     pair<CAmount, pair<const CWalletTx*, unsigned int> > coinLowestLarger;
@@ -1619,14 +2145,15 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
 
     // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
+    sort(vCoins.begin(), vCoins.end(), less_then_denom_ptr);
 
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
         if (fDebug) LogPrint("selectcoins", "tryDenom: %d\n", tryDenom);
         vValue.clear();
         nTotalLower = 0;
-        BOOST_FOREACH (const COutput& output, vCoins) {
+        BOOST_FOREACH (const COutput* poutput, vCoins) {
+            const COutput& output = *poutput;
             if (!output.fSpendable)
                 continue;
 
@@ -1681,14 +2208,18 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         break;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Look for an exact match first, then solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest, nDeadline)) {
+        nBest = nTargetValue;
+    } else {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nDeadline, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nDeadline, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1711,13 +2242,10 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type, bool useIX) const
+bool CWallet::SelectCoins(const vector<COutput>& vCoins, const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, AvailableCoinsType coin_type) const
 {
     // Note: this function should never be used for "always free" tx types like dstx
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, false, coin_type, useIX);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected()) {
         BOOST_FOREACH (const COutput& out, vCoins) {
@@ -2123,6 +2651,11 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
         {
             nFeeRet = 0;
             if (nFeePay > 0) nFeeRet = nFeePay;
+
+            // the coins to choose from do not change while the fee is adjusted
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl, false, coin_type, useIX);
+
             while (true) {
                 txNew.vin.clear();
                 txNew.vout.clear();
@@ -2165,7 +2698,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 set<pair<const CWalletTx*, unsigned int> > setCoins;
                 CAmount nValueIn = 0;
 
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl, coin_type, useIX)) {
+                if (!SelectCoins(vAvailableCoins, nTotalValue, setCoins, nValueIn, coinControl, coin_type)) {
                     if (coin_type == ALL_COINS) {
                         strFailReason = _("Insufficient funds.");
                     } else if (coin_type == ONLY_NOT10000IFMN) {
@@ -2338,21 +2871,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    // presstab HyperStake - Initialize as static and don't update the set on every run of CreateCoinStake() in order to lighten resource use
-    static std::set<pair<const CWalletTx*, unsigned int> > setStakeCoins;
-    static int nLastStakeSetUpdate = 0;
-
-    if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
-        setStakeCoins.clear();
-        if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
-            return false;
-
-        nLastStakeSetUpdate = GetTime();
-    }
-
-    if (setStakeCoins.empty())
-        return false;
-
     vector<const CWalletTx*> vwtxPrev;
 
     CAmount nCredit = 0;
@@ -2362,28 +2880,27 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (GetAdjustedTime() <= chainActive.Tip()->nTime)
         MilliSleep(10000);
 
-    BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = NULL;
-        BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
-        if (it != mapBlockIndex.end())
-            pindex = it->second;
-        else {
-            if (fDebug)
-                LogPrintf("CreateCoinStake() failed to find block index \n");
-            continue;
-        }
+    // the stake candidate index hands out only coins old and deep enough, with their block and modifier
+    std::vector<std::pair<COutPoint, CStakeCandidate> > vStakeCoins;
+    if (!SelectStakeCoins(vStakeCoins, nBalance - nReserveBalance, GetAdjustedTime()))
+        return false;
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+    if (vStakeCoins.empty())
+        return false;
+
+    BOOST_FOREACH (const PAIRTYPE(COutPoint, CStakeCandidate) & item, vStakeCoins) {
+        const COutPoint& prevoutStake = item.first;
+        const CStakeCandidate& candidate = item.second;
+        const CWalletTx* pwtx = GetWalletTx(prevoutStake.hash);
+        if (pwtx == NULL)
+            continue;
 
         bool fKernelFound = false;
         uint256 hashProofOfStake = 0;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
         nTxNewTime = GetAdjustedTime();
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (CheckStakeKernelHash(nBits, block, *pcoin.first, prevoutStake, nTxNewTime, nHashDrift, false, hashProofOfStake, true)) {
+        //iterates each utxo inside of SearchStakeKernelHash()
+        if (SearchStakeKernelHash(nBits, candidate.nStakeModifier, candidate.pindexFrom->nTime, prevoutStake, pwtx->vout[prevoutStake.n].nValue, nTxNewTime, nHashDrift, hashProofOfStake)) {
             //Double check that this will pass time requirements
             if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
                 LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
@@ -2397,7 +2914,7 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             vector<valtype> vSolutions;
             txnouttype whichType;
             CScript scriptPubKeyOut;
-            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+            scriptPubKeyKernel = pwtx->vout[prevoutStake.n].scriptPubKey;
             if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
                 LogPrintf("CreateCoinStake : failed to parse kernel\n");
                 break;
@@ -2423,14 +2940,14 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
             } else
                 scriptPubKeyOut = scriptPubKeyKernel;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
+            txNew.vin.push_back(CTxIn(prevoutStake.hash, prevoutStake.n));
+            nCredit += pwtx->vout[prevoutStake.n].nValue;
+            vwtxPrev.push_back(pwtx);
             txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
             //presstab HyperStake - calculate the total size of our new output including the stake reward so that we can use it to decide whether to split the stake outputs
             const CBlockIndex* pIndex0 = chainActive.Tip();
-            uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
+            uint64_t nTotalSize = pwtx->vout[prevoutStake.n].nValue + GetBlockValue(pIndex0->nHeight);
 
             //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
             if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
@@ -2444,6 +2961,10 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         if (fKernelFound)
             break; // if kernel is found stop searching
     }
+
+    mapHashedBlocks.clear();
+    mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
@@ -2491,10 +3012,23 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     }
 
     // Successfully generated coinstake
-    nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
     return true;
 }
 
+void CWallet::NotifySpentCoins(const CWalletTx& wtx)
+{
+    set<uint256> updated_hahes;
+    BOOST_FOREACH (const CTxIn& txin, wtx.vin) {
+        // notify only once
+        if (updated_hahes.find(txin.prevout.hash) != updated_hahes.end()) continue;
+
+        CWalletTx& coin = mapWallet[txin.prevout.hash];
+        coin.BindWallet(this);
+        NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
+        updated_hahes.insert(txin.prevout.hash);
+    }
+}
+
 /**
  * Call after CreateTransaction unless you want to abort
  */
@@ -2517,16 +3051,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
             AddToWallet(wtxNew);
 
             // Notify that old coins are spent
-            set<uint256> updated_hahes;
-            BOOST_FOREACH (const CTxIn& txin, wtxNew.vin) {
-                // notify only once
-                if (updated_hahes.find(txin.prevout.hash) != updated_hahes.end()) continue;
-
-                CWalletTx& coin = mapWallet[txin.prevout.hash];
-                coin.BindWallet(this);
-                NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
-                updated_hahes.insert(txin.prevout.hash);
-            }
+            NotifySpentCoins(wtxNew);
             if (fFileBacked)
                 delete pwalletdb;
         }
@@ -2545,6 +3070,292 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
     return true;
 }
 
+//! Largest signature script of a single key input: a signature and an uncompressed public key
+static const unsigned int MAX_SINGLE_KEY_SCRIPTSIG_SIZE = 1 + 73 + 1 + 65;
+
+/**
+ * Signs the inputs of a batch of transactions on -par worker threads. Each
+ * worker signs every nStep-th input on its own copy of the transactions;
+ * the signature scripts are put back once all workers are done.
+ */
+class CTransactionBatchSigner
+{
+private:
+    const CKeyStore& keystore;
+    std::vector<CMutableTransaction>& vTxs;
+    const std::vector<std::vector<const CWalletTx*> >& vPrevTxs;
+    std::vector<std::vector<CScript> > vScriptSigs;
+    std::vector<std::vector<char> > vfSigned;
+    boost::thread_group threads;
+
+    void SignInputs(unsigned int nFirst, unsigned int nStep)
+    {
+        RenameThread("lyra-sign");
+        unsigned int nInput = 0;
+        for (unsigned int i = 0; i < vTxs.size(); i++) {
+            CMutableTransaction txCopy;
+            bool fCopied = false;
+            for (unsigned int j = 0; j < vTxs[i].vin.size(); j++, nInput++) {
+                if (nInput % nStep != nFirst)
+                    continue;
+                if (!fCopied) {
+                    txCopy = vTxs[i];
+                    fCopied = true;
+                }
+                vfSigned[i][j] = SignSignature(keystore, *vPrevTxs[i][j], txCopy, j);
+                vScriptSigs[i][j] = txCopy.vin[j].scriptSig;
+            }
+        }
+    }
+
+public:
+    CTransactionBatchSigner(const CKeyStore& keystoreIn, std::vector<CMutableTransaction>& vTxsIn, const std::vector<std::vector<const CWalletTx*> >& vPrevTxsIn) : keystore(keystoreIn), vTxs(vTxsIn), vPrevTxs(vPrevTxsIn) {}
+
+    bool Sign(int nThreads)
+    {
+        unsigned int nInputs = 0;
+        vScriptSigs.resize(vTxs.size());
+        vfSigned.resize(vTxs.size());
+        for (unsigned int i = 0; i < vTxs.size(); i++) {
+            vScriptSigs[i].resize(vTxs[i].vin.size());
+            vfSigned[i].assign(vTxs[i].vin.size(), false);
+            nInputs += vTxs[i].vin.size();
+        }
+        for (int i = 0; i < nThreads && i < (int)nInputs; i++)
+            threads.create_thread(boost::bind(&CTransactionBatchSigner::SignInputs, this, i, nThreads));
+        threads.join_all();
+
+        for (unsigned int i = 0; i < vTxs.size(); i++) {
+            for (unsigned int j = 0; j < vTxs[i].vin.size(); j++) {
+                if (!vfSigned[i][j])
+                    return false;
+                vTxs[i].vin[j].scriptSig = vScriptSigs[i][j];
+            }
+        }
+        return true;
+    }
+};
+
+bool CWallet::CreateTransactionBatch(const vector<pair<CScript, CAmount> >& vecSend, unsigned int nMaxOutputs, vector<CWalletTx>& vwtxNew, vector<boost::shared_ptr<CReserveKey> >& vReserveKeys, CAmount& nFeeRet, std::string& strFailReason)
+{
+    LOCK2(cs_main, cs_wallet);
+
+    vector<COutput> vAvailableCoins;
+    AvailableCoins(vAvailableCoins, true, NULL, false, ALL_COINS, false);
+    return CreateTransactionBatch(vAvailableCoins, vecSend, nMaxOutputs, vwtxNew, vReserveKeys, nFeeRet, strFailReason);
+}
+
+bool CWallet::CreateTransactionBatch(const vector<COutput>& vCoins, const vector<pair<CScript, CAmount> >& vecSend, unsigned int nMaxOutputs, vector<CWalletTx>& vwtxNew, vector<boost::shared_ptr<CReserveKey> >& vReserveKeys, CAmount& nFeeRet, std::string& strFailReason)
+{
+    vwtxNew.clear();
+    vReserveKeys.clear();
+    nFeeRet = 0;
+
+    if (vecSend.empty() || nMaxOutputs == 0) {
+        strFailReason = _("Transaction amounts must be positive");
+        return false;
+    }
+    BOOST_FOREACH (const PAIRTYPE(CScript, CAmount) & s, vecSend) {
+        if (s.second <= 0) {
+            strFailReason = _("Transaction amounts must be positive");
+            return false;
+        }
+        if (CTxOut(s.second, s.first).IsDust(::minRelayTxFee)) {
+            strFailReason = _("Transaction amount too small");
+            return false;
+        }
+    }
+
+    vector<CMutableTransaction> vTxs;
+    vector<vector<const CWalletTx*> > vPrevTxs;
+    vector<CAmount> vFees;
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        // the fees are sized for single key signatures, so multisig and P2SH
+        // coins are left out. Coins chosen for a transaction are taken out too,
+        // so the next ones cannot spend them
+        vector<COutput> vAvailableCoins;
+        BOOST_FOREACH (const COutput& out, vCoins) {
+            txnouttype whichType;
+            vector<valtype> vSolutions;
+            if (Solver(out.tx->vout[out.i].scriptPubKey, whichType, vSolutions) && (whichType == TX_PUBKEY || whichType == TX_PUBKEYHASH))
+                vAvailableCoins.push_back(out);
+        }
+
+        // payments still to be placed, as ranges of vecSend
+        std::list<pair<unsigned int, unsigned int> > listRanges;
+        for (unsigned int i = 0; i < vecSend.size(); i += nMaxOutputs)
+            listRanges.push_back(make_pair(i, std::min(i + nMaxOutputs, (unsigned int)vecSend.size())));
+
+        while (!listRanges.empty()) {
+            pair<unsigned int, unsigned int> range = listRanges.front();
+            listRanges.pop_front();
+
+            CAmount nValue = 0;
+            for (unsigned int i = range.first; i < range.second; i++)
+                nValue += vecSend[i].second;
+
+            boost::shared_ptr<CReserveKey> pkeyChange(new CReserveKey(this));
+            CMutableTransaction txNew;
+            set<pair<const CWalletTx*, unsigned int> > setCoins;
+            vector<const CWalletTx*> vPrev;
+            CAmount nFee = 0;
+            bool fTooLarge = false;
+            while (true) {
+                txNew.vin.clear();
+                txNew.vout.clear();
+                for (unsigned int i = range.first; i < range.second; i++)
+                    txNew.vout.push_back(CTxOut(vecSend[i].second, vecSend[i].first));
+
+                setCoins.clear();
+                CAmount nValueIn = 0;
+                if (!SelectCoins(vAvailableCoins, nValue + nFee, setCoins, nValueIn)) {
+                    strFailReason = _("Insufficient funds.");
+                    return false;
+                }
+
+                CAmount nChange = nValueIn - nValue - nFee;
+                if (nChange > 0) {
+                    CPubKey vchPubKey;
+                    bool ret;
+                    ret = pkeyChange->GetReservedKey(vchPubKey);
+                    assert(ret); // should never fail, as we just unlocked
+
+                    CTxOut newTxOut(nChange, GetScriptForDestination(vchPubKey.GetID()));
+                    if (newTxOut.IsDust(::minRelayTxFee)) {
+                        nFee += nChange;
+                        pkeyChange->ReturnKey();
+                    } else {
+                        // Insert change txn at random position:
+                        vector<CTxOut>::iterator position = txNew.vout.begin() + GetRandInt(txNew.vout.size() + 1);
+                        txNew.vout.insert(position, newTxOut);
+                    }
+                } else
+                    pkeyChange->ReturnKey();
+
+                vPrev.clear();
+                BOOST_FOREACH (const PAIRTYPE(const CWalletTx*, unsigned int) & coin, setCoins) {
+                    txNew.vin.push_back(CTxIn(coin.first->GetHash(), coin.second));
+                    vPrev.push_back(coin.first);
+                }
+
+                // the size once signed, without signing on every pass
+                unsigned int nBytes = ::GetSerializeSize(txNew, SER_NETWORK, PROTOCOL_VERSION) + txNew.vin.size() * MAX_SINGLE_KEY_SCRIPTSIG_SIZE;
+                if (nBytes >= MAX_STANDARD_TX_SIZE) {
+                    fTooLarge = true;
+                    break;
+                }
+
+                CAmount nFeeNeeded = GetMinimumFee(nBytes, nTxConfirmTarget, mempool);
+                if (nFeeNeeded < ::minRelayTxFee.GetFee(nBytes)) {
+                    strFailReason = _("Transaction too large for fee policy");
+                    return false;
+                }
+                if (nFee >= nFeeNeeded)
+                    break;
+                nFee = nFeeNeeded;
+            }
+
+            if (fTooLarge) {
+                if (range.second - range.first < 2) {
+                    strFailReason = _("Transaction too large");
+                    return false;
+                }
+                // pay the halves in two transactions
+                unsigned int nMiddle = range.first + (range.second - range.first) / 2;
+                listRanges.push_front(make_pair(nMiddle, range.second));
+                listRanges.push_front(make_pair(range.first, nMiddle));
+                pkeyChange->ReturnKey();
+                continue;
+            }
+
+            vector<COutput> vCoinsLeft;
+            vCoinsLeft.reserve(vAvailableCoins.size());
+            BOOST_FOREACH (const COutput& out, vAvailableCoins) {
+                if (!setCoins.count(make_pair(out.tx, (unsigned int)out.i)))
+                    vCoinsLeft.push_back(out);
+            }
+            vAvailableCoins.swap(vCoinsLeft);
+
+            vTxs.push_back(txNew);
+            vPrevTxs.push_back(vPrev);
+            vFees.push_back(nFee);
+            vReserveKeys.push_back(pkeyChange);
+            nFeeRet += nFee;
+        }
+
+        // Sign
+        CTransactionBatchSigner signer(*this, vTxs, vPrevTxs);
+        if (!signer.Sign(std::max(1, nScriptCheckThreads))) {
+            strFailReason = _("Signing transaction failed");
+            return false;
+        }
+    }
+
+    for (unsigned int i = 0; i < vTxs.size(); i++) {
+        CWalletTx wtxNew(this, CTransaction(vTxs[i]));
+        wtxNew.fTimeReceivedIsTxTime = true;
+        wtxNew.fFromMe = true;
+
+        // the estimate must not have been short of the signed transaction
+        unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBytes >= MAX_STANDARD_TX_SIZE) {
+            strFailReason = _("Transaction too large");
+            return false;
+        }
+        if (vFees[i] < GetMinimumFee(nBytes, nTxConfirmTarget, mempool)) {
+            strFailReason = _("Transaction fee too low for its signed size");
+            return false;
+        }
+        vwtxNew.push_back(wtxNew);
+    }
+    return true;
+}
+
+bool CWallet::CommitTransactionBatch(vector<CWalletTx>& vwtxNew, vector<boost::shared_ptr<CReserveKey> >& vReserveKeys, vector<bool>& vAccepted)
+{
+    bool fAccepted = true;
+    vAccepted.assign(vwtxNew.size(), false);
+    {
+        LOCK2(cs_main, cs_wallet);
+        {
+            // Keep the database open for the whole batch, and get the writes
+            // of all transactions to disk together
+            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile, "r") : NULL;
+
+            for (unsigned int i = 0; i < vwtxNew.size(); i++) {
+                LogPrintf("CommitTransactionBatch: %u of %u\n%s", i + 1, vwtxNew.size(), vwtxNew[i].ToString());
+                vReserveKeys[i]->KeepKey(false);
+                AddToWallet(vwtxNew[i]);
+                NotifySpentCoins(vwtxNew[i]);
+            }
+            if (fFileBacked) {
+                pwalletdb->CommitJournal(true);
+                delete pwalletdb;
+            }
+        }
+
+        // Broadcast once all of them are in the memory pool. A transaction that
+        // is refused stays in the wallet like with CommitTransaction, the others
+        // still go out
+        for (unsigned int i = 0; i < vwtxNew.size(); i++) {
+            mapRequestCount[vwtxNew[i].GetHash()] = 0;
+            vAccepted[i] = vwtxNew[i].AcceptToMemoryPool(false);
+            if (!vAccepted[i]) {
+                // This must not fail. The transaction has already been signed and recorded.
+                LogPrintf("CommitTransactionBatch() : Error: Transaction %s not valid\n", vwtxNew[i].GetHash().ToString());
+                fAccepted = false;
+            }
+        }
+        for (unsigned int i = 0; i < vwtxNew.size(); i++) {
+            if (vAccepted[i])
+                vwtxNew[i].RelayWalletTransaction();
+        }
+    }
+    return fAccepted;
+}
+
 CAmount CWallet::GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool)
 {
     // payTxFee is user-set "I want to pay this much"
@@ -2839,6 +3650,8 @@ bool CWallet::NewKeyPool()
             walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
             setKeyPool.insert(nIndex);
         }
+        if (!walletdb.CommitJournal(true))
+            return error("CWallet::NewKeyPool() : failed to sync the new keys");
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -2873,6 +3686,10 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
             std::string strMsg = strprintf(_("Loading wallet... (%3.2f %%)"), dProgress);
             uiInterface.InitMessage(strMsg);
         }
+
+        // one sync for all the keys added, before any of them is handed out
+        if (!walletdb.CommitJournal(true))
+            throw runtime_error("TopUpKeyPool() : syncing generated keys failed");
     }
     return true;
 }
@@ -2904,12 +3721,14 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     }
 }
 
-void CWallet::KeepKey(int64_t nIndex)
+void CWallet::KeepKey(int64_t nIndex, bool fSync)
 {
-    // Remove from key pool
+    // Remove from key pool, for good once synced: a crash must not hand the key out again
     if (fFileBacked) {
         CWalletDB walletdb(strWalletFile);
         walletdb.ErasePool(nIndex);
+        if (fSync && !walletdb.CommitJournal(true))
+            LogPrintf("CWallet::KeepKey() : failed to sync the erase of keypool key %d\n", nIndex);
     }
     LogPrintf("keypool keep %d\n", nIndex);
 }
@@ -2934,7 +3753,7 @@ bool CWallet::GetKeyFromPool(CPubKey& result)
         if (nIndex == -1) {
             if (IsLocked()) return false;
             result = GenerateNewKey();
-            return true;
+            return SyncKeys();
         }
         KeepKey(nIndex);
         result = keypool.vchPubKey;
@@ -2942,6 +3761,13 @@ bool CWallet::GetKeyFromPool(CPubKey& result)
     return true;
 }
 
+bool CWallet::SyncKeys()
+{
+    if (!fFileBacked)
+        return true;
+    return CWalletDB(strWalletFile).CommitJournal(true);
+}
+
 int64_t CWallet::GetOldestKeyPoolTime()
 {
     int64_t nIndex = 0;
@@ -3103,10 +3929,10 @@ bool CReserveKey::GetReservedKey(CPubKey& pubkey)
     return true;
 }
 
-void CReserveKey::KeepKey()
+void CReserveKey::KeepKey(bool fSync)
 {
     if (nIndex != -1)
-        pwallet->KeepKey(nIndex);
+        pwallet->KeepKey(nIndex, fSync);
     nIndex = -1;
     vchPubKey = CPubKey();
 }
@@ -3145,6 +3971,8 @@ bool CWallet::UpdatedTransaction(const uint256& hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()) {
+            // its depth or trust changed without a new tip, e.g. a SwiftTX lock completed
+            nWalletGeneration++;
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -3156,18 +3984,21 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    nWalletGeneration++;
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    nWalletGeneration++;
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.clear();
+    nWalletGeneration++;
 }
 
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
@@ -3617,24 +4448,12 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!IsSporkActive(SPORK_2_SWIFTTX)) return -3;
     if (!fEnableSwiftTX) return -1;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()) {
-        return (*i).second.CountSignatures();
-    }
-
-    return -1;
+    return swiftTXManager.GetSignatures(GetHash());
 }
 
 bool CMerkleTx::IsTransactionLockTimedOut() const
 {
     if (!fEnableSwiftTX) return 0;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()) {
-        return GetTime() > (*i).second.nTimeout;
-    }
-
-    return false;
+    return swiftTXManager.IsTimedOut(GetHash());
 }
@@ -32,6 +32,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 /**
  * Settings
  */
@@ -39,6 +41,7 @@ extern CFeeRate payTxFee;
 extern CAmount maxTxFee;
 extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
+extern unsigned int nCoinSelectionMillis;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
 
@@ -52,8 +55,19 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Outputs whose obfuscation rounds are kept before the table is started over
+static const unsigned int MAX_OBFUSCATION_ROUNDS_CACHE = 200000;
+//! -coinselectionms default, the time coin selection searches for a better set of coins
+static const unsigned int DEFAULT_COIN_SELECTION_MS = 250;
+//! Steps of the exact match search of coin selection
+static const int COIN_SELECTION_BNB_TRIES = 100000;
+//! Payments in a transaction of a batch payout, unless set otherwise
+static const unsigned int DEFAULT_BATCH_MAX_OUTPUTS = 500;
+//! Blocks a rescan reads and matches ahead on worker threads before applying them
+static const unsigned int WALLET_RESCAN_CHUNK = 64;
 
 class CAccountingEntry;
+class CBlockFilterQuery;
 class CCoinControl;
 class COutput;
 class CReserveKey;
@@ -88,6 +102,20 @@ struct CompactTallyItem {
     }
 };
 
+/**
+ * A wallet coin that can stake, with what a kernel hash needs from the block
+ * it is in. The stake modifier is known once the chain is a modifier
+ * selection interval past that block.
+ */
+struct CStakeCandidate {
+    const CBlockIndex* pindexFrom;
+    int64_t nTimeReady; //! block time plus nStakeMinAge
+    bool fStakeModifier;
+    uint64_t nStakeModifier;
+
+    CStakeCandidate() : pindexFrom(NULL), nTimeReady(0), fStakeModifier(false), nStakeModifier(0) {}
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -133,7 +161,7 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = true) const;
+    bool SelectCoins(const std::vector<COutput>& vCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS) const;
     //it was public bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
 
     CWalletDB* pwalletdbEncryption;
@@ -159,9 +187,78 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Obfuscation rounds of the wallet outputs looked up so far. An entry only
+     * depends on the transactions it descends from, so it stays valid until one
+     * of them is added to the wallet.
+     */
+    mutable std::map<COutPoint, int> mapObfuscationRounds;
+    void ForgetObfuscationRounds(const uint256& wtxid);
+
+    /**
+     * Outputs of wallet transactions that are ours and not spent by another
+     * wallet transaction. AddToWallet keeps it current; anything that changes
+     * which scripts are ours marks it dirty and it is rebuilt on next use.
+     */
+    mutable std::set<COutPoint> setWalletUTXO;
+    mutable bool fWalletUTXODirty;
+    //! Set while GenerateNewKey adds a key, which can't be paid by any wallet output yet
+    bool fGeneratingKey;
+    void UpdateWalletUTXO(const uint256& wtxid);
+    void UpdateConflictedSpends(const CTransaction& tx);
+    const std::set<COutPoint>& GetWalletUTXO() const;
+    std::vector<const CWalletTx*> GetWalletUTXOTxs() const;
+
+    /**
+     * The spendable confirmed coins of setWalletUTXO, ordered by the time
+     * they reach nStakeMinAge so that a stake attempt stops at the first
+     * coin that is too young. Kept in step with setWalletUTXO.
+     */
+    mutable std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    mutable std::set<std::pair<int64_t, COutPoint> > setStakeReady;
+    //! Tip the cached stake modifiers were taken from, they are dropped on a reorg
+    const CBlockIndex* pindexStakeModifiers;
+    void UpdateStakeCandidate(const COutPoint& outpoint) const;
+
+    //! Tell the UI the coins spent by a transaction we created changed
+    void NotifySpentCoins(const CWalletTx& wtx);
+
+    enum BalanceType {
+        BALANCE_AVAILABLE,
+        BALANCE_UNCONFIRMED,
+        BALANCE_IMMATURE,
+        BALANCE_WATCH_ONLY,
+        BALANCE_UNCONFIRMED_WATCH_ONLY,
+        BALANCE_IMMATURE_WATCH_ONLY,
+        BALANCE_ANONYMIZABLE,
+        BALANCE_ANONYMIZED,
+        BALANCE_NORMALIZED_ANONYMIZED,
+        BALANCE_DENOMINATED,
+        BALANCE_DENOMINATED_UNCONFIRMED
+    };
+
+    /**
+     * Balances computed since the last change to the wallet, the chain tip,
+     * the mempool or the obfuscation rounds setting.
+     */
+    unsigned int nWalletGeneration;
+    mutable std::map<int, CAmount> mapCachedBalances;
+    mutable uint256 hashCachedBalancesTip;
+    mutable unsigned int nCachedBalancesGeneration;
+    mutable unsigned int nCachedBalancesMempool;
+    mutable int nCachedBalancesRounds;
+    bool GetCachedBalance(BalanceType nType, CAmount& nBalanceRet) const;
+    void SetCachedBalance(BalanceType nType, CAmount nBalance) const;
+
+    /**
+     * Fill query with what block filters of blocks involving the wallet
+     * contain. False if a watched script has no data a filter could match.
+     */
+    bool GetBlockFilterQuery(CBlockFilterQuery& query) const;
+
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const;
+    bool SelectStakeCoins(std::vector<std::pair<COutPoint, CStakeCandidate> >& vCoins, CAmount nTargetAmount, int64_t nTime);
     bool SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxIn>& vCoinsRet, std::vector<COutput>& vCoinsRet2, CAmount& nValueRet, int nObfuscationRoundsMin, int nObfuscationRoundsMax);
     bool SelectCoinsDarkDenominated(CAmount nTargetValue, std::vector<CTxIn>& setCoinsRet, CAmount& nValueRet) const;
@@ -195,7 +292,6 @@ public:
     unsigned int nHashDrift;
     unsigned int nHashInterval;
     uint64_t nStakeSplitThreshold;
-    int nStakeSetUpdateTime;
 
     //MultiSend
     std::vector<std::pair<std::string, int> > vMultiSend;
@@ -240,12 +336,19 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fWalletUTXODirty = true;
+        fGeneratingKey = false;
+        pindexStakeModifiers = NULL;
+        nWalletGeneration = 0;
+        hashCachedBalancesTip = 0;
+        nCachedBalancesGeneration = 0;
+        nCachedBalancesMempool = 0;
+        nCachedBalancesRounds = 0;
 
         // Stake Settings
         nHashDrift = 45;
         nStakeSplitThreshold = 2000;
         nHashInterval = 22;
-        nStakeSetUpdateTime = 300; // 5 minutes
 
         //MultiSend
         vMultiSend.clear();
@@ -296,7 +399,7 @@ public:
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     /// Get 1000DASH output and keys which can be used for the Masternode
     bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash = "", std::string strOutputIndex = "");
@@ -405,6 +508,31 @@ public:
         CAmount nFeePay = 0);
     bool CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl = NULL, AvailableCoinsType coin_type = ALL_COINS, bool useIX = false, CAmount nFeePay = 0);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std::string strCommand = "tx");
+    /**
+     * Pay vecSend in as few transactions as the size limits allow, with at
+     * most nMaxOutputs payments each. The coins are chosen once for the whole
+     * batch, so no two transactions spend the same coin, and all inputs are
+     * signed together on worker threads. Nothing is committed.
+     */
+    bool CreateTransactionBatch(const std::vector<std::pair<CScript, CAmount> >& vecSend,
+        unsigned int nMaxOutputs,
+        std::vector<CWalletTx>& vwtxNew,
+        std::vector<boost::shared_ptr<CReserveKey> >& vReserveKeys,
+        CAmount& nFeeRet,
+        std::string& strFailReason);
+    //! Same, spending only the single key coins of vCoins
+    bool CreateTransactionBatch(const std::vector<COutput>& vCoins,
+        const std::vector<std::pair<CScript, CAmount> >& vecSend,
+        unsigned int nMaxOutputs,
+        std::vector<CWalletTx>& vwtxNew,
+        std::vector<boost::shared_ptr<CReserveKey> >& vReserveKeys,
+        CAmount& nFeeRet,
+        std::string& strFailReason);
+    /**
+     * Record the transactions of a batch, then relay the ones the memory pool
+     * accepted. vAccepted tells which ones, false is returned if any was refused.
+     */
+    bool CommitTransactionBatch(std::vector<CWalletTx>& vwtxNew, std::vector<boost::shared_ptr<CReserveKey> >& vReserveKeys, std::vector<bool>& vAccepted);
     std::string PrepareObfuscationDenominate(int minRounds, int maxRounds);
     int GenerateObfuscationOutputs(int nTotalValue, std::vector<CTxOut>& vout);
     bool CreateCollateralTransaction(CMutableTransaction& txCollateral, std::string& strReason);
@@ -419,9 +547,12 @@ public:
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
-    void KeepKey(int64_t nIndex);
+    //! fSync false leaves the sync of the erase to the caller, see SyncKeys
+    void KeepKey(int64_t nIndex, bool fSync = true);
     void ReturnKey(int64_t nIndex);
     bool GetKeyFromPool(CPubKey& key);
+    //! Get the keys and keypool changes written since the last call to disk, with one sync
+    bool SyncKeys();
     int64_t GetOldestKeyPoolTime();
     void GetAllReserveKeys(std::set<CKeyID>& setAddress) const;
 
@@ -590,7 +721,7 @@ public:
 
     void ReturnKey();
     bool GetReservedKey(CPubKey& pubkey);
-    void KeepKey();
+    void KeepKey(bool fSync = true);
 };
 
 
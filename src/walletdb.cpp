@@ -15,6 +15,7 @@
 #include "utiltime.h"
 #include "wallet.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -82,6 +83,7 @@ bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, c
     vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
     vchKey.insert(vchKey.end(), vchPrivKey.begin(), vchPrivKey.end());
 
+    // the caller syncs the journal once the batch of keys is written
     return Write(std::make_pair(std::string("key"), vchPubKey), std::make_pair(vchPrivKey, Hash(vchKey.begin(), vchKey.end())), false);
 }
 
@@ -108,13 +110,13 @@ bool CWalletDB::WriteCryptedKey(const CPubKey& vchPubKey,
 bool CWalletDB::WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
 {
     nWalletDBUpdated++;
-    return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true);
+    return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true) && CommitJournal(true);
 }
 
 bool CWalletDB::WriteCScript(const uint160& hash, const CScript& redeemScript)
 {
     nWalletDBUpdated++;
-    return Write(std::make_pair(std::string("cscript"), hash), redeemScript, false);
+    return Write(std::make_pair(std::string("cscript"), hash), redeemScript, false) && CommitJournal(true);
 }
 
 bool CWalletDB::WriteWatchOnly(const CScript& dest)
@@ -404,6 +406,97 @@ public:
     }
 };
 
+/** Read a "tx" record, undoing the serialize changes of 31600 */
+static bool ReadTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
+        if (!ssValue.empty()) {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        } else {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void LoadTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtx, bool fUpgraded, CWalletScanState& wss)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(hash);
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->AddToWallet(wtx, true);
+}
+
+/** Read a "key" or "wkey" record and check the private key against its public key */
+static bool ReadKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid()) {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash = 0;
+
+    if (strType == "key") {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try {
+        ssValue >> hash;
+    } catch (...) {
+    }
+
+    bool fSkipCheck = false;
+
+    if (hash != 0) {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash) {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
 bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CWalletScanState& wss, string& strType, string& strErr)
 {
     try {
@@ -421,33 +514,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
         } else if (strType == "tx") {
             uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!ReadTx(ssKey, ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703) {
-                if (!ssValue.empty()) {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                        wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                } else {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true);
+            LoadTx(pwallet, hash, wtx, fUpgraded, wss);
         } else if (strType == "acentry") {
             string strAccount;
             ssKey >> strAccount;
@@ -475,55 +546,11 @@ bool ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue, CW
             pwallet->nTimeFirstKey = 1;
         } else if (strType == "key" || strType == "wkey") {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid()) {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            uint256 hash = 0;
-
-            if (strType == "key") {
+            if (strType == "key")
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try {
-                ssValue >> hash;
-            } catch (...) {
-            }
-
-            bool fSkipCheck = false;
-
-            if (hash != 0) {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash) {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck)) {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!ReadKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey)) {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -646,6 +673,87 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/**
+ * A run of wallet records read from the cursor. Transactions and keys, which
+ * take most of the loading time, are deserialized and checked on -par worker
+ * threads; the records are then loaded into the wallet in cursor order.
+ */
+class CWalletLoadBatch
+{
+private:
+    boost::thread_group threads;
+
+    void DecodeRecords(unsigned int nFirst, unsigned int nStep)
+    {
+        RenameThread("lyra-loadwallet");
+        for (unsigned int i = nFirst; i < vRecords.size(); i += nStep) {
+            Record& record = vRecords[i];
+            try {
+                CDataStream ssType(record.ssKey);
+                ssType >> record.strType;
+                if (record.strType == "tx") {
+                    record.fValid = ReadTx(ssType, record.ssValue, record.hash, record.wtx, record.fUpgraded, record.strErr);
+                    record.fDecoded = true;
+                } else if (record.strType == "key" || record.strType == "wkey") {
+                    record.fValid = ReadKey(record.strType, ssType, record.ssValue, record.vchPubKey, record.key, record.strErr);
+                    record.fDecoded = true;
+                }
+            } catch (...) {
+                record.fValid = false;
+                record.fDecoded = true;
+            }
+        }
+    }
+
+public:
+    struct Record {
+        CDataStream ssKey;
+        CDataStream ssValue;
+        std::string strType;
+        //! decoded by a worker, else left to ReadKeyValue
+        bool fDecoded;
+        bool fValid;
+        std::string strErr;
+        uint256 hash;
+        CWalletTx wtx;
+        bool fUpgraded;
+        CPubKey vchPubKey;
+        CKey key;
+
+        Record() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), fDecoded(false), fValid(false), fUpgraded(false) {}
+    };
+
+    std::vector<Record> vRecords;
+
+    void Decode(int nThreads)
+    {
+        for (int i = 0; i < nThreads && i < (int)vRecords.size(); i++)
+            threads.create_thread(boost::bind(&CWalletLoadBatch::DecodeRecords, this, i, nThreads));
+        threads.join_all();
+    }
+
+    /** Load a record into the wallet, like ReadKeyValue */
+    static bool Load(CWallet* pwallet, Record& record, CWalletScanState& wss, string& strType, string& strErr)
+    {
+        if (!record.fDecoded)
+            return ReadKeyValue(pwallet, record.ssKey, record.ssValue, wss, strType, strErr);
+
+        strType = record.strType;
+        strErr = record.strErr;
+        if (strType == "key")
+            wss.nKeys++;
+        if (!record.fValid)
+            return false;
+        if (strType == "tx") {
+            LoadTx(pwallet, record.hash, record.wtx, record.fUpgraded, wss);
+        } else if (!pwallet->LoadKey(record.key, record.vchPubKey)) {
+            strErr = "Error reading wallet database: LoadKey failed";
+            return false;
+        }
+        return true;
+    }
+};
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -669,35 +777,48 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
-        while (true) {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0) {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+        int nThreads = std::max(1, nScriptCheckThreads);
+        CWalletLoadBatch batch;
+        bool fDone = false;
+        while (!fDone) {
+            // Read the next records
+            batch.vRecords.clear();
+            batch.vRecords.reserve(WALLET_LOAD_BATCH);
+            while (batch.vRecords.size() < WALLET_LOAD_BATCH) {
+                batch.vRecords.push_back(CWalletLoadBatch::Record());
+                CWalletLoadBatch::Record& record = batch.vRecords.back();
+                int ret = ReadAtCursor(pcursor, record.ssKey, record.ssValue);
+                if (ret == DB_NOTFOUND) {
+                    batch.vRecords.pop_back();
+                    fDone = true;
+                    break;
+                } else if (ret != 0) {
+                    LogPrintf("Error reading next record from wallet database\n");
+                    pcursor->close();
+                    return DB_CORRUPT;
+                }
             }
-
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr)) {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+            batch.Decode(nThreads);
+
+            BOOST_FOREACH (CWalletLoadBatch::Record& record, batch.vRecords) {
+                // Try to be tolerant of single corrupt records:
+                string strType, strErr;
+                if (!CWalletLoadBatch::Load(pwallet, record, wss, strType, strErr)) {
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!strErr.empty())
+                    LogPrintf("%s\n", strErr);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
         }
         pcursor->close();
     } catch (boost::thread_interrupted) {
@@ -825,14 +946,30 @@ void ThreadFlushWalletDB(const string& strFile)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
+    bool fFlushWallet = GetBoolArg("-flushwallet", true);
+    int64_t nJournalMillis = GetArg("-walletflushms", DEFAULT_WALLET_FLUSH_MS);
+    if (nJournalMillis > 0)
+        bitdb.EnableJournal(strFile);
+    else if (!fFlushWallet)
         return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64_t nLastWalletUpdate = GetTime();
+    int64_t nLastJournalCommit = GetTimeMillis();
     while (true) {
-        MilliSleep(500);
+        MilliSleep(nJournalMillis > 0 ? std::min(nJournalMillis, (int64_t)500) : 500);
+
+        // Group commit of the writes made since the last one
+        if (nJournalMillis > 0 && GetTimeMillis() - nLastJournalCommit >= nJournalMillis) {
+            nLastJournalCommit = GetTimeMillis();
+            CWalletDB walletdb(strFile);
+            if (!walletdb.CommitJournal(true))
+                LogPrintf("ThreadFlushWalletDB : failed to commit the %s journal\n", strFile);
+        }
+
+        if (!fFlushWallet)
+            continue;
 
         if (nLastSeen != nWalletDBUpdated) {
             nLastSeen = nWalletDBUpdated;
@@ -875,6 +1012,8 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    if (!CWalletDB(wallet.strWalletFile).CommitJournal(true))
+        return false;
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -28,6 +28,12 @@ class CWalletTx;
 class uint160;
 class uint256;
 
+//! Default for -walletflushms, the longest a wallet write waits in memory before it is on disk
+static const int64_t DEFAULT_WALLET_FLUSH_MS = 500;
+
+//! Wallet records read from the database and decoded together while loading
+static const unsigned int WALLET_LOAD_BATCH = 10000;
+
 /** Error statuses for the wallet database */
 enum DBErrors {
     DB_LOAD_OK,